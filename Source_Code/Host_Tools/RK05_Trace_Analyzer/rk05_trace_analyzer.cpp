@@ -0,0 +1,443 @@
+// *********************************************************************************
+// rk05_trace_analyzer.cpp
+//   host tool that reads the controller command trace files written by the emulator
+//   (RK05TRC/Tnnnnnnn.RKT on the microSD card) and prints how the pack was used:
+//   command counts and the read/write ratio, a cylinder heatmap, a cylinder by
+//   sector heatmap, the seek distance histogram and the distribution of the time
+//   between commands. With -c the tables are also written as CSV files.
+//
+//   usage: rk05_trace_analyzer [-c csvprefix] tracefile...
+//
+//   The files are sorted by their sequence number, so a whole directory of rotated
+//   files can be given in any order. See the command trace section of
+//   microsd_file_ops.cpp in the emulator for the file format.
+// *********************************************************************************
+//
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#define TRACE_HEADER_SIZE 64
+#define TRACE_RECORD_SIZE 8
+#define TRACE_VERSION 1
+
+// record opcodes, the same as in emulator_events.h
+#define EVENT_SEEK 0
+#define EVENT_READ 1
+#define EVENT_WRITE 2
+#define EVENT_ERROR 3
+#define EVENT_RESTORE 4
+#define EVENT_LOST 5
+#define EVENT_KINDS 6
+
+#define MAX_CYLINDERS 256
+#define MAX_SECTORS 32
+#define HEATMAP_ROWS 41
+#define BAR_WIDTH 50
+#define LOG2_BUCKETS 28  // inter-arrival buckets, the last one is 2^27 us (134 s) and up
+#define SEEK_BUCKETS 9   // 0, 1, 2-3, 4-7 ... 128-255
+#define SESSION_GAP_US 10000000 // a file that starts this far from the end of the one before is a new load
+
+struct Trace_File {
+    std::string name;
+    uint32_t sequence;
+    uint32_t starttime;
+    int cylinders;
+    int heads;
+    int sectors;
+    std::string imagename;
+    std::vector<uint8_t> records;
+};
+
+struct Trace_Stats {
+    uint64_t events[EVENT_KINDS];
+    uint64_t lost;
+    uint64_t reads[MAX_CYLINDERS][MAX_SECTORS];
+    uint64_t writes[MAX_CYLINDERS][MAX_SECTORS];
+    uint64_t seeks[MAX_CYLINDERS];
+    uint64_t seekdistance[SEEK_BUCKETS];
+    uint64_t restoredistance;   // cylinders moved by restores
+    std::vector<uint32_t> interarrival;
+    uint64_t elapsed_us;
+    int sessions;       // pack loads covered by the files
+    int cylinders;
+    int sectors;
+};
+
+static const char* event_names[EVENT_KINDS] = {"seek", "read", "write", "error", "restore", "lost"};
+
+static uint32_t get_le32(const uint8_t* bp)
+{
+    return(bp[0] | (bp[1] << 8) | (bp[2] << 16) | ((uint32_t)bp[3] << 24));
+}
+
+static bool read_trace_file(const char* name, Trace_File* tf)
+{
+    FILE* f = fopen(name, "rb");
+    if (f == NULL){
+        fprintf(stderr, "###ERROR, could not open '%s'\n", name);
+        return(false);
+    }
+    uint8_t header[TRACE_HEADER_SIZE];
+    if ((fread(header, 1, TRACE_HEADER_SIZE, f) != TRACE_HEADER_SIZE) || (memcmp(header, "RK05TRC\x1A", 8) != 0)){
+        fprintf(stderr, "###ERROR, '%s' is not an RK05 trace file\n", name);
+        fclose(f);
+        return(false);
+    }
+    int version = header[8] | (header[9] << 8);
+    int recordsize = header[10] | (header[11] << 8);
+    if ((version != TRACE_VERSION) || (recordsize != TRACE_RECORD_SIZE)){
+        fprintf(stderr, "###ERROR, '%s' is trace format version %d with %d-byte records, expected version %d\n", name,
+            version, recordsize, TRACE_VERSION);
+        fclose(f);
+        return(false);
+    }
+    tf->name = name;
+    tf->cylinders = header[12] | (header[13] << 8);
+    tf->heads = header[14];
+    tf->sectors = header[15];
+    tf->sequence = get_le32(&header[16]);
+    tf->starttime = get_le32(&header[20]);
+    char imagename[TRACE_HEADER_SIZE - 24 + 1];
+    memcpy(imagename, &header[24], TRACE_HEADER_SIZE - 24);
+    imagename[TRACE_HEADER_SIZE - 24] = '\0';
+    tf->imagename = imagename;
+
+    uint8_t buf[64 * 1024];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        tf->records.insert(tf->records.end(), buf, buf + n);
+    fclose(f);
+    if ((tf->records.size() % TRACE_RECORD_SIZE) != 0){
+        // the emulator lost power in the middle of a write
+        fprintf(stderr, "  '%s' ends with a partial record, ignored\n", name);
+        tf->records.resize(tf->records.size() - (tf->records.size() % TRACE_RECORD_SIZE));
+    }
+    return(true);
+}
+
+static int log2_bucket(uint64_t value, int buckets)
+{
+    int bucket = 0;
+    while ((value > 1) && (bucket < (buckets - 1))){
+        value >>= 1;
+        bucket++;
+    }
+    return(bucket);
+}
+
+static void analyze(const std::vector<Trace_File>& files, Trace_Stats* st)
+{
+    bool havetime = false;
+    uint32_t lasttime = 0;
+    uint32_t lastsequence = 0;
+    int cylinder = -1; // current head position, unknown until the first command
+
+    for (const Trace_File& tf : files){
+        // A file started when the last one filled up carries on from it. Any other file is from a later load
+        // of the pack, so the time since the last command and the head position aren't known.
+        if (havetime && ((tf.sequence != (lastsequence + 1)) || (abs((int32_t)(tf.starttime - lasttime)) > SESSION_GAP_US))){
+            havetime = false;
+            cylinder = -1;
+            st->sessions++;
+        }
+        lastsequence = tf.sequence;
+        for (size_t i = 0; i < tf.records.size(); i += TRACE_RECORD_SIZE){
+            const uint8_t* rp = &tf.records[i];
+            uint32_t time_us = get_le32(rp);
+            int opcode = rp[4];
+            int c = rp[5];
+            int s = rp[7];
+            if (opcode >= EVENT_KINDS)
+                opcode = EVENT_ERROR;
+            if (opcode == EVENT_LOST){
+                st->lost += rp[5] | (rp[6] << 8) | (rp[7] << 16);
+                st->events[EVENT_LOST]++;
+                continue;
+            }
+            st->events[opcode]++;
+            // the times are time_us_32() values, so the difference is right across a wrap
+            if (havetime){
+                uint32_t delta = time_us - lasttime;
+                st->interarrival.push_back(delta);
+                st->elapsed_us += delta;
+            }
+            lasttime = time_us;
+            havetime = true;
+            switch (opcode){
+                case EVENT_SEEK:
+                    if (cylinder >= 0)
+                        st->seekdistance[(c == cylinder) ? 0 : 1 + log2_bucket(abs(c - cylinder), SEEK_BUCKETS - 1)]++;
+                    st->seeks[c]++;
+                    cylinder = c;
+                    break;
+                case EVENT_RESTORE:
+                    if (cylinder > 0)
+                        st->restoredistance += cylinder;
+                    cylinder = 0;
+                    break;
+                case EVENT_READ:
+                case EVENT_WRITE:
+                    if (s < MAX_SECTORS){
+                        if (opcode == EVENT_READ)
+                            st->reads[c][s]++;
+                        else
+                            st->writes[c][s]++;
+                    }
+                    cylinder = c;
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+}
+
+static void print_bar(uint64_t value, uint64_t maxvalue)
+{
+    int n = (maxvalue > 0) ? (int)((value * BAR_WIDTH + maxvalue - 1) / maxvalue) : 0;
+    for (int i = 0; i < n; i++)
+        putchar('#');
+    putchar('\n');
+}
+
+static void print_summary(const std::vector<Trace_File>& files, const Trace_Stats* st)
+{
+    printf("trace of '%s', %d cylinders, %d heads, %d sectors, %d files from sequence %u to %u\n",
+        files[0].imagename.c_str(), files[0].cylinders, files[0].heads, files[0].sectors, (int)files.size(),
+        files.front().sequence, files.back().sequence);
+    uint64_t commands = st->events[EVENT_SEEK] + st->events[EVENT_READ] + st->events[EVENT_WRITE] + st->events[EVENT_ERROR]
+        + st->events[EVENT_RESTORE];
+    double seconds = st->elapsed_us / 1e6;
+    printf("  %llu commands in %.1f seconds of %d pack load%s", (unsigned long long)commands, seconds, st->sessions,
+        (st->sessions == 1) ? "" : "s");
+    if (seconds > 0)
+        printf(", %.1f per second", commands / seconds);
+    printf("\n");
+    for (int i = 0; i < EVENT_KINDS; i++){
+        if (i != EVENT_LOST)
+            printf("  %-8s %llu\n", event_names[i], (unsigned long long)st->events[i]);
+    }
+    if (st->lost > 0)
+        printf("  ###WARNING, %llu events were lost by the emulator, in %llu gaps\n", (unsigned long long)st->lost,
+            (unsigned long long)st->events[EVENT_LOST]);
+    if (st->events[EVENT_WRITE] > 0)
+        printf("  read/write ratio %.2f\n", (double)st->events[EVENT_READ] / (double)st->events[EVENT_WRITE]);
+    else
+        printf("  read/write ratio: no writes\n");
+    if ((st->events[EVENT_READ] + st->events[EVENT_WRITE]) > 0)
+        printf("  reads are %.1f%% of the sector accesses\n",
+            100.0 * st->events[EVENT_READ] / (double)(st->events[EVENT_READ] + st->events[EVENT_WRITE]));
+}
+
+static void print_cylinder_heatmap(const Trace_Stats* st)
+{
+    int cylsperrow = (st->cylinders + HEATMAP_ROWS - 1) / HEATMAP_ROWS;
+    std::vector<uint64_t> rowreads, rowwrites;
+    uint64_t maxvalue = 0;
+    for (int first = 0; first < st->cylinders; first += cylsperrow){
+        uint64_t r = 0, w = 0;
+        for (int c = first; (c < first + cylsperrow) && (c < st->cylinders); c++){
+            for (int s = 0; s < MAX_SECTORS; s++){
+                r += st->reads[c][s];
+                w += st->writes[c][s];
+            }
+        }
+        rowreads.push_back(r);
+        rowwrites.push_back(w);
+        maxvalue = std::max(maxvalue, r + w);
+    }
+    printf("\ncylinder heatmap, sector reads and writes, %d cylinders per row\n", cylsperrow);
+    printf("  cylinders      reads     writes\n");
+    for (size_t row = 0; row < rowreads.size(); row++){
+        int first = (int)row * cylsperrow;
+        int last = std::min(first + cylsperrow, st->cylinders) - 1;
+        printf("  %3d-%3d  %10llu %10llu  ", first, last, (unsigned long long)rowreads[row], (unsigned long long)rowwrites[row]);
+        print_bar(rowreads[row] + rowwrites[row], maxvalue);
+    }
+}
+
+// cylinders down, sectors across, the darker the character the more accesses
+static void print_sector_heatmap(const Trace_Stats* st)
+{
+    static const char shades[] = " .:-=+*#%@";
+    int cylsperrow = (st->cylinders + HEATMAP_ROWS - 1) / HEATMAP_ROWS;
+    int nshades = (int)strlen(shades);
+    std::vector<std::vector<uint64_t>> cells;
+    uint64_t maxvalue = 0;
+    for (int first = 0; first < st->cylinders; first += cylsperrow){
+        std::vector<uint64_t> row(st->sectors, 0);
+        for (int c = first; (c < first + cylsperrow) && (c < st->cylinders); c++){
+            for (int s = 0; s < st->sectors; s++)
+                row[s] += st->reads[c][s] + st->writes[c][s];
+        }
+        for (uint64_t v : row)
+            maxvalue = std::max(maxvalue, v);
+        cells.push_back(row);
+    }
+    printf("\ncylinder by sector heatmap, '%s' from none to %llu accesses\n", shades, (unsigned long long)maxvalue);
+    printf("  cylinders  sector 0 ->\n");
+    for (size_t row = 0; row < cells.size(); row++){
+        printf("  %3d-%3d   ", (int)row * cylsperrow, std::min(((int)row + 1) * cylsperrow, st->cylinders) - 1);
+        for (uint64_t v : cells[row]){
+            int shade = 0;
+            if ((v > 0) && (maxvalue > 0))
+                shade = 1 + (int)((v * (nshades - 2)) / maxvalue);
+            putchar(shades[shade]);
+        }
+        putchar('\n');
+    }
+}
+
+static void seek_bucket_name(int bucket, char* name, size_t len)
+{
+    if (bucket == 0)
+        snprintf(name, len, "0");
+    else if (bucket == 1)
+        snprintf(name, len, "1");
+    else
+        snprintf(name, len, "%d-%d", 1 << (bucket - 1), (1 << bucket) - 1);
+}
+
+static void print_seek_histogram(const Trace_Stats* st)
+{
+    uint64_t total = 0, maxvalue = 0;
+    for (int i = 0; i < SEEK_BUCKETS; i++){
+        total += st->seekdistance[i];
+        maxvalue = std::max(maxvalue, st->seekdistance[i]);
+    }
+    printf("\nseek distance histogram, %llu seeks", (unsigned long long)total);
+    if (st->events[EVENT_RESTORE] > 0)
+        printf(" (and %llu restores moving %llu cylinders)", (unsigned long long)st->events[EVENT_RESTORE],
+            (unsigned long long)st->restoredistance);
+    printf("\n  cylinders      seeks\n");
+    for (int i = 0; i < SEEK_BUCKETS; i++){
+        char name[16];
+        seek_bucket_name(i, name, sizeof(name));
+        printf("  %-9s %10llu  ", name, (unsigned long long)st->seekdistance[i]);
+        print_bar(st->seekdistance[i], maxvalue);
+    }
+}
+
+static void print_interarrival(const Trace_Stats* st)
+{
+    if (st->interarrival.empty())
+        return;
+    uint64_t buckets[LOG2_BUCKETS] = {0};
+    uint64_t maxvalue = 0;
+    for (uint32_t delta : st->interarrival)
+        buckets[log2_bucket(delta, LOG2_BUCKETS)]++;
+    for (int i = 0; i < LOG2_BUCKETS; i++)
+        maxvalue = std::max(maxvalue, buckets[i]);
+    std::vector<uint32_t> sorted = st->interarrival;
+    std::sort(sorted.begin(), sorted.end());
+    printf("\ntime between commands, median %u us, 90%% %u us, 99%% %u us, longest %u us\n", sorted[sorted.size() / 2],
+        sorted[(sorted.size() * 90) / 100], sorted[(sorted.size() * 99) / 100], sorted.back());
+    printf("  microseconds     commands\n");
+    int first = 0, last = LOG2_BUCKETS - 1;
+    while ((first < last) && (buckets[first] == 0))
+        first++;
+    while ((last > first) && (buckets[last] == 0))
+        last--;
+    for (int i = first; i <= last; i++){
+        printf("  %10llu+ %10llu  ", (i == 0) ? 0ULL : (1ULL << i), (unsigned long long)buckets[i]);
+        print_bar(buckets[i], maxvalue);
+    }
+}
+
+static bool write_csv(const std::string& prefix, const Trace_Stats* st)
+{
+    std::string name = prefix + "_cylinders.csv";
+    FILE* f = fopen(name.c_str(), "w");
+    if (f == NULL)
+        return(false);
+    fprintf(f, "cylinder,seeks,reads,writes\n");
+    for (int c = 0; c < st->cylinders; c++){
+        uint64_t r = 0, w = 0;
+        for (int s = 0; s < MAX_SECTORS; s++){
+            r += st->reads[c][s];
+            w += st->writes[c][s];
+        }
+        fprintf(f, "%d,%llu,%llu,%llu\n", c, (unsigned long long)st->seeks[c], (unsigned long long)r, (unsigned long long)w);
+    }
+    fclose(f);
+
+    name = prefix + "_sectors.csv";
+    if ((f = fopen(name.c_str(), "w")) == NULL)
+        return(false);
+    fprintf(f, "cylinder,sector,reads,writes\n");
+    for (int c = 0; c < st->cylinders; c++){
+        for (int s = 0; s < st->sectors; s++)
+            fprintf(f, "%d,%d,%llu,%llu\n", c, s, (unsigned long long)st->reads[c][s], (unsigned long long)st->writes[c][s]);
+    }
+    fclose(f);
+
+    name = prefix + "_seeks.csv";
+    if ((f = fopen(name.c_str(), "w")) == NULL)
+        return(false);
+    fprintf(f, "distance,seeks\n");
+    for (int i = 0; i < SEEK_BUCKETS; i++){
+        char bucketname[16];
+        seek_bucket_name(i, bucketname, sizeof(bucketname));
+        fprintf(f, "%s,%llu\n", bucketname, (unsigned long long)st->seekdistance[i]);
+    }
+    fclose(f);
+
+    name = prefix + "_interarrival.csv";
+    if ((f = fopen(name.c_str(), "w")) == NULL)
+        return(false);
+    uint64_t buckets[LOG2_BUCKETS] = {0};
+    for (uint32_t delta : st->interarrival)
+        buckets[log2_bucket(delta, LOG2_BUCKETS)]++;
+    fprintf(f, "from_us,commands\n");
+    for (int i = 0; i < LOG2_BUCKETS; i++)
+        fprintf(f, "%llu,%llu\n", (i == 0) ? 0ULL : (1ULL << i), (unsigned long long)buckets[i]);
+    fclose(f);
+    return(true);
+}
+
+int main(int argc, char* argv[])
+{
+    std::string csvprefix;
+    std::vector<Trace_File> files;
+
+    for (int i = 1; i < argc; i++){
+        if ((strcmp(argv[i], "-c") == 0) && ((i + 1) < argc))
+            csvprefix = argv[++i];
+        else if (argv[i][0] == '-'){
+            fprintf(stderr, "usage: rk05_trace_analyzer [-c csvprefix] tracefile...\n");
+            return(1);
+        }
+        else{
+            Trace_File tf;
+            if (!read_trace_file(argv[i], &tf))
+                return(1);
+            files.push_back(tf);
+        }
+    }
+    if (files.empty()){
+        fprintf(stderr, "usage: rk05_trace_analyzer [-c csvprefix] tracefile...\n");
+        return(1);
+    }
+    std::sort(files.begin(), files.end(), [](const Trace_File& a, const Trace_File& b){ return(a.sequence < b.sequence); });
+
+    static Trace_Stats st;
+    st.cylinders = std::min(std::max(files[0].cylinders, 1), MAX_CYLINDERS);
+    st.sectors = std::min(std::max(files[0].sectors, 1), MAX_SECTORS);
+    st.sessions = 1;
+    analyze(files, &st);
+    print_summary(files, &st);
+    print_cylinder_heatmap(&st);
+    print_sector_heatmap(&st);
+    print_seek_histogram(&st);
+    print_interarrival(&st);
+    if (!csvprefix.empty() && !write_csv(csvprefix, &st)){
+        fprintf(stderr, "###ERROR, could not write the CSV files '%s_*.csv'\n", csvprefix.c_str());
+        return(1);
+    }
+    return(0);
+}
@@ -43,7 +43,7 @@
 //#include "display_big_images.h"
 #include "disk_state_definitions.h"
 #include "display_functions.h"
-//#include "microsd_file_ops.h"
+#include "microsd_file_ops.h"
 
 #include "emulator_state_definitions.h"
 #include "emulator_state.h"
@@ -51,6 +51,7 @@
 #include "display_functions.h"
 #include "display_timers.h"
 #include "emulator_command.h"
+#include "emulator_events.h"
 
 // GLOBAL VARIABLES
 struct Disk_State edisk;
@@ -76,30 +77,6 @@ void callback(void *ptr){
     *i = getchar_timeout_us(100); // length of timeout does not affect results
 }
 
-void gpio_callback(uint gpio, uint32_t events) {
-    int readval = read_int_inputs();
-    int operation_id = (readval >> 10) & 0x3;
-    if((gpio == 4) && ((events & 0x8) == 0x8)){
-        switch(operation_id){
-            case 0:
-                if((readval & 0x400000) == 0)
-                    printf("*SEEK RESTORE\r\n");
-                else
-                    printf("*SEEK %d\r\n", readval & 0xff);
-                break;
-            case 1:
-                printf("*READ c=%d h=%d s=%d\r\n", readval & 0xff, (readval >> 8) & 1, (readval >> 12) & 0xf);
-                break;
-            case 2:
-                printf("*WRITE c=%d h=%d s=%d\r\n", readval & 0xff, (readval >> 8) & 1, (readval >> 12) & 0xf);
-                break;
-            default:
-                printf("*ERROR, operation_id=%d\r\n", operation_id);
-                break;
-        }
-    }
-}
-
 void read_switches_and_set_drive_address(){
     int switch_read_value = read_drive_address_switches();
     edisk.Drive_Address = switch_read_value & DRIVE_ADDRESS_BITS_I2C;
@@ -267,15 +244,25 @@ int main() {
                 }
             }
             manage_display_timers(&edisk);
+            event_log_drain(); // print the command events recorded by the interrupt
             if(char_from_callback != 0){
                 // if the key was L or l then begin logging events
                 if((char_from_callback == 'L') || (char_from_callback == 'l')){
                     printf("  Begin logging events\r\n");
-                    gpio_set_irq_enabled_with_callback(4, GPIO_IRQ_EDGE_RISE, true, &gpio_callback); // gpio callback
+                    set_event_logging(true); // command events are always tracked while loaded, this only turns on the event ring
                 }
                 else if((char_from_callback == 'S') || (char_from_callback == 's')){
-                    printf("  Stop logging events\r\n");
-                    gpio_set_irq_enabled_with_callback(4, GPIO_IRQ_EDGE_RISE, false, &gpio_callback); // gpio callback
+                    event_log_drain(); // print the records still in the ring before logging is turned off
+                    set_event_logging(false);
+                    printf("  Stop logging events, %u dropped since power on\r\n", (unsigned)event_ring_dropped());
+                }
+                // T prints the microSD telemetry from the last load and unload
+                else if((char_from_callback == 'T') || (char_from_callback == 't')){
+                    card_telemetry(false);
+                }
+                // R prints the state of the command trace
+                else if((char_from_callback == 'R') || (char_from_callback == 'r')){
+                    trace_status();
                 }
                 char_from_callback = 0; //reset the value
             }
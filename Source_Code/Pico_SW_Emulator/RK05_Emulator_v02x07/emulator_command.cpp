@@ -410,7 +410,7 @@ void door_test(){
 
 void card_directory(){
     printf("  Card Directory test.\r\n");
-    printf("  card_directory() not yet implemented\r\n");
+    catalog_list();
 }
 
 void vsense_test(){
@@ -422,6 +422,7 @@ void ramtest(int start_address, int num_bytes){
     int prbs_reg;
     int bytecount, i;
     int byte_errors;
+    uint8_t readback[256];
 
     byte_errors = 0;
     prbs_reg = 0x12345678; // initialize PRBS register starting seed value
@@ -439,7 +440,9 @@ void ramtest(int start_address, int num_bytes){
     load_ram_address(start_address);
     for(bytecount = 0; bytecount < num_bytes; bytecount++){
         shift_prbs31(&prbs_reg); // shift 1 time
-        int tempval = readbyte();
+        if((bytecount % sizeof(readback)) == 0) // read back a block at a time with the burst transfer
+            readbytes(readback, ((num_bytes - bytecount) > (int)sizeof(readback)) ? (int)sizeof(readback) : (num_bytes - bytecount));
+        int tempval = readback[bytecount % sizeof(readback)];
         if(tempval != (prbs_reg & 0xff)){
             printf("Error, address = %x, ideal = %x, readback = %x\r\n", start_address + bytecount, prbs_reg & 0xff, tempval);
             byte_errors++;
@@ -460,7 +463,9 @@ void ramtest(int start_address, int num_bytes){
     load_ram_address(start_address);
     for(bytecount = 0; bytecount < num_bytes; bytecount++){
         shift_prbs31(&prbs_reg); // shift 1 time
-        int tempval = readbyte();
+        if((bytecount % sizeof(readback)) == 0)
+            readbytes(readback, ((num_bytes - bytecount) > (int)sizeof(readback)) ? (int)sizeof(readback) : (num_bytes - bytecount));
+        int tempval = readback[bytecount % sizeof(readback)];
         if(tempval != (~prbs_reg & 0xff)){
             printf("Error, address = %x, ideal = %x, readback = %x\r\n", start_address + bytecount, ~prbs_reg & 0xff, tempval);
             byte_errors++;
@@ -528,6 +533,35 @@ void command_parse_and_dispatch (Disk_State* dstate)
             card_directory();
         }
     }
+    else if((strcmp((char *) "CACHE", extract_argv[0])==0) || (strcmp((char *) "C", extract_argv[0])==0)){
+        if((extract_argc == 2) && (strcmp((char *) "RESET", extract_argv[1])==0))
+            card_cache_stats(true);
+        else if(extract_argc != 1)
+            printf("### ERROR, %d fields entered, should be 1 field or CACHE RESET\r\n", extract_argc);
+        else{
+            card_cache_stats(false);
+        }
+    }
+    else if((strcmp((char *) "SHADOW", extract_argv[0])==0) || (strcmp((char *) "SH", extract_argv[0])==0)){
+        if((extract_argc == 2) && (strcmp((char *) "RESET", extract_argv[1])==0))
+            shadow_registers_report(true);
+        else if(extract_argc != 1)
+            printf("### ERROR, %d fields entered, should be 1 field or SHADOW RESET\r\n", extract_argc);
+        else{
+            shadow_registers_report(false);
+        }
+    }
+    else if((strcmp((char *) "SDSTATS", extract_argv[0])==0) || (strcmp((char *) "SD", extract_argv[0])==0)){
+        if((extract_argc == 2) && (strcmp((char *) "RESET", extract_argv[1])==0))
+            card_telemetry(true);
+        else if((extract_argc == 2) && (strcmp((char *) "LOG", extract_argv[1])==0))
+            card_telemetry_log_start();
+        else if(extract_argc != 1)
+            printf("### ERROR, %d fields entered, should be 1 field or SDSTATS RESET or SDSTATS LOG\r\n", extract_argc);
+        else{
+            card_telemetry(false);
+        }
+    }
     else if((strcmp((char *) "VSENSE", extract_argv[0])==0) || (strcmp((char *) "DCLOW", extract_argv[0])==0) || (strcmp((char *) "V", extract_argv[0])==0)){
         if(extract_argc != 1)
             printf("### ERROR, %d fields entered, should be 1 field\r\n", extract_argc);
@@ -555,6 +589,7 @@ void command_parse_and_dispatch (Disk_State* dstate)
             printf("  SCANINPUTS, SCANI, I\r\n  SCANOUTPUTS, SCANO, O\r\n");
             printf("  ADDRESS, ADDR, A\r\n  ROCKER, ROCK, R\r\n  LEDTEST, LED, L\r\n");
             printf("  DOORTEST, DOOR, M\r\n  DIRECTORY, DIR, D\r\n  VSENSE, DCLOW, V\r\n");
+            printf("  CACHE, C [RESET]\r\n  SDSTATS, SD [RESET | LOG]\r\n  SHADOW, SH [RESET]\r\n");
             printf("  RAMTEST, MEMTEST <hex start address> <hex number of bytes>\r\n");
         }
     }
@@ -0,0 +1,263 @@
+// *********************************************************************************
+// emulator_events.cpp
+//   controller command events: write tracking and event logging
+//
+//   The FPGA raises CMD_INTERRUPT (GPIO4) on every seek, read and write command
+//   from the controller while the drive is ready. Every write marks its sector in
+//   the dirty map so the unload only has to save the sectors that changed. If a
+//   command can't be decoded the whole pack is marked dirty so nothing is lost.
+//   The GPIO interrupt only latches one rising edge, so two commands that arrive
+//   while interrupts are masked are serviced as one and a write could be missed.
+//   A PIO state machine counts every rising edge of CMD_INTERRUPT, and if it saw
+//   more edges than the interrupt serviced the dirty map can't be trusted and the
+//   whole pack is marked dirty when command events are disabled.
+//   When logging is turned on from the console or the command trace is running the
+//   interrupt also pushes a compact record of each event into a ring, and the main
+//   loop drains the ring, prints the records and passes them to the trace. Nothing
+//   is printed from the interrupt. The ring has a single
+//   producer, the interrupt, and a single consumer, the main loop, so no lock is
+//   needed. If the ring is full the event is counted as dropped.
+// *********************************************************************************
+// 
+#include <stdio.h>
+#include "pico/stdlib.h"
+#include "hardware/gpio.h"
+#include "hardware/sync.h"
+#include "hardware/pio.h"
+#include <string.h>
+
+#include "disk_state_definitions.h"
+#include "emulator_hardware.h"
+#include "emulator_events.h"
+#include "microsd_file_ops.h"
+#include "emulator_events.pio.h"
+
+#define CMD_INTERRUPT 4
+
+static volatile uint32_t dirty_map[TRACK_MAX_CYLINDERS * TRACK_MAX_HEADS];
+static volatile bool dirty_all;
+static volatile int dirty_count;
+static volatile bool log_events = false;
+static volatile bool trace_events = false;
+static volatile uint32_t events_serviced;   // rising edges handled by the interrupt
+static PIO edge_pio = pio1;
+static int edge_sm = -1;
+static uint edge_offset;
+static bool edge_counting = false;          // the edge counter is running
+
+#define EVENT_RING_SIZE 256 // records, must be a power of 2
+static Event_Record event_ring[EVENT_RING_SIZE];
+static volatile uint32_t event_ring_head;   // next record to fill, written only by the interrupt
+static volatile uint32_t event_ring_tail;   // next record to empty, written only by the main loop
+static volatile uint32_t events_dropped;    // events lost because the ring was full
+static uint32_t events_dropped_reported;
+
+void dirty_map_clear()
+{
+    for (int i = 0; i < (TRACK_MAX_CYLINDERS * TRACK_MAX_HEADS); i++)
+        dirty_map[i] = 0;
+    dirty_count = 0;
+    dirty_all = false;
+}
+
+void dirty_mark(int cylinder, int head, int sector)
+{
+    if ((cylinder >= TRACK_MAX_CYLINDERS) || (head >= TRACK_MAX_HEADS) || (sector >= TRACK_MAX_SECTORS)){
+        dirty_all = true;
+        return;
+    }
+    int track = (cylinder * TRACK_MAX_HEADS) + head;
+    uint32_t bit = 1u << sector;
+    if ((dirty_map[track] & bit) == 0){
+        dirty_map[track] |= bit;
+        dirty_count++;
+    }
+}
+
+void dirty_mark_all()
+{
+    dirty_all = true;
+}
+
+bool dirty_is_marked(int cylinder, int head, int sector)
+{
+    if (dirty_all)
+        return(true);
+    return((dirty_map[(cylinder * TRACK_MAX_HEADS) + head] & (1u << sector)) != 0);
+}
+
+bool dirty_all_marked()
+{
+    return(dirty_all);
+}
+
+int dirty_sector_count()
+{
+    return(dirty_count);
+}
+
+// *************** event ring ***************
+//
+// push one record for the main loop, called only from the command event interrupt
+static void event_push(uint32_t time_us, int opcode, int cylinder, int head, int sector)
+{
+    uint32_t h = event_ring_head;
+    if ((h - event_ring_tail) >= EVENT_RING_SIZE){
+        events_dropped = events_dropped + 1;
+        return;
+    }
+    Event_Record* rec = &event_ring[h & (EVENT_RING_SIZE - 1)];
+    rec->time_us = time_us;
+    rec->opcode = opcode;
+    rec->cylinder = cylinder;
+    rec->head = head;
+    rec->sector = sector;
+    __dmb(); // the record must be visible before the head index moves
+    event_ring_head = h + 1;
+}
+
+// take the oldest record off the ring, returns false if the ring is empty
+bool event_ring_pop(Event_Record* rec)
+{
+    uint32_t t = event_ring_tail;
+    if (t == event_ring_head)
+        return(false);
+    __dmb(); // read the record only after seeing the head index move
+    *rec = event_ring[t & (EVENT_RING_SIZE - 1)];
+    __dmb(); // finished with the record before handing it back
+    event_ring_tail = t + 1;
+    return(true);
+}
+
+uint32_t event_ring_dropped()
+{
+    return(events_dropped);
+}
+
+static void print_event(const Event_Record* rec)
+{
+    switch(rec->opcode){
+        case EVENT_RESTORE:
+            printf("*SEEK RESTORE t=%u\r\n", (unsigned)rec->time_us);
+            break;
+        case EVENT_SEEK:
+            printf("*SEEK %d t=%u\r\n", rec->cylinder, (unsigned)rec->time_us);
+            break;
+        case EVENT_READ:
+            printf("*READ c=%d h=%d s=%d t=%u\r\n", rec->cylinder, rec->head, rec->sector, (unsigned)rec->time_us);
+            break;
+        case EVENT_WRITE:
+            printf("*WRITE c=%d h=%d s=%d t=%u\r\n", rec->cylinder, rec->head, rec->sector, (unsigned)rec->time_us);
+            break;
+        default:
+            printf("*ERROR, operation_id=%d t=%u\r\n", rec->opcode, (unsigned)rec->time_us);
+            break;
+    }
+}
+
+// called from the main loop, prints and traces the events recorded since the last call
+void event_log_drain()
+{
+    Event_Record rec;
+    while (event_ring_pop(&rec)){
+        if (log_events)
+            print_event(&rec);
+        if (trace_events)
+            trace_record(&rec);
+    }
+    uint32_t dropped = events_dropped;
+    if (dropped != events_dropped_reported){
+        printf("###ERROR, %u events dropped, the event ring was full\r\n", (unsigned)(dropped - events_dropped_reported));
+        events_dropped_reported = dropped;
+    }
+}
+
+// *************** command edge counter ***************
+//
+// start counting rising edges of CMD_INTERRUPT from zero
+static void edge_counter_start()
+{
+    if (edge_sm < 0){
+        edge_sm = pio_claim_unused_sm(edge_pio, true);
+        edge_offset = pio_add_program(edge_pio, &command_edge_count_program);
+    }
+    pio_sm_config c = command_edge_count_program_get_default_config(edge_offset);
+    sm_config_set_in_pins(&c, CMD_INTERRUPT);
+    pio_sm_init(edge_pio, edge_sm, edge_offset, &c);
+    pio_sm_exec(edge_pio, edge_sm, pio_encode_set(pio_x, 0));
+    pio_sm_set_enabled(edge_pio, edge_sm, true);
+    edge_counting = true;
+}
+
+// stop counting and return the number of rising edges seen, only called while the counter is running
+static uint32_t edge_counter_stop()
+{
+    edge_counting = false;
+    pio_sm_set_enabled(edge_pio, edge_sm, false);
+    pio_sm_exec(edge_pio, edge_sm, pio_encode_mov(pio_isr, pio_x));
+    pio_sm_exec(edge_pio, edge_sm, pio_encode_push(false, false));
+    return(0u - pio_sm_get(edge_pio, edge_sm));
+}
+
+static void gpio_callback(uint gpio, uint32_t events) {
+    if((gpio != CMD_INTERRUPT) || ((events & GPIO_IRQ_EDGE_RISE) == 0))
+        return;
+    uint32_t now = time_us_32();
+    events_serviced = events_serviced + 1;
+    int readval = read_int_inputs();
+    int operation_id = (readval >> 10) & 0x3;
+    int cylinder = readval & 0xff;
+    int head = (readval >> 8) & 1;
+    int sector = ((readval >> 12) & 0xf) | ((readval >> 20) & 0x10); // sector bit 4 is in bit 24 of readval
+    int opcode = operation_id;
+    switch(operation_id){
+        case 0:
+            if((readval & 0x400000) == 0)
+                opcode = EVENT_RESTORE;
+            break;
+        case 1:
+            break;
+        case 2:
+            dirty_mark(cylinder, head, sector);
+            break;
+        default:
+            dirty_mark_all();
+            break;
+    }
+    if(log_events || trace_events)
+        event_push(now, opcode, cylinder, head, sector);
+}
+
+// command events are enabled while the pack is loaded and the FPGA SPI port is not used for transfers
+// The edge counter starts before the interrupt is enabled and stops after it is disabled, so it can only
+// count more edges than the interrupt, never fewer. Disabling twice is harmless, the second call finds the counter
+// stopped and doesn't compare a stale count.
+void enable_command_events()
+{
+    events_serviced = 0;
+    edge_counter_start();
+    gpio_set_irq_enabled_with_callback(CMD_INTERRUPT, GPIO_IRQ_EDGE_RISE, true, &gpio_callback);
+}
+
+void disable_command_events()
+{
+    gpio_set_irq_enabled_with_callback(CMD_INTERRUPT, GPIO_IRQ_EDGE_RISE, false, &gpio_callback);
+    if (!edge_counting)
+        return;
+    uint32_t edges = edge_counter_stop();
+    if (edges != events_serviced){
+        printf("###ERROR, %u of %u command interrupts were missed, the whole image will be saved\r\n",
+            (unsigned)(edges - events_serviced), (unsigned)edges);
+        dirty_mark_all();
+    }
+}
+
+void set_event_logging(bool enable)
+{
+    log_events = enable;
+}
+
+void set_event_trace(bool enable)
+{
+    trace_events = enable;
+}
@@ -0,0 +1,42 @@
+// *********************************************************************************
+// emulator_events.h
+//   header for controller command events: write tracking and event logging
+// *********************************************************************************
+// 
+
+// largest geometry covered by the write tracking map, one 32-bit word per track
+#define TRACK_MAX_CYLINDERS 203
+#define TRACK_MAX_HEADS 2
+#define TRACK_MAX_SECTORS 32
+
+// event record opcodes, seek, read, write and error are the FPGA operation ID
+#define EVENT_SEEK 0
+#define EVENT_READ 1
+#define EVENT_WRITE 2
+#define EVENT_ERROR 3
+#define EVENT_RESTORE 4
+#define EVENT_LOST 5        // trace files only, see microsd_file_ops.cpp
+
+// one controller command event, 8 bytes
+struct Event_Record {
+    uint32_t time_us;   // time_us_32() when the interrupt was taken
+    uint8_t opcode;
+    uint8_t cylinder;
+    uint8_t head;
+    uint8_t sector;
+};
+
+void enable_command_events();
+void disable_command_events();
+void set_event_logging(bool enable);
+void set_event_trace(bool enable);
+bool event_ring_pop(Event_Record* rec);
+uint32_t event_ring_dropped();
+void event_log_drain();
+
+void dirty_map_clear();
+void dirty_mark(int cylinder, int head, int sector);
+void dirty_mark_all();
+bool dirty_is_marked(int cylinder, int head, int sector);
+bool dirty_all_marked();
+int dirty_sector_count();
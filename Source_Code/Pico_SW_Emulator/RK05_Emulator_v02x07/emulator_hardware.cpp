@@ -11,10 +11,14 @@
 #include "hardware/uart.h"
 #include "pico/binary_info.h"
 #include "hardware/spi.h"
+#include "hardware/dma.h"
+#include "hardware/sync.h"
 
 #include "disk_state_definitions.h"
 #include "display_functions.h"
 #include "emulator_state_definitions.h"
+#include "fpga_batch.h"
+#include "fpga_bus.h"
 
 #include "hardware/gpio.h"
 #include "hardware/pwm.h"
@@ -91,6 +95,7 @@
 #define SPI_STATUS_80 0x80
 #define SPI_CYLADDR_81 0x81
 #define SPI_DRVSTATUS_82 0x82
+#define SPI_SECTADDR_MSB_83 0x83
 #define SPI_DRAMREAD_88 0x88
 #define SPI_FUNCT_ID_89 0x89
 #define SPI_FPGACODE_VER_90 0x90
@@ -141,47 +146,82 @@ static uint servo_chan;
 
 static uint8_t dutyfactortable_fpga[21] = {47, 49, 51, 53, 55, 57, 59, 61, 63, 65, 67, 69, 71, 73, 75, 77, 79, 81, 83, 85, 88};
 
-#ifdef PICO_DEFAULT_SPI_CSN_PIN
-static inline void cs_select()
+// *************** FPGA SPI Registers ***************
+// Interrupts are disabled for each transaction because the command event interrupt also reads FPGA registers
+//
+uint8_t read_write_spi_register(uint8_t reg, uint8_t data)
 {
-    asm volatile("nop \n nop \n nop");
-    gpio_put(PICO_DEFAULT_SPI_CSN_PIN, 0);  // Active low
-    asm volatile("nop \n nop \n nop");
+    uint32_t saved_irq = save_and_disable_interrupts();
+    uint8_t readdata = fpga_bus_transfer(reg, data);
+    restore_interrupts(saved_irq);
+    return(readdata);
 }
 
-static inline void cs_deselect()
+void write_spi_register(uint8_t reg, uint8_t data)
 {
-    asm volatile("nop \n nop \n nop");
-    gpio_put(PICO_DEFAULT_SPI_CSN_PIN, 1);
-    asm volatile("nop \n nop \n nop");
+    uint32_t saved_irq = save_and_disable_interrupts();
+    fpga_bus_transfer(reg, data);
+    restore_interrupts(saved_irq);
 }
-#endif
 
-// *************** FPGA SPI Registers ***************
+// *************** FPGA control register shadow ***************
+// Control register 0 is kept in a shadow copy so changing a bit is a single register write instead of a readback
+// and a write. The shadow is loaded from the readback register by shadow_registers_sync(), called from
+// initialize_fpga() after the FPGA reset. With SHADOW_REGISTER_CHECK set to 1 every update still reads the register
+// back first and reports a shadow that doesn't match.
 //
-uint8_t read_write_spi_register(uint8_t reg, uint8_t data)
+#ifndef SHADOW_REGISTER_CHECK
+#define SHADOW_REGISTER_CHECK 0
+#endif
+
+static uint8_t fpga_ctrl_reg_image;     // register 0, drive address, file ready and fault latch
+static uint32_t shadow_updates;         // control register updates
+static uint32_t shadow_readbacks_saved; // readbacks the shadow made unnecessary
+static uint32_t shadow_mismatches;      // readbacks that didn't match the shadow, check mode only
+
+void shadow_registers_sync()
 {
-    uint8_t out_buf [BUF_LEN], in_buf [BUF_LEN];
-    uint8_t buf[2];
-    out_buf[0] = reg;
-    out_buf[1] = data;
-    cs_select();
-    spi_write_read_blocking (spi_default, out_buf, in_buf, 2);
-    cs_deselect();
-    return(in_buf[1]);
+    fpga_ctrl_reg_image = read_write_spi_register(SPI_READBACK_00_A0, 0);
 }
 
-void write_spi_register(uint8_t reg, uint8_t data)
+// clear then set bits in control register 0 and its shadow with one write
+static void update_control_register(uint8_t clearbits, uint8_t setbits)
 {
-    uint8_t out_buf [BUF_LEN], in_buf [BUF_LEN];
-    uint8_t buf[2];
-    out_buf[0] = reg;
-    out_buf[1] = data;
-    cs_select();
-    spi_write_read_blocking (spi_default, out_buf, in_buf, 2);
-    cs_deselect();
+    uint32_t saved_irq = save_and_disable_interrupts(); // keep the shadow and the register together
+#if SHADOW_REGISTER_CHECK
+    uint8_t readback = read_write_spi_register(SPI_READBACK_00_A0, 0);
+    if(readback != fpga_ctrl_reg_image){
+        shadow_mismatches++;
+        fpga_ctrl_reg_image = readback;
+    }
+#else
+    shadow_readbacks_saved++;
+#endif
+    fpga_ctrl_reg_image = (fpga_ctrl_reg_image & ~clearbits) | setbits;
+    write_spi_register(SPI_CONTROL_0, fpga_ctrl_reg_image);
+    shadow_updates++;
+    restore_interrupts(saved_irq);
+}
+
+void shadow_registers_report(bool reset)
+{
+    printf("  control register updates %lu, SPI transactions saved %lu, shadow mismatches %lu%s\r\n", (unsigned long)shadow_updates,
+        (unsigned long)shadow_readbacks_saved, (unsigned long)shadow_mismatches, SHADOW_REGISTER_CHECK ? " (check mode)" : "");
+    printf("  register 0 = 0x%x\r\n", fpga_ctrl_reg_image);
+    if(reset){
+        shadow_updates = 0;
+        shadow_readbacks_saved = 0;
+        shadow_mismatches = 0;
+        printf("  counters cleared\r\n");
+    }
 }
 
+// queue for register sequences that are sent as one burst, see fpga_batch.cpp.
+// Used only from the main loop, and each function runs it before returning. The command event interrupt has its own
+// batch, intbatch, because it can fire while a main loop function is still queueing into regbatch.
+static Fpga_Batch regbatch;
+static Fpga_Batch intbatch;
+
 void toggle_wp()
 {
     write_spi_register(SPI_COMMAND_4, TOGGLE_WP_BIT);
@@ -190,33 +230,24 @@ void toggle_wp()
 void set_file_ready()
 {
     printf("set_file_ready\r\n");
-    int tempctrlreg = read_write_spi_register(SPI_READBACK_00_A0, 0);
-    tempctrlreg = tempctrlreg | FILE_READY_BIT;
-    write_spi_register(SPI_CONTROL_0, tempctrlreg & 0xff);
+    update_control_register(0, FILE_READY_BIT);
 }
 
 void clear_file_ready()
 {
     //int tempctrlreg;
     printf("clear_file_ready\r\n");
-    int tempctrlreg = read_write_spi_register(SPI_READBACK_00_A0, 0);
-    //tempctrlreg = 0;
-    tempctrlreg = tempctrlreg & ~FILE_READY_BIT;
-    write_spi_register(SPI_CONTROL_0, tempctrlreg & 0xff);
+    update_control_register(FILE_READY_BIT, 0);
 }
 
 void set_fault_latch()
 {
-    int tempctrlreg = read_write_spi_register(SPI_READBACK_00_A0, 0);
-    tempctrlreg = tempctrlreg | FAULT_LATCH_BIT;
-    write_spi_register(SPI_CONTROL_0, tempctrlreg & 0xff);
+    update_control_register(0, FAULT_LATCH_BIT);
 }
 
 void clear_fault_latch()
 {
-    int tempctrlreg = read_write_spi_register(SPI_READBACK_00_A0, 0);
-    tempctrlreg = tempctrlreg & ~FAULT_LATCH_BIT;
-    write_spi_register(SPI_CONTROL_0, tempctrlreg & 0xff);
+    update_control_register(FAULT_LATCH_BIT, 0);
 }
 
 void set_dc_low()
@@ -252,72 +283,79 @@ void enable_interface_test_mode(){
 void assert_outputs(int step_count){
     int walking_one = 1 << (step_count & 0x7);
     if((step_count >= 0) && (step_count <= 7)){
-        write_spi_register(SPI_TEST_REG1_7, walking_one);
-        write_spi_register(SPI_TEST_REG2_8, 0);
-        write_spi_register(SPI_TEST_REG3L_A, 0);
+        fpga_batch_write(&regbatch, SPI_TEST_REG1_7, walking_one);
+        fpga_batch_write(&regbatch, SPI_TEST_REG2_8, 0);
+        fpga_batch_write(&regbatch, SPI_TEST_REG3L_A, 0);
         if(step_count == 6)
             set_dc_low();
         else
             clear_dc_low();
         if((step_count & 1) == 1)
-            write_spi_register(SPI_TEST_REG3H_9, 8);
+            fpga_batch_write(&regbatch, SPI_TEST_REG3H_9, 8);
         else
-            write_spi_register(SPI_TEST_REG3H_9, 0);
+            fpga_batch_write(&regbatch, SPI_TEST_REG3H_9, 0);
     }
     else if((step_count >= 8) && (step_count <= 15)){
-        write_spi_register(SPI_TEST_REG1_7, 0);
-        write_spi_register(SPI_TEST_REG2_8, walking_one);
-        write_spi_register(SPI_TEST_REG3L_A, 0);
+        fpga_batch_write(&regbatch, SPI_TEST_REG1_7, 0);
+        fpga_batch_write(&regbatch, SPI_TEST_REG2_8, walking_one);
+        fpga_batch_write(&regbatch, SPI_TEST_REG3L_A, 0);
         clear_dc_low();
         if((step_count & 1) == 1)
-            write_spi_register(SPI_TEST_REG3H_9, 8);
+            fpga_batch_write(&regbatch, SPI_TEST_REG3H_9, 8);
         else
-            write_spi_register(SPI_TEST_REG3H_9, 0);
+            fpga_batch_write(&regbatch, SPI_TEST_REG3H_9, 0);
     }
     else if((step_count >= 16) && (step_count <= 19)){ // activates the 3 test outputs added to v1 hardware
-        write_spi_register(SPI_TEST_REG1_7, 0);
-        write_spi_register(SPI_TEST_REG2_8, 0);
-        write_spi_register(SPI_TEST_REG3L_A, 0);
+        fpga_batch_write(&regbatch, SPI_TEST_REG1_7, 0);
+        fpga_batch_write(&regbatch, SPI_TEST_REG2_8, 0);
+        fpga_batch_write(&regbatch, SPI_TEST_REG3L_A, 0);
         clear_dc_low();
         if((step_count & 1) == 1)
-            write_spi_register(SPI_TEST_REG3H_9, walking_one | 8);
+            fpga_batch_write(&regbatch, SPI_TEST_REG3H_9, walking_one | 8);
         else
-            write_spi_register(SPI_TEST_REG3H_9, walking_one);
+            fpga_batch_write(&regbatch, SPI_TEST_REG3H_9, walking_one);
     }
     else if((step_count >= 20) && (step_count <= 21)){ // activates the 5th sector bit added to v2 hardware
-        write_spi_register(SPI_TEST_REG1_7, 0);
-        write_spi_register(SPI_TEST_REG2_8, 0);
+        fpga_batch_write(&regbatch, SPI_TEST_REG1_7, 0);
+        fpga_batch_write(&regbatch, SPI_TEST_REG2_8, 0);
         clear_dc_low();
         if(step_count == 20)
-            write_spi_register(SPI_TEST_REG3L_A, TEST_REG_3_LO_BIT_7);
+            fpga_batch_write(&regbatch, SPI_TEST_REG3L_A, TEST_REG_3_LO_BIT_7);
         else
-            write_spi_register(SPI_TEST_REG3L_A, 0);
+            fpga_batch_write(&regbatch, SPI_TEST_REG3L_A, 0);
         if((step_count & 1) == 1)
-            write_spi_register(SPI_TEST_REG3H_9, 8);
+            fpga_batch_write(&regbatch, SPI_TEST_REG3H_9, 8);
         else
-            write_spi_register(SPI_TEST_REG3H_9, 0);
+            fpga_batch_write(&regbatch, SPI_TEST_REG3H_9, 0);
     }
+    fpga_batch_run(&regbatch);
 }
 
 int read_test_inputs(){
-    int retval = read_write_spi_register(SPI_TEST_MODE_GRP1_94, 0);
-    retval |= (read_write_spi_register(SPI_TEST_MODE_GRP2_95, 0) & 0xff) << 8;
-    retval |= (read_write_spi_register(SPI_TEST_MODE_GRP3_96, 0) & 0xff) << 16;
+    uint8_t grp[3];
+    fpga_batch_read(&regbatch, SPI_TEST_MODE_GRP1_94, &grp[0]);
+    fpga_batch_read(&regbatch, SPI_TEST_MODE_GRP2_95, &grp[1]);
+    fpga_batch_read(&regbatch, SPI_TEST_MODE_GRP3_96, &grp[2]);
+    fpga_batch_run(&regbatch);
+    int retval = grp[0] | (grp[1] << 8) | (grp[2] << 16);
     return(retval);
 }
 
+// called from the command event interrupt, so it uses intbatch and never regbatch
 int read_int_inputs(){
-    int retval = read_write_spi_register(SPI_CYLADDR_81, 0);
-    retval |= (read_write_spi_register(SPI_DRVSTATUS_82, 0) & 0xff) << 8;
-    retval |= (read_write_spi_register(SPI_TEST_MODE_GRP2_95, 0) & 0xff) << 16;
+    uint8_t in[4];
+    fpga_batch_read(&intbatch, SPI_CYLADDR_81, &in[0]);
+    fpga_batch_read(&intbatch, SPI_DRVSTATUS_82, &in[1]);
+    fpga_batch_read(&intbatch, SPI_TEST_MODE_GRP2_95, &in[2]);
+    fpga_batch_read(&intbatch, SPI_SECTADDR_MSB_83, &in[3]);
+    fpga_batch_run(&intbatch);
+    int retval = in[0] | (in[1] << 8) | (in[2] << 16) | ((in[3] & 0x01) << 24);
     return(retval);
 }
 
 void load_drive_address(int d_addr)
 {
-    int tempctrlreg = read_write_spi_register(SPI_READBACK_00_A0, 0);
-    tempctrlreg = (tempctrlreg & ~DRIVE_ADDRESS_BITS) | d_addr;
-    write_spi_register(SPI_CONTROL_0, tempctrlreg & 0xff);
+    update_control_register(DRIVE_ADDRESS_BITS, d_addr & 0xff);
 }
 
 int read_fpga_version()
@@ -353,9 +391,10 @@ int read_board_version()
 
 void load_ram_address(int ramaddress)
 {
-    write_spi_register(SPI_DRAM_ADDR_5, (ramaddress >> 16) & 0xff);
-    write_spi_register(SPI_DRAM_ADDR_5, (ramaddress >> 8)  & 0xff);
-    write_spi_register(SPI_DRAM_ADDR_5,  ramaddress        & 0xff);
+    fpga_batch_write(&regbatch, SPI_DRAM_ADDR_5, (ramaddress >> 16) & 0xff);
+    fpga_batch_write(&regbatch, SPI_DRAM_ADDR_5, (ramaddress >> 8)  & 0xff);
+    fpga_batch_write(&regbatch, SPI_DRAM_ADDR_5,  ramaddress        & 0xff);
+    fpga_batch_run(&regbatch);
 }
 
 void storebyte(int bytevalue)
@@ -363,6 +402,166 @@ void storebyte(int bytevalue)
     write_spi_register(SPI_DRAM_DATA_6, bytevalue & 0xff);
 }
 
+// *************** FPGA SPI burst mode ***************
+// The FPGA latches every register write on the rising edge of CS, so CS cannot simply be held low
+// across a block transfer. Instead the FPGA link is used as 16-bit frames with CS pulsed high between
+// frames by the hardware, see fpga_bus.cpp, so each frame is one complete [register][data] write and
+// the TX FIFO can be kept full with no per-byte software overhead.
+// While burst mode is active the byte-wide register functions above must not be used, so command events
+// must be disabled. With the PIO link storebytes() and readbytes() use the DRAM streams instead.
+//
+#define STOREBYTES_FRAME_BUF_LEN 256
+#define READBYTES_BLOCK_LEN 256 // bytes per DMA block, must be even
+#define READBYTES_FRAME_BUF_LEN ((READBYTES_BLOCK_LEN * 3) / 2) // 3 frames for every 2 bytes
+static int burst_tx_dma = -1;
+static int burst_rx_dma = -1;
+static dma_channel_config burst_tx_dma_cfg;
+static dma_channel_config burst_rx_dma_cfg;
+static uint16_t burst_rx_dummy;
+
+void fpga_burst_begin()
+{
+    if (burst_tx_dma < 0){
+        // grab two unused DMA channels the first time through, the microSD driver has already claimed its own
+        burst_tx_dma = dma_claim_unused_channel(true);
+        burst_rx_dma = dma_claim_unused_channel(true);
+        burst_tx_dma_cfg = dma_channel_get_default_config(burst_tx_dma);
+        channel_config_set_transfer_data_size(&burst_tx_dma_cfg, DMA_SIZE_16);
+        channel_config_set_read_increment(&burst_tx_dma_cfg, true);
+        channel_config_set_write_increment(&burst_tx_dma_cfg, false);
+        channel_config_set_dreq(&burst_tx_dma_cfg, fpga_bus_tx_dreq());
+        // the received frames are meaningless for writes, but they must be drained so the RX FIFO never overruns
+        burst_rx_dma_cfg = dma_channel_get_default_config(burst_rx_dma);
+        channel_config_set_transfer_data_size(&burst_rx_dma_cfg, DMA_SIZE_16);
+        channel_config_set_read_increment(&burst_rx_dma_cfg, false);
+        channel_config_set_write_increment(&burst_rx_dma_cfg, false);
+        channel_config_set_dreq(&burst_rx_dma_cfg, fpga_bus_rx_dreq());
+    }
+    fpga_bus_frames_begin();
+}
+
+void fpga_burst_end()
+{
+    fpga_bus_frames_end();
+}
+
+// build the burst frames to load the DRAM address and then store count bytes starting at that address
+// returns the number of frames, which is always count + 3
+int build_dram_write_frames(uint16_t* frames, int ramaddress, const uint8_t* bp, int count)
+{
+    uint16_t* fp = frames;
+    *fp++ = (SPI_DRAM_ADDR_5 << 8) | ((ramaddress >> 16) & 0xff);
+    *fp++ = (SPI_DRAM_ADDR_5 << 8) | ((ramaddress >> 8)  & 0xff);
+    *fp++ = (SPI_DRAM_ADDR_5 << 8) | ( ramaddress        & 0xff);
+    for (int i = 0; i < count; i++)
+        *fp++ = (SPI_DRAM_DATA_6 << 8) | *bp++;
+    return(count + 3);
+}
+
+// build count burst frames that store the 16-bit fill word over and over, low byte first, starting at the current DRAM address
+// the FPGA has no fill command so a fill is still streamed, but the frames only have to be built once per word
+int build_dram_fill_frames(uint16_t* frames, uint16_t fillword, int count)
+{
+    uint16_t lowframe = (SPI_DRAM_DATA_6 << 8) | (fillword & 0xff);
+    uint16_t highframe = (SPI_DRAM_DATA_6 << 8) | ((fillword >> 8) & 0xff);
+    for (int i = 0; i < count; i += 2){
+        frames[i] = lowframe;
+        frames[i + 1] = highframe;
+    }
+    return(count);
+}
+
+// start sending a block of burst frames to the FPGA by DMA and return immediately
+// the frame buffer must not be touched until fpga_burst_dma_wait() returns
+void fpga_burst_dma_start(const uint16_t* frames, int count)
+{
+    dma_channel_configure(burst_tx_dma, &burst_tx_dma_cfg, fpga_bus_tx_fifo(), frames, count, false);
+    dma_channel_configure(burst_rx_dma, &burst_rx_dma_cfg, &burst_rx_dummy, fpga_bus_rx_fifo(), count, false);
+    dma_start_channel_mask((1u << burst_tx_dma) | (1u << burst_rx_dma));
+}
+
+// wait for the last DMA block to finish, the RX channel completes only after the last frame is off the wire
+void fpga_burst_dma_wait()
+{
+    if (burst_rx_dma < 0)
+        return;
+    dma_channel_wait_for_finish_blocking(burst_tx_dma);
+    dma_channel_wait_for_finish_blocking(burst_rx_dma);
+}
+
+// store a block of bytes into the FPGA DRAM at the SPI line rate
+void storebytes(const uint8_t* bp, int count)
+{
+#if FPGA_BUS_PIO
+    fpga_bus_dram_write_start(bp, count);
+    fpga_bus_dram_wait();
+#else
+    static uint16_t frames[STOREBYTES_FRAME_BUF_LEN];
+
+    fpga_burst_begin();
+    while (count > 0){
+        int n = (count > STOREBYTES_FRAME_BUF_LEN) ? STOREBYTES_FRAME_BUF_LEN : count;
+        for (int i = 0; i < n; i++)
+            frames[i] = (SPI_DRAM_DATA_6 << 8) | *bp++;
+        spi_write16_blocking(spi_default, frames, n);
+        count -= n;
+    }
+    fpga_burst_end();
+#endif
+}
+
+// read a block of bytes from the FPGA DRAM starting at the address loaded by load_ram_address()
+// The FPGA fetches the next DRAM word on the rising edge of CS after the high byte is shifted out, and
+// back-to-back burst frames leave less time than a DRAM cycle that collides with a refresh. So every
+// word is followed by a read of the function ID register, which has no side effects and gives the
+// DRAM controller a full frame time to fetch the next word.
+// Interrupts are held off for each block because the command event handler uses byte-wide transfers.
+void readbytes(uint8_t* bp, int count)
+{
+#if FPGA_BUS_PIO
+    // the PIO read stream stores the DRAM bytes straight into the buffer
+    while (count > 0){
+        int n = (count > READBYTES_BLOCK_LEN) ? READBYTES_BLOCK_LEN : count;
+        uint32_t irqstatus = save_and_disable_interrupts();
+        fpga_bus_dram_read(bp, n);
+        restore_interrupts(irqstatus);
+        bp += n;
+        count -= n;
+    }
+#else
+    static uint16_t txframes[READBYTES_FRAME_BUF_LEN];
+    static uint16_t rxframes[READBYTES_FRAME_BUF_LEN];
+    static bool txframes_built = false;
+
+    if (!txframes_built){
+        for (int i = 0; i < READBYTES_FRAME_BUF_LEN; i++)
+            txframes[i] = ((i % 3) == 2) ? (SPI_FUNCT_ID_89 << 8) : (SPI_DRAMREAD_88 << 8);
+        txframes_built = true;
+    }
+    fpga_burst_begin();
+    dma_channel_config rxcfg = burst_rx_dma_cfg;
+    channel_config_set_write_increment(&rxcfg, true);
+    while (count > 0){
+        // the block size is always even except possibly the last one, so every block starts on a low byte
+        int n = (count > READBYTES_BLOCK_LEN) ? READBYTES_BLOCK_LEN : count;
+        int nframes = n + (n / 2);
+        uint32_t irqstatus = save_and_disable_interrupts();
+        dma_channel_configure(burst_tx_dma, &burst_tx_dma_cfg, fpga_bus_tx_fifo(), txframes, nframes, false);
+        dma_channel_configure(burst_rx_dma, &rxcfg, rxframes, fpga_bus_rx_fifo(), nframes, false);
+        dma_start_channel_mask((1u << burst_tx_dma) | (1u << burst_rx_dma));
+        dma_channel_wait_for_finish_blocking(burst_rx_dma);
+        restore_interrupts(irqstatus);
+        // the data byte is in the low half of each received frame
+        for (int i = 0; i < nframes; i++){
+            if ((i % 3) != 2)
+                *bp++ = rxframes[i] & 0xff;
+        }
+        count -= n;
+    }
+    fpga_burst_end();
+#endif
+}
+
 int readbyte()
 {
     int readdata = read_write_spi_register(SPI_DRAMREAD_88, 0);
@@ -374,19 +573,19 @@ int readbyte()
 //
 void update_fpga_disk_state(Disk_State* ddisk){
     if(ddisk->bitRate == 1440000){
-        write_spi_register(SPI_BITCLKDIV_CP_D, 14);
-        write_spi_register(SPI_BITCLKDIV_DP_E, 14);
-        write_spi_register(SPI_BITPLSWIDTH_F, 6);
+        fpga_batch_write(&regbatch, SPI_BITCLKDIV_CP_D, 14);
+        fpga_batch_write(&regbatch, SPI_BITCLKDIV_DP_E, 14);
+        fpga_batch_write(&regbatch, SPI_BITPLSWIDTH_F, 6);
     }
     else if(ddisk->bitRate == 1545000){
-        write_spi_register(SPI_BITCLKDIV_CP_D, 13);
-        write_spi_register(SPI_BITCLKDIV_DP_E, 13);
-        write_spi_register(SPI_BITPLSWIDTH_F, 6);
+        fpga_batch_write(&regbatch, SPI_BITCLKDIV_CP_D, 13);
+        fpga_batch_write(&regbatch, SPI_BITCLKDIV_DP_E, 13);
+        fpga_batch_write(&regbatch, SPI_BITPLSWIDTH_F, 6);
     }
     else if(ddisk->bitRate == 1600000){
-        write_spi_register(SPI_BITCLKDIV_CP_D, 12);
-        write_spi_register(SPI_BITCLKDIV_DP_E, 13);
-        write_spi_register(SPI_BITPLSWIDTH_F, 6);
+        fpga_batch_write(&regbatch, SPI_BITCLKDIV_CP_D, 12);
+        fpga_batch_write(&regbatch, SPI_BITCLKDIV_DP_E, 13);
+        fpga_batch_write(&regbatch, SPI_BITPLSWIDTH_F, 6);
     }
     else
         printf("###ERROR, unknown disk bitRate %d\r\n", ddisk->bitRate);
@@ -396,10 +595,11 @@ void update_fpga_disk_state(Disk_State* ddisk){
     //write_spi_register(SPI_TEST_REG3L_A, ddisk->dataLength & 0xff);
     //write_spi_register(SPI_POSTAMBLE_B, ddisk->postambleLength);
     //write_spi_register(<NO_REGISTER_FOR_THIS_YET>, ddisk->numberOfCylinders); // FPGA is coded with a constant == 203
-    write_spi_register(SPI_SECTPERTRK_C, ddisk->numberOfSectorsPerTrack);
+    fpga_batch_write(&regbatch, SPI_SECTPERTRK_C, ddisk->numberOfSectorsPerTrack);
     //write_spi_register(<NO_REGISTER_FOR_THIS_YET>, ddisk->numberOfHeads); // FPGA is coded with a constant of 2 heads
-    write_spi_register(SPI_USECPERSECTH_10, ddisk->microsecondsPerSector >> 8);
-    write_spi_register(SPI_USECPERSECTL_11, ddisk->microsecondsPerSector & 0xff);
+    fpga_batch_write(&regbatch, SPI_USECPERSECTH_10, ddisk->microsecondsPerSector >> 8);
+    fpga_batch_write(&regbatch, SPI_USECPERSECTL_11, ddisk->microsecondsPerSector & 0xff);
+    fpga_batch_run(&regbatch);
 }
 
 // *************** CPU GPIO Signals ***************
@@ -660,27 +860,8 @@ void initialize_gpio()
 
 void initialize_spi()
 {
-    // initialize SPI to run at 25 MHz
-    // This is the CPU to FPGA SPI link.
-    spi_init(spi_default, 25 * 1000 * 1000);
-    gpio_set_function(PICO_DEFAULT_SPI_SCK_PIN, GPIO_FUNC_SPI);
-    gpio_set_function(PICO_DEFAULT_SPI_TX_PIN, GPIO_FUNC_SPI);
-    gpio_set_function(PICO_DEFAULT_SPI_RX_PIN, GPIO_FUNC_SPI);
-    // SPI configuration needs to be CPHA = 0, CPOL = 0
-    // resting state of the CPI clock is low, data is captured in the RPi Pico and in the FPGA on rising edge
-    // so data needs to change on the falling edge and be set up half a clock prior to the first clock rising edge
-    //spi_set_format(spi_default, )
-
-    // Make the SPI pins available to picotool
-    bi_decl(bi_2pins_with_func(PICO_DEFAULT_SPI_TX_PIN, PICO_DEFAULT_SPI_SCK_PIN, GPIO_FUNC_SPI));
-
-    // Chip select is active-low, so we'll initialise it to a driven-high state
-    gpio_init(PICO_DEFAULT_SPI_CSN_PIN);
-    gpio_set_dir(PICO_DEFAULT_SPI_CSN_PIN, GPIO_OUT);
-    gpio_put(PICO_DEFAULT_SPI_CSN_PIN, 1);
-
-    // Make the CS pin available to picotool
-    bi_decl(bi_1pin_with_name(PICO_DEFAULT_SPI_CSN_PIN, "SPI CS"));
+    // This is the CPU to FPGA link, run by a PIO state machine or by the SPI port, see fpga_bus.cpp
+    fpga_bus_init();
 }
 
 void initialize_uart()
@@ -702,7 +883,7 @@ void initialize_uart()
 
 void initialize_fpga(struct Disk_State* ddisk)
 {
-    //fpga_ctrl_reg_image = 0;
+    shadow_registers_sync(); // the FPGA has just been reset, start the shadow from its register
     //update_drive_address(ddisk);
     clear_file_ready();
     ddisk->File_Ready = false;
@@ -26,7 +26,15 @@ void initialize_spi();
 
 void load_ram_address(int ramaddress);
 void storebyte(int bytevalue);
+void storebytes(const uint8_t* bp, int count);
+void fpga_burst_begin();
+void fpga_burst_end();
+int build_dram_write_frames(uint16_t* frames, int ramaddress, const uint8_t* bp, int count);
+int build_dram_fill_frames(uint16_t* frames, uint16_t fillword, int count);
+void fpga_burst_dma_start(const uint16_t* frames, int count);
+void fpga_burst_dma_wait();
 int readbyte();
+void readbytes(uint8_t* bp, int count);
 bool is_it_a_tester();
 int read_board_version();
 
@@ -48,6 +56,8 @@ void microSD_LED_on();
 void microSD_LED_off();
 
 uint8_t read_write_spi_register(uint8_t reg, uint8_t data);
+void shadow_registers_sync();
+void shadow_registers_report(bool reset);
 void toggle_wp();
 void set_file_ready();
 void clear_file_ready();
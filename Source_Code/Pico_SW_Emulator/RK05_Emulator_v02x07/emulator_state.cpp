@@ -14,6 +14,7 @@
 //#include "display_timers.h"
 #include "emulator_hardware.h"
 #include "microsd_file_ops.h"
+#include "emulator_events.h"
 
 #define LOADINGERRORON 7
 #define LOADINGERROROFF 7
@@ -32,6 +33,7 @@ int intermediate_result;
             if(dstate->rl_switch){
                 if(dstate->wp_switch){ //if WTPROT switch is simultaneously pressed then only move the microSD carriage
                     close_drive_door();
+                    enable_command_events(); // the pack runs again without a reload, track its writes
                     set_file_ready();
                     set_cpu_ready_indicator();
                     dstate->File_Ready = true;
@@ -96,7 +98,7 @@ int intermediate_result;
         case RLST4:
             // Check to see if the disk image file can be opened. If not, then go to load error state with code 4.
             printf("  Drive_Address = %d, RLST%x, %d, %d\r\n", dstate->Drive_Address, dstate->run_load_state, dstate->rl_switch, dstate->wp_switch);
-            if(file_open_read_disk_image() != 0){
+            if(file_open_read_disk_image(dstate) != 0){
                 //error_code = 0x4;
                 printf("*** ERROR, file_open_read_disk_image failed\r\n");
                 display_error((char *) "cannot open", (char *) "disk image");
@@ -165,12 +167,18 @@ int intermediate_result;
             if(intermediate_result != 0){
                 file_close_disk_image();
                 printf("*** ERROR, problem reading disk image data\n");
-                display_error((char *) "cannot read", (char *) "image data");
+                // after a CRC error the display already shows the first bad sector
+                if(intermediate_result != FILE_OPS_CRC_ERROR)
+                    display_error((char *) "cannot read", (char *) "image data");
                 dstate->run_load_state = RLST18;
             }
             else{
                 printf("Disk image data read successfully\r\n");
                 display_status((char *) "Image data", (char *) "read OK");
+                // sectors saved in the journal when the pack was last stopped without saving are written back into DRAM and marked as written
+                dirty_map_clear();
+                if(journal_replay(dstate) != FILE_OPS_OKAY)
+                    printf("*** ERROR, journal could not be replayed\r\n");
                 dstate->run_load_state = RLST8;
             }
             break;
@@ -185,6 +193,9 @@ int intermediate_result;
             }
             else{
                 printf("Disk image data read, file closed successfully\r\n");
+                journal_start();
+                trace_start(dstate);
+                enable_command_events();
                 set_cpu_ready_indicator();
                 set_file_ready();
                 dstate->File_Ready = true;
@@ -194,10 +205,16 @@ int intermediate_result;
         case RLST10:
             // Loaded and running state. Waiting for the RUN/LOAD switch to be toggled to the “LOAD” position.
             microSD_LED_on();
+            trace_service(dstate);
             if(dstate->rl_switch == 0){ //if WTPROT switch is simultaneously pressed then only move the microSD carriage
                 if(dstate->wp_switch){
-                    open_drive_door();
+                    // the image file is not saved, the sectors written by the controller go to the journal and are replayed at the next load
                     clear_file_ready();
+                    disable_command_events();
+                    trace_stop();
+                    journal_save(dstate);
+                    journal_stop();
+                    open_drive_door();
                     clear_cpu_ready_indicator();
                     dstate->File_Ready = false;
                     set_cpu_load_indicator();
@@ -210,10 +227,30 @@ int intermediate_result;
             }
             break;
         case RLST11:
-            // The RUN/LOAD switch has been toggled to the “LOAD” position. Read the contents of the DRAM and write it to the disk image file. 
+            // The RUN/LOAD switch has been toggled to the “LOAD” position. Stop the controller and check which sectors it has written.
+            // If no sectors were written then the image file is unchanged and the door is opened. If some sectors were written then
+            // only those are rewritten in place (RLST16), otherwise the whole image file is rewritten (RLST12).
             // If a write error occurs then go to the unload error state with code 21.
             printf("  Drive_Address = %d, RLST%x, %d, %d\r\n", dstate->Drive_Address, dstate->run_load_state, dstate->rl_switch, dstate->wp_switch);
-            intermediate_result = file_open_write_disk_image();
+            clear_cpu_ready_indicator();
+            clear_file_ready();
+            disable_command_events();
+            trace_stop();
+            journal_stop();
+            dstate->File_Ready = false;
+            if(!dirty_all_marked() && (dirty_sector_count() == 0)){
+                printf("No sectors written, disk image file is unchanged\r\n");
+                file_remove_journal();
+                display_status((char *) "Opening", (char *) "microSD door");
+                open_drive_door();
+                printf("Moving the actuator to open the door\r\n");
+                dstate->run_load_state = RLST15;
+                break;
+            }
+            if(dirty_all_marked())
+                intermediate_result = file_open_write_disk_image(dstate);
+            else
+                intermediate_result = file_open_update_disk_image();
             printf("finished file open for write, code %d\r\n", intermediate_result);
             if(intermediate_result != FILE_OPS_OKAY){
                 //error_code = 0x21;
@@ -223,12 +260,31 @@ int intermediate_result;
             }
             else{
                 printf("Disk image file is open\r\n");
-                clear_cpu_ready_indicator();
-                clear_file_ready();
-                dstate->File_Ready = false;
                 display_status((char *) "Image file", (char *) "open");
+                dstate->run_load_state = dirty_all_marked() ? RLST12 : RLST16;
+            }
+            break;
+        case RLST16:
+            // Rewrite only the sectors written by the controller. If a sector changed length then the whole image file
+            // has to be rewritten, so reopen it for write and go on to write the header.
+            printf("  Drive_Address = %d, RLST%x, %d, %d\r\n", dstate->Drive_Address, dstate->run_load_state, dstate->rl_switch, dstate->wp_switch);
+            display_status((char *) "Writing", (char *) "changed data");
+            intermediate_result = write_dirty_sectors(dstate);
+            if(intermediate_result == FILE_OPS_OKAY){
+                printf("Changed sectors written\r\n");
+                dstate->run_load_state = RLST14;
+            }
+            else if((intermediate_result == FILE_OPS_FULL_REWRITE) && (file_close_disk_image() == FILE_OPS_OKAY)
+                    && (file_open_write_disk_image(dstate) == FILE_OPS_OKAY)){
+                printf("Disk image file is open for a full rewrite\r\n");
                 dstate->run_load_state = RLST12;
             }
+            else{
+                file_close_disk_image();
+                printf("*** ERROR, write_dirty_sectors failed\r\n");
+                display_error((char *) "image data", (char *) "write fail");
+                dstate->run_load_state = RLST1a;
+            }
             break;
         case RLST12:
             // Write the header of the image file.
@@ -275,6 +331,7 @@ int intermediate_result;
             }
             else{
                 printf("Disk image data write, file closed successfully\r\n");
+                file_remove_journal(); // the journaled sectors are now in the image file
                 display_status((char *) "Opening", (char *) "microSD door");
                 open_drive_door();
                 printf("Moving the actuator to open the door\r\n");
@@ -361,6 +418,7 @@ int intermediate_result;
             if(dstate->rl_switch && dstate->wp_switch){ //if WTPROT switch is simultaneously pressed when toggling RUN/LOAD back to RUN then only move the microSD carriage
                 close_drive_door();
                 clear_cpu_fault_indicator();
+                enable_command_events(); // the pack runs again without a reload, track its writes
                 set_file_ready();
                 set_cpu_ready_indicator();
                 clear_cpu_load_indicator();
@@ -378,6 +436,7 @@ int intermediate_result;
             if(dstate->rl_switch && dstate->wp_switch){ //if WTPROT switch is simultaneously pressed when toggling RUN/LOAD back to RUN then only move the microSD carriage
                 close_drive_door();
                 clear_cpu_fault_indicator();
+                enable_command_events(); // the pack runs again without a reload, track its writes
                 set_file_ready();
                 set_cpu_ready_indicator();
                 clear_cpu_load_indicator();
@@ -386,8 +445,11 @@ int intermediate_result;
             break;
         case RLST1f:
             // wait for door to close after Unloading error state or unloaded RLST0 state.
+            // The pack in DRAM runs again without a reload. Command events were enabled with File_Ready so the controller's
+            // writes are tracked again, the dirty map is kept because the sectors written before the stop are not saved yet.
             if(drive_door_status() == DOORCLOSED){
                 printf("  Drive_Address = %d, RLST%x, %d, %d\r\n", dstate->Drive_Address, dstate->run_load_state, dstate->rl_switch, dstate->wp_switch);
+                journal_start(); // the card is only mounted once the door is closed
                 dstate->run_load_state = RLST10;
             }
             break;
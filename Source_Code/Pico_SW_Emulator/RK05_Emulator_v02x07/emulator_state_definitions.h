@@ -19,12 +19,14 @@
 #define RLST8  0x8  // Close the disk image file and set the File_Ready bit in the FPGA mode register and illuminate RDY on the front panel.
 #define RLST10 0x10 // Loaded and running state. Waiting for the RUN/LOAD switch to be toggled to the “LOAD” position.
 #define RLST11 0x11 // The RUN/LOAD switch has been toggled to the “LOAD” position. Read the contents of the DRAM and write it to the disk image file. 
+                    // If no sectors were written go straight to RLST15, if some were written go to RLST16, otherwise RLST12.
                     // If a write error occurs then go to the unload error state with code 21.
 #define RLST12 0x12 // Write the header of the image file.
 #define RLST13 0x13 // Write the disk image data.
 #define RLST14 0x14 // Close the disk image file. If an error occurs then go to the unload error state with code 22.
                     // Start moving the actuator to close the drive door
 #define RLST15 0x15 // Wait for the actuator to finish opening the drive door.
+#define RLST16 0x16 // Rewrite only the sectors written by the controller. If a sector changed length then reopen for a full rewrite in RLST12.
 //#define RLST34 0x34 // Check to see if the config file can be opened.
 #define RLST18 0x18 // Loading error state, initialize internal error states for loading error.
 #define RLST19 0x19 // Loading error state, indicator on. Flash the Fault light indefinitely.
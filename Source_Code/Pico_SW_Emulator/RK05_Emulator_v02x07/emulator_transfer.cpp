@@ -0,0 +1,279 @@
+// *********************************************************************************
+// emulator_transfer.cpp
+//   core 1 FPGA DRAM transfer engine used for image load and unload
+//
+//   During a load core 0 reads sectors from the microSD card into a ring of slots
+//   and core 1 drains the ring into the FPGA DRAM. During an unload core 1 reads
+//   sectors from the FPGA DRAM into the ring and core 0 writes them to the card.
+//   The ring has a single producer and a single consumer, so the head index is
+//   only written by the producer and the tail index only by the consumer and no
+//   lock is needed. A memory barrier orders the slot contents against the index.
+//   Core 0 does not touch the FPGA SPI port while core 1 is running.
+//   With the PIO FPGA link core 1 hands the sector bytes straight to the DRAM write
+//   stream, otherwise it builds SPI burst frames for them.
+// *********************************************************************************
+// 
+#include <stdio.h>
+#include "pico/stdlib.h"
+#include "pico/multicore.h"
+#include "hardware/sync.h"
+#include <string.h>
+
+#include "disk_state_definitions.h"
+#include "emulator_hardware.h"
+#include "fpga_bus.h"
+#include "emulator_transfer.h"
+
+static Xfer_Slot xfer_ring[XFER_RING_SLOTS];
+static volatile uint32_t xfer_head;     // next slot to fill, written only by the producer
+static volatile uint32_t xfer_tail;     // next slot to empty, written only by the consumer
+static volatile bool xfer_producer_done;
+static volatile bool xfer_abort_request;
+static volatile bool xfer_core1_done;
+static volatile bool xfer_core1_error;
+static uint64_t xfer_stall_time;        // time core 0 spent waiting on the ring
+
+static int xfer_cylinders;
+static int xfer_heads;
+static int xfer_sectors;
+
+#if !FPGA_BUS_PIO
+// double-buffered FPGA burst frames used by core 1 during the load, one buffer is sent by DMA while the other is built.
+// Each sector needs 3 DRAM address frames plus one frame per byte.
+static uint16_t dramframes[2][MAX_SECTOR_SIZE + 3];
+
+// burst frames for a fill sector body, kept between sectors and rebuilt only when the fill word changes.
+// A formatted pack is mostly fill sectors with the same word so core 1 only has to build the address and length frames.
+static uint16_t fillframes[MAX_SECTOR_SIZE];
+static int fillframes_word;
+#endif
+
+static void xfer_reset()
+{
+    xfer_head = 0;
+    xfer_tail = 0;
+    xfer_producer_done = false;
+    xfer_abort_request = false;
+    xfer_core1_done = false;
+    xfer_core1_error = false;
+    xfer_stall_time = 0;
+}
+
+// *************** load, core 1 is the consumer ***************
+//
+#if FPGA_BUS_PIO
+// The DMA reads the sector bytes from the slot itself, so the slot is handed back only when they are off the wire.
+// A fill sector body is sent from the two bytes of the fill word with the DMA reading them over and over.
+static void core1_load_entry()
+{
+    static uint8_t fillbytes[2] __attribute__((aligned(2)));
+
+    while (!xfer_abort_request){
+        if (xfer_tail == xfer_head){
+            if (xfer_producer_done)
+                break;
+            tight_loop_contents();
+            continue;
+        }
+        __dmb(); // read the slot only after seeing the head index move
+        Xfer_Slot* slot = &xfer_ring[xfer_tail & (XFER_RING_SLOTS - 1)];
+        load_ram_address(slot->ramaddress);
+        if (slot->fillword < 0)
+            fpga_bus_dram_write_start(slot->data, slot->count);
+        else{
+            // the address and length fields, then the body from the fill word
+            fillbytes[0] = slot->fillword & 0xff;
+            fillbytes[1] = (slot->fillword >> 8) & 0xff;
+            fpga_bus_dram_write_start(slot->data, 4);
+            fpga_bus_dram_fill_start(fillbytes, slot->count - 4);
+        }
+        fpga_bus_dram_wait();
+        __dmb(); // finished with the slot contents, hand it back to the producer
+        xfer_tail = xfer_tail + 1;
+    }
+    __dmb();
+    xfer_core1_done = true;
+}
+#else
+static void core1_load_entry()
+{
+    int framebuf = 0;
+    bool fillframes_busy = false;   // a DMA block from fillframes[] may still be running
+
+    fillframes_word = -1;
+    fpga_burst_begin();
+    while (!xfer_abort_request){
+        if (xfer_tail == xfer_head){
+            if (xfer_producer_done)
+                break;
+            tight_loop_contents();
+            continue;
+        }
+        __dmb(); // read the slot only after seeing the head index move
+        Xfer_Slot* slot = &xfer_ring[xfer_tail & (XFER_RING_SLOTS - 1)];
+        if (slot->fillword < 0){
+            int framecount = build_dram_write_frames(dramframes[framebuf], slot->ramaddress, slot->data, slot->count);
+            __dmb(); // the slot contents are copied, hand it back to the producer
+            xfer_tail = xfer_tail + 1;
+            fpga_burst_dma_wait();
+            fpga_burst_dma_start(dramframes[framebuf], framecount);
+            fillframes_busy = false;
+        }
+        else{
+            // the address and length fields, then the body from the cached fill frames
+            int fillword = slot->fillword;
+            int bodycount = slot->count - 4;
+            int framecount = build_dram_write_frames(dramframes[framebuf], slot->ramaddress, slot->data, 4);
+            __dmb(); // the slot contents are copied, hand it back to the producer
+            xfer_tail = xfer_tail + 1;
+            if (fillword != fillframes_word){
+                if (fillframes_busy)
+                    fpga_burst_dma_wait();
+                build_dram_fill_frames(fillframes, (uint16_t)fillword, MAX_SECTOR_SIZE - 4);
+                fillframes_word = fillword;
+            }
+            fpga_burst_dma_wait();
+            fpga_burst_dma_start(dramframes[framebuf], framecount);
+            fpga_burst_dma_wait();
+            fpga_burst_dma_start(fillframes, bodycount);
+            fillframes_busy = true;
+        }
+        framebuf ^= 1;
+    }
+    fpga_burst_dma_wait();
+    fpga_burst_end();
+    __dmb();
+    xfer_core1_done = true;
+}
+#endif
+
+void xfer_start_load()
+{
+    xfer_reset();
+    multicore_launch_core1(core1_load_entry);
+}
+
+// wait for a free slot and return it, core 0 fills it and then calls xfer_producer_commit()
+Xfer_Slot* xfer_producer_slot()
+{
+    if ((xfer_head - xfer_tail) >= XFER_RING_SLOTS){
+        uint64_t t0 = time_us_64();
+        while ((xfer_head - xfer_tail) >= XFER_RING_SLOTS)
+            tight_loop_contents();
+        xfer_stall_time += time_us_64() - t0;
+    }
+    __dmb(); // don't write the slot until the consumer is finished with it
+    return(&xfer_ring[xfer_head & (XFER_RING_SLOTS - 1)]);
+}
+
+void xfer_producer_commit()
+{
+    __dmb(); // the slot contents must be visible before the head index moves
+    xfer_head = xfer_head + 1;
+}
+
+// *************** unload, core 1 is the producer ***************
+//
+// read every sector from DRAM into the ring, returns early on an abort request or a bad length field
+static void core1_unload_sectors()
+{
+    for (int cylindercount = 0; cylindercount < xfer_cylinders; cylindercount++){
+        for (int headcount = 0; headcount < xfer_heads; headcount++){
+            for (int sectorcount = 0; sectorcount < xfer_sectors; sectorcount++){
+                while ((xfer_head - xfer_tail) >= XFER_RING_SLOTS){
+                    if (xfer_abort_request)
+                        return;
+                    tight_loop_contents();
+                }
+                if (xfer_abort_request)
+                    return;
+                __dmb(); // don't write the slot until the consumer is finished with it
+                Xfer_Slot* slot = &xfer_ring[xfer_head & (XFER_RING_SLOTS - 1)];
+                slot->ramaddress = (cylindercount << 14) | (headcount << 13) | (sectorcount << 9);
+                load_ram_address(slot->ramaddress);
+
+                readbytes(slot->data, 4);
+                int sector_data_bit_count = (slot->data[3] << 8) | slot->data[2];
+                int wordcount = (sector_data_bit_count + 15) >> 4; // round the word count up to the next integer value
+                int bytecount = wordcount * 2;
+                if ((bytecount + 4) > MAX_SECTOR_SIZE){
+                    // a corrupt length field in DRAM, core 0 reports the error
+                    xfer_core1_error = true;
+                    return;
+                }
+                readbytes(&slot->data[4], bytecount);
+                slot->count = bytecount + 4;
+                slot->fillword = -1;
+                __dmb(); // the slot contents must be visible before the head index moves
+                xfer_head = xfer_head + 1;
+            }
+        }
+    }
+}
+
+static void core1_unload_entry()
+{
+    core1_unload_sectors();
+    __dmb();
+    xfer_producer_done = true;
+    xfer_core1_done = true;
+}
+
+void xfer_start_unload(int cylinders, int heads, int sectors)
+{
+    xfer_reset();
+    xfer_cylinders = cylinders;
+    xfer_heads = heads;
+    xfer_sectors = sectors;
+    multicore_launch_core1(core1_unload_entry);
+}
+
+// wait for a filled slot and return it, returns NULL when core 1 has no more sectors
+Xfer_Slot* xfer_consumer_slot()
+{
+    if (xfer_head == xfer_tail){
+        uint64_t t0 = time_us_64();
+        while (xfer_head == xfer_tail){
+            if (xfer_producer_done){
+                __dmb(); // pick up a slot committed just before the done flag
+                if (xfer_head == xfer_tail){
+                    xfer_stall_time += time_us_64() - t0;
+                    return(NULL);
+                }
+                break;
+            }
+            tight_loop_contents();
+        }
+        xfer_stall_time += time_us_64() - t0;
+    }
+    __dmb(); // read the slot only after seeing the head index move
+    return(&xfer_ring[xfer_tail & (XFER_RING_SLOTS - 1)]);
+}
+
+void xfer_consumer_release()
+{
+    __dmb(); // finished with the slot contents before handing it back
+    xfer_tail = xfer_tail + 1;
+}
+
+// *************** common ***************
+//
+// tell core 1 there is nothing more to do, wait for it to finish and put it back in reset so it can be launched again.
+// If abort is true core 1 stops at the next sector boundary. Returns false if core 1 reported an error.
+bool xfer_finish(bool abort)
+{
+    if (abort)
+        xfer_abort_request = true;
+    xfer_producer_done = true;
+    while (!xfer_core1_done)
+        tight_loop_contents();
+    __dmb();
+    multicore_reset_core1();
+    return(!xfer_core1_error);
+}
+
+// time core 0 spent waiting on core 1 during the last transfer
+int xfer_stall_us()
+{
+    return((int)xfer_stall_time);
+}
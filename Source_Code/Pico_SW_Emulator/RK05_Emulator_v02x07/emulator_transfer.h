@@ -0,0 +1,31 @@
+// *********************************************************************************
+// emulator_transfer.h
+//   header for the core 1 FPGA DRAM transfer engine used for image load and unload
+// *********************************************************************************
+// 
+
+// max sector for 4 sector pack, 2% speed variation, ((40 msec / 4 sectors) * 1.6e6 bits/sec * 1.02) / 8 bits/byte + 4 bytes length fields = 2044
+#define MAX_SECTOR_SIZE 2044 
+
+#define XFER_RING_SLOTS 8   // must be a power of 2
+
+struct Xfer_Slot {
+    int ramaddress;     // DRAM address of the sector
+    int count;          // number of bytes in the sector, including the 4 bytes of length fields
+    int fillword;       // -1 if data[] holds the whole sector, otherwise data[] holds only the length fields and every body word is fillword
+    uint8_t data[MAX_SECTOR_SIZE];
+};
+
+// load, core 0 reads the microSD card and core 1 writes the FPGA DRAM
+void xfer_start_load();
+Xfer_Slot* xfer_producer_slot();
+void xfer_producer_commit();
+
+// unload, core 1 reads the FPGA DRAM and core 0 writes the microSD card
+void xfer_start_unload(int cylinders, int heads, int sectors);
+Xfer_Slot* xfer_consumer_slot();
+void xfer_consumer_release();
+
+// common to load and unload
+bool xfer_finish(bool abort);
+int xfer_stall_us();
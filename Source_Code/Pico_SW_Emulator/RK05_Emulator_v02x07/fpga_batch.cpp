@@ -0,0 +1,130 @@
+// *********************************************************************************
+// fpga_batch.cpp
+//   batched FPGA register transactions, shared by the emulator and the tester
+//
+//   Register accesses are queued in an Fpga_Batch and then sent to the FPGA as one
+//   DMA burst instead of one blocking 2-byte transfer with software CS for each.
+//   The FPGA latches every access on the rising edge of CS, so as in the DRAM burst
+//   transfers the FPGA link is used as 16-bit frames with CS pulsed high between
+//   frames by the hardware, see fpga_bus.cpp. Each frame is one complete
+//   [register][data] access and the byte read back comes in the low half of the
+//   received frame. The read bytes are copied to the caller's buffers when the batch
+//   finishes.
+//
+//   fpga_batch_run() sends a batch and waits for it with interrupts held off, like
+//   the single register functions. fpga_batch_start() returns as soon as the DMA is
+//   running. The batch is then finished by fpga_batch_poll() or fpga_batch_wait(),
+//   which call the completion callback. Nothing else may use the FPGA SPI port until
+//   then, so command events must be disabled.
+// *********************************************************************************
+// 
+#include <stdio.h>
+#include "pico/stdlib.h"
+#include "hardware/dma.h"
+#include "hardware/sync.h"
+#include <string.h>
+
+#include "fpga_batch.h"
+#include "fpga_bus.h"
+
+static int batch_tx_dma = -1;
+static int batch_rx_dma = -1;
+static dma_channel_config batch_tx_dma_cfg;
+static dma_channel_config batch_rx_dma_cfg;
+
+void fpga_batch_init(Fpga_Batch* batch)
+{
+    batch->count = 0;
+    batch->busy = false;
+    batch->callback = NULL;
+    batch->context = NULL;
+}
+
+// queue a register write, returns false if the batch is full
+bool fpga_batch_write(Fpga_Batch* batch, uint8_t reg, uint8_t data)
+{
+    if (batch->count >= FPGA_BATCH_MAX_FRAMES)
+        return(false);
+    batch->txframes[batch->count] = (reg << 8) | data;
+    batch->readdest[batch->count] = NULL;
+    batch->count++;
+    return(true);
+}
+
+// queue a register read, the byte is stored at dest when the batch finishes, returns false if the batch is full
+bool fpga_batch_read(Fpga_Batch* batch, uint8_t reg, uint8_t* dest)
+{
+    if (batch->count >= FPGA_BATCH_MAX_FRAMES)
+        return(false);
+    batch->txframes[batch->count] = reg << 8;
+    batch->readdest[batch->count] = dest;
+    batch->count++;
+    return(true);
+}
+
+// start sending the batch and return immediately, the callback may be NULL
+void fpga_batch_start(Fpga_Batch* batch, fpga_batch_callback_t callback, void* context)
+{
+    if (batch_tx_dma < 0){
+        // grab two unused DMA channels the first time through
+        batch_tx_dma = dma_claim_unused_channel(true);
+        batch_rx_dma = dma_claim_unused_channel(true);
+        batch_tx_dma_cfg = dma_channel_get_default_config(batch_tx_dma);
+        channel_config_set_transfer_data_size(&batch_tx_dma_cfg, DMA_SIZE_16);
+        channel_config_set_read_increment(&batch_tx_dma_cfg, true);
+        channel_config_set_write_increment(&batch_tx_dma_cfg, false);
+        channel_config_set_dreq(&batch_tx_dma_cfg, fpga_bus_tx_dreq());
+        batch_rx_dma_cfg = dma_channel_get_default_config(batch_rx_dma);
+        channel_config_set_transfer_data_size(&batch_rx_dma_cfg, DMA_SIZE_16);
+        channel_config_set_read_increment(&batch_rx_dma_cfg, false);
+        channel_config_set_write_increment(&batch_rx_dma_cfg, true);
+        channel_config_set_dreq(&batch_rx_dma_cfg, fpga_bus_rx_dreq());
+    }
+    batch->callback = callback;
+    batch->context = context;
+    batch->busy = true;
+    if (batch->count == 0)
+        return; // finished at the next poll
+    fpga_bus_frames_begin();
+    dma_channel_configure(batch_tx_dma, &batch_tx_dma_cfg, fpga_bus_tx_fifo(), batch->txframes, batch->count, false);
+    dma_channel_configure(batch_rx_dma, &batch_rx_dma_cfg, batch->rxframes, fpga_bus_rx_fifo(), batch->count, false);
+    dma_start_channel_mask((1u << batch_tx_dma) | (1u << batch_rx_dma));
+}
+
+// finish the batch if the last frame is done, returns true when the batch is no longer running
+// The RX channel completes only after the last frame is off the wire.
+bool fpga_batch_poll(Fpga_Batch* batch)
+{
+    if (!batch->busy)
+        return(true);
+    if ((batch->count > 0) && dma_channel_is_busy(batch_rx_dma))
+        return(false);
+    if (batch->count > 0){
+        fpga_bus_frames_end();
+        for (int i = 0; i < batch->count; i++){
+            if (batch->readdest[i] != NULL)
+                *batch->readdest[i] = batch->rxframes[i] & 0xff;
+        }
+    }
+    batch->busy = false;
+    if (batch->callback != NULL)
+        batch->callback(batch->context);
+    return(true);
+}
+
+void fpga_batch_wait(Fpga_Batch* batch)
+{
+    while (!fpga_batch_poll(batch))
+        tight_loop_contents();
+}
+
+// send the batch and wait for it, then empty it so it can be reused
+// Interrupts are held off for the whole batch because the emulator's command event interrupt also reads FPGA registers.
+void fpga_batch_run(Fpga_Batch* batch)
+{
+    uint32_t saved_irq = save_and_disable_interrupts();
+    fpga_batch_start(batch, NULL, NULL);
+    fpga_batch_wait(batch);
+    restore_interrupts(saved_irq);
+    batch->count = 0;
+}
@@ -0,0 +1,29 @@
+// *********************************************************************************
+// fpga_bus.h
+//   header for the CPU to FPGA register link
+// *********************************************************************************
+//
+
+// set to 0 to run the FPGA link on the SPI port with software CS instead of the PIO state machine
+#ifndef FPGA_BUS_PIO
+#define FPGA_BUS_PIO 1
+#endif
+
+void fpga_bus_init();
+uint8_t fpga_bus_transfer(uint8_t reg, uint8_t data);
+
+// DMA access to the link as 16-bit [register][data] frames, the read data is in the low byte of each received frame
+void fpga_bus_frames_begin();
+void fpga_bus_frames_end();
+volatile void* fpga_bus_tx_fifo();
+volatile void* fpga_bus_rx_fifo();
+uint fpga_bus_tx_dreq();
+uint fpga_bus_rx_dreq();
+
+#if FPGA_BUS_PIO
+// DRAM streams, the DRAM address must already be loaded
+void fpga_bus_dram_write_start(const uint8_t* bp, int count);
+void fpga_bus_dram_fill_start(const uint8_t* fillbytes, int count);
+void fpga_bus_dram_wait();
+void fpga_bus_dram_read(uint8_t* bp, int count);
+#endif
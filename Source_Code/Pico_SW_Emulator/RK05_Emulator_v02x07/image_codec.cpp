@@ -0,0 +1,230 @@
+// *********************************************************************************
+// image_codec.cpp
+//   sector record encodings used in .rke image format 2.0
+//
+//   Most packs are mostly empty, so the sector bodies are stored with PackBits run
+//   length encoding. It needs no tables or history buffer, it encodes and decodes
+//   in one pass straight between the sector buffers, and a sector body can never
+//   grow by more than 1 byte in 128. A body that doesn't get smaller is stored raw.
+//   A freshly formatted pack is mostly sectors whose body is one 16-bit word over
+//   and over, so those are stored as a fill record holding just that word.
+//
+//   A record can carry a CRC-32 so a corrupted image file is caught when it is
+//   loaded. It covers the record as it is stored in the file, so it is checked
+//   from the buffer the record is parsed from and costs no extra pass over the card.
+//
+//   Each PackBits block starts with a control byte n:
+//     0 to 127      n + 1 literal bytes follow
+//     129 to 255    the next byte is repeated 257 - n times (2 to 128 times)
+//     128           no operation
+// *********************************************************************************
+// 
+#include <stdio.h>
+#include "pico/stdlib.h"
+#include <string.h>
+
+#include "image_codec.h"
+
+#define PACKBITS_MAX_RUN 128
+
+static uint32_t crc32_table[256];
+static bool crc32_table_ready = false;
+
+// encode count bytes from src into dst, returns the encoded length or -1 if it would be longer than dstmax
+int packbits_encode(const uint8_t* src, int count, uint8_t* dst, int dstmax)
+{
+    int in = 0;
+    int out = 0;
+
+    while (in < count){
+        // measure the run of identical bytes starting here
+        int run = 1;
+        while (((in + run) < count) && (run < PACKBITS_MAX_RUN) && (src[in + run] == src[in]))
+            run++;
+        if (run >= 3){
+            if ((out + 2) > dstmax)
+                return(-1);
+            dst[out++] = (uint8_t)(257 - run);
+            dst[out++] = src[in];
+            in += run;
+            continue;
+        }
+        // literal block, up to the start of the next run of 3 or more identical bytes
+        int literal = 0;
+        while (((in + literal) < count) && (literal < PACKBITS_MAX_RUN)){
+            int i = in + literal;
+            if (((i + 2) < count) && (src[i] == src[i + 1]) && (src[i] == src[i + 2]))
+                break;
+            literal++;
+        }
+        if ((out + 1 + literal) > dstmax)
+            return(-1);
+        dst[out++] = (uint8_t)(literal - 1);
+        memcpy(&dst[out], &src[in], literal);
+        out += literal;
+        in += literal;
+    }
+    return(out);
+}
+
+// decode exactly count bytes into dst from the srclen bytes at src, anything in src after that is ignored
+// returns false if the encoded data is corrupt
+bool packbits_decode(const uint8_t* src, int srclen, uint8_t* dst, int count)
+{
+    int in = 0;
+    int out = 0;
+
+    while (out < count){
+        if (in >= srclen)
+            return(false);
+        int n = src[in++];
+        if (n < 128){
+            int literal = n + 1;
+            if (((in + literal) > srclen) || ((out + literal) > count))
+                return(false);
+            memcpy(&dst[out], &src[in], literal);
+            in += literal;
+            out += literal;
+        }
+        else if (n > 128){
+            int run = 257 - n;
+            if ((in >= srclen) || ((out + run) > count))
+                return(false);
+            memset(&dst[out], src[in++], run);
+            out += run;
+        }
+    }
+    return(true);
+}
+
+// true if the body is one 16-bit word repeated, the DRAM byte order is kept so the word is body[0] then body[1]
+bool image_body_is_fill(const uint8_t* body, int count)
+{
+    if ((count < 2) || (count & 1))
+        return(false);
+    for (int i = 2; i < count; i += 2){
+        if ((body[i] != body[0]) || (body[i + 1] != body[1]))
+            return(false);
+    }
+    return(true);
+}
+
+// decode count body bytes into dst from a sector record body of srclen bytes, returns false if it is corrupt
+bool image_decode_body(int encoding, const uint8_t* src, int srclen, uint8_t* dst, int count)
+{
+    switch (encoding){
+    case IMAGE_ENC_RAW:
+        if (srclen < count)
+            return(false);
+        memcpy(dst, src, count);
+        return(true);
+    case IMAGE_ENC_PACKBITS:
+        return(packbits_decode(src, srclen, dst, count));
+    case IMAGE_ENC_FILL:
+        if ((srclen < 2) || (count & 1))
+            return(false);
+        for (int i = 0; i < count; i += 2){
+            dst[i] = src[0];
+            dst[i + 1] = src[1];
+        }
+        return(true);
+    default:
+        return(false);
+    }
+}
+
+// length of the format 2.0 record header for a record with these flags
+int image_record_header_length(int flags)
+{
+    return(IMAGE_RECORD_HEADER_V2 + ((flags & IMAGE_FLAG_CRC32) ? IMAGE_RECORD_CRC_LEN : 0));
+}
+
+// update crc with count bytes from p, the standard CRC-32 (as used by zip) of a buffer is image_crc32(0, p, count)
+// The 1 KB table is built in RAM the first time, reading it from flash would be slower.
+uint32_t image_crc32(uint32_t crc, const uint8_t* p, int count)
+{
+    if (!crc32_table_ready){
+        for (uint32_t i = 0; i < 256; i++){
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+            crc32_table[i] = c;
+        }
+        crc32_table_ready = true;
+    }
+    crc = ~crc;
+    for (int i = 0; i < count; i++)
+        crc = crc32_table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    return(~crc);
+}
+
+// CRC-32 of a format 2.0 record, the header bytes without the CRC field and then the stored body
+static uint32_t image_record_crc(const uint8_t* record)
+{
+    int storedbody = (record[7] << 8) | record[6];
+    uint32_t crc = image_crc32(0, record, IMAGE_RECORD_HEADER_V2);
+    return(image_crc32(crc, &record[IMAGE_RECORD_HEADER_V2 + IMAGE_RECORD_CRC_LEN], storedbody));
+}
+
+// check the CRC of a whole format 2.0 record in memory, a record without a CRC always passes
+bool image_record_crc_ok(const uint8_t* record)
+{
+    if (!(record[5] & IMAGE_FLAG_CRC32))
+        return(true);
+    uint32_t crc = record[8] | (record[9] << 8) | (record[10] << 16) | ((uint32_t)record[11] << 24);
+    return(crc == image_record_crc(record));
+}
+
+// build a format 2.0 sector record in out from a raw sector (4 bytes of length fields followed by the body)
+// A uniform body is always stored as a fill record. Otherwise, if storedbody is 0 the body is stored in whichever encoding is shorter. Otherwise the record has to fill exactly
+// storedbody body bytes so it can replace a record in place, and -1 is returned if the sector doesn't fit.
+// flags is IMAGE_FLAG_CRC32 to add a CRC to the record, or 0. Returns the length of the record.
+int image_encode_record_v2(const uint8_t* raw, int rawcount, int storedbody, int flags, uint8_t* out)
+{
+    int bodycount = rawcount - 4;
+    int headerlength = image_record_header_length(flags);
+    uint8_t* body = &out[headerlength];
+    int encoding;
+    int encodedcount;
+
+    if (image_body_is_fill(&raw[4], bodycount) && ((storedbody == 0) || (storedbody >= 2))){
+        encoding = IMAGE_ENC_FILL;
+        encodedcount = 2;
+        body[0] = raw[4];
+        body[1] = raw[5];
+    }
+    else if ((storedbody > 0) && (bodycount <= storedbody)){
+        encoding = IMAGE_ENC_RAW;
+        encodedcount = bodycount;
+    }
+    else{
+        // PackBits is only worth it if the body gets shorter
+        encoding = IMAGE_ENC_PACKBITS;
+        encodedcount = packbits_encode(&raw[4], bodycount, body, (storedbody > 0) ? storedbody : (bodycount - 1));
+        if (encodedcount < 0){
+            if (storedbody > 0)
+                return(-1);
+            encoding = IMAGE_ENC_RAW;
+            encodedcount = bodycount;
+        }
+    }
+    if (encoding == IMAGE_ENC_RAW)
+        memcpy(body, &raw[4], bodycount);
+    if (storedbody == 0)
+        storedbody = encodedcount;
+    memset(&body[encodedcount], 0, storedbody - encodedcount);
+
+    memcpy(out, raw, 4);
+    out[4] = encoding;
+    out[5] = flags & IMAGE_FLAG_CRC32;
+    out[6] = storedbody & 0xff;
+    out[7] = (storedbody >> 8) & 0xff;
+    if (flags & IMAGE_FLAG_CRC32){
+        uint32_t crc = image_record_crc(out);
+        out[8] = crc & 0xff;
+        out[9] = (crc >> 8) & 0xff;
+        out[10] = (crc >> 16) & 0xff;
+        out[11] = (crc >> 24) & 0xff;
+    }
+    return(headerlength + storedbody);
+}
@@ -0,0 +1,33 @@
+// *********************************************************************************
+// image_codec.h
+//   header for the sector record encodings used in .rke image format 2.0
+// *********************************************************************************
+// 
+
+// format 2.0 sector record header, all values little endian
+//   bytes 0-1  bit times from sector pulse to start bit, same as format 1.1
+//   bytes 2-3  number of data bits after the start bit, same as format 1.1
+//   byte  4    encoding of the sector body
+//   byte  5    flags
+//   bytes 6-7  number of body bytes stored in the file, the encoded data may be shorter and the rest is padding
+//   bytes 8-11 only if IMAGE_FLAG_CRC32 is set, CRC-32 of header bytes 0-7 and the stored body bytes
+#define IMAGE_RECORD_HEADER_V2 8
+#define IMAGE_RECORD_CRC_LEN 4
+#define IMAGE_RECORD_HEADER_V2_MAX (IMAGE_RECORD_HEADER_V2 + IMAGE_RECORD_CRC_LEN)
+
+// sector record flags
+#define IMAGE_FLAG_CRC32 0x01  // the record header has a CRC-32 of the record
+
+// sector body encodings
+#define IMAGE_ENC_RAW      0   // the body bytes as they are in DRAM
+#define IMAGE_ENC_PACKBITS 1   // PackBits run length encoding of the body bytes
+#define IMAGE_ENC_FILL     2   // every 16-bit word of the body is the same, the 2 bytes of one word are stored
+
+int packbits_encode(const uint8_t* src, int count, uint8_t* dst, int dstmax);
+bool packbits_decode(const uint8_t* src, int srclen, uint8_t* dst, int count);
+bool image_body_is_fill(const uint8_t* body, int count);
+bool image_decode_body(int encoding, const uint8_t* src, int srclen, uint8_t* dst, int count);
+int image_encode_record_v2(const uint8_t* raw, int rawcount, int storedbody, int flags, uint8_t* out);
+int image_record_header_length(int flags);
+uint32_t image_crc32(uint32_t crc, const uint8_t* p, int count);
+bool image_record_crc_ok(const uint8_t* record);
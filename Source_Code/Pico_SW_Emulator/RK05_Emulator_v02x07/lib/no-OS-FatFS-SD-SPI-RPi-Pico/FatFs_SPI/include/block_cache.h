@@ -0,0 +1,38 @@
+/* block_cache.h
+Small cache of 512-byte card blocks between FatFs and the SD card driver.
+See block_cache.c.
+*/
+#pragma once
+
+#include <stdint.h>
+//
+#include "ff.h"
+#include "sd_card.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    uint32_t hits;             // single block reads found in the cache
+    uint32_t misses;           // single block reads that went to the card
+    uint32_t direct;           // multi-block reads, always from the card
+    uint32_t prefetches;       // read-ahead transfers started
+    uint32_t prefetch_blocks;  // blocks read ahead
+    uint32_t prefetch_hits;    // single block reads found in the read-ahead blocks
+    uint32_t writes;           // write requests, written through to the card
+} block_cache_stats_t;
+
+int block_cache_read(sd_card_t *p_sd, BYTE *buff, LBA_t sector, UINT count);
+int block_cache_write(sd_card_t *p_sd, const BYTE *buff, LBA_t sector, UINT count);
+void block_cache_invalidate(void);
+void block_cache_invalidate_range(LBA_t sector, UINT count);
+void block_cache_pin_range(LBA_t sector, LBA_t count);
+void block_cache_get_stats(block_cache_stats_t *stats);
+void block_cache_reset_stats(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+/* [] END OF FILE */
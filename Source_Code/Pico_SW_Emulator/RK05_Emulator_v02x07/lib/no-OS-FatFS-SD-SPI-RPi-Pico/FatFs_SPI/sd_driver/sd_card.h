@@ -86,6 +86,38 @@ struct sd_card_t {
 bool sd_card_detect(sd_card_t *pSD);
 uint64_t sd_sectors(sd_card_t *pSD);
 
+// Background block transfers, see sd_card.c. The callback is called from sd_async_poll() or
+// sd_async_wait() once the card is unlocked, so it may start the next transfer.
+typedef void (*sd_async_callback_t)(sd_card_t *sd_card_p, int status, void *context);
+int sd_read_blocks_async(sd_card_t *sd_card_p, uint8_t *buffer, uint64_t ulSectorNumber,
+                         uint32_t ulSectorCount, sd_async_callback_t callback, void *context);
+int sd_write_blocks_async(sd_card_t *sd_card_p, const uint8_t *buffer, uint64_t ulSectorNumber,
+                          uint32_t blockCnt, sd_async_callback_t callback, void *context);
+bool sd_async_poll(sd_card_t *sd_card_p);
+int sd_async_wait(sd_card_t *sd_card_p);
+
+// Card statistics, see sd_card.c. Bucket 0 of a latency histogram counts transfers under
+// 128 us, each following bucket doubles the limit and the last one counts everything longer.
+#define SD_STATS_BUCKETS 12
+enum { SD_STATS_CMD17, SD_STATS_CMD18, SD_STATS_CMD24, SD_STATS_CMD25, SD_STATS_COMMANDS };
+typedef struct {
+    uint32_t count;                        // transfers
+    uint32_t blocks;                       // 512-byte blocks moved
+    uint64_t total_us;                     // time from the command to the end of the transfer
+    uint32_t max_us;                       // longest transfer
+    uint32_t histogram[SD_STATS_BUCKETS];  // transfers by time
+} sd_command_stats_t;
+typedef struct {
+    sd_command_stats_t command[SD_STATS_COMMANDS];  // CMD17, CMD18, CMD24, CMD25
+    uint64_t busy_us;                      // time spent waiting for the card to be ready
+    uint32_t retries;                      // commands sent again after no response
+    uint32_t crc_errors;                   // command and data CRC errors
+    uint32_t timeouts;                     // data tokens or blocks that didn't arrive in time
+    uint32_t errors;                       // transfers that failed
+} sd_stats_t;
+void sd_get_stats(sd_stats_t *stats);
+void sd_reset_stats(void);
+
 bool sd_init_driver();
 bool sd_card_detect(sd_card_t *sd_card_p);
 
@@ -86,10 +86,12 @@ bool sd_spi_transfer(sd_card_t *pSD, const uint8_t *tx, uint8_t *rx,
     return spi_transfer(pSD->spi, tx, rx, length);
 }
 
+// Single bytes are sent without DMA, setting up a DMA transfer and taking its interrupt costs more than the byte.
+// This is also called from the DMA interrupt during a background block transfer, where spi_transfer() can't be used.
 uint8_t sd_spi_write(sd_card_t *pSD, const uint8_t value) {
     // TRACE_PRINTF("%s\n", __FUNCTION__);
     uint8_t received = SPI_FILL_CHAR;
-#if 0
+#if 1
     int num = spi_write_read_blocking(pSD->spi->hw_inst, &value, &received, 1);    
     myASSERT(1 == num);
 #else
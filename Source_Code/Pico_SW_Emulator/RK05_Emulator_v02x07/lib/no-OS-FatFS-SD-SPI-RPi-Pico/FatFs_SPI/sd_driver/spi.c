@@ -45,7 +45,10 @@ static void __not_in_flash_func(spi_irq_handler)() {
             if (spi_p) {                    // Ours?
                 *dma_hw_ints_p = 1u << ch;  // Clear it.
                 myASSERT(!dma_channel_is_busy(spi_p->rx_dma));
-                sem_release(&spi_p->sem);
+                if (spi_p->dma_done)
+                    spi_p->dma_done(spi_p->dma_done_context);
+                else
+                    sem_release(&spi_p->sem);
             }
         }
     }
@@ -56,15 +59,12 @@ void set_spi_dma_irq_channel(bool useChannel1, bool shared) {
     irqShared = shared;
 }
 
-// SPI Transfer: Read & Write (simultaneously) on SPI bus
-//   If the data that will be received is not important, pass NULL as rx.
-//   If the data that will be transmitted is not important,
-//     pass NULL as tx and then the SPI_FILL_CHAR is sent out as each data
-//     element.
-bool spi_transfer(spi_t *pSPI, const uint8_t *tx, uint8_t *rx, size_t length) {
-    // myASSERT(512 == length || 1 == length);
+// Start a DMA transfer on the SPI bus and return without waiting for it.
+//   The end of the transfer is signalled from the DMA interrupt, either by
+//   calling pSPI->dma_done or, when that is NULL, by releasing pSPI->sem for
+//   spi_transfer_wait_complete().
+void spi_transfer_start(spi_t *pSPI, const uint8_t *tx, uint8_t *rx, size_t length) {
     myASSERT(tx || rx);
-    // myASSERT(!(tx && rx));
 
     // tx write increment is already false
     if (tx) {
@@ -102,12 +102,13 @@ bool spi_transfer(spi_t *pSPI, const uint8_t *tx, uint8_t *rx, size_t length) {
     // start them exactly simultaneously to avoid races (in extreme cases
     // the FIFO could overflow)
     dma_start_channel_mask((1u << pSPI->tx_dma) | (1u << pSPI->rx_dma));
+}
 
-    /* Timeout 1 sec */
-    uint32_t timeOut = 1000;
+// Wait for a transfer started with spi_transfer_start() to finish
+bool spi_transfer_wait_complete(spi_t *pSPI, uint32_t timeout_ms) {
     /* Wait until master completes transfer or time out has occured. */
     bool rc = sem_acquire_timeout_ms(
-        &pSPI->sem, timeOut);  // Wait for notification from ISR
+        &pSPI->sem, timeout_ms);  // Wait for notification from ISR
     if (!rc) {
         // If the timeout is reached the function will return false
         DBG_PRINTF("Notification wait timed out in %s\n", __FUNCTION__);
@@ -123,6 +124,17 @@ bool spi_transfer(spi_t *pSPI, const uint8_t *tx, uint8_t *rx, size_t length) {
     return true;
 }
 
+// SPI Transfer: Read & Write (simultaneously) on SPI bus
+//   If the data that will be received is not important, pass NULL as rx.
+//   If the data that will be transmitted is not important,
+//     pass NULL as tx and then the SPI_FILL_CHAR is sent out as each data
+//     element.
+bool spi_transfer(spi_t *pSPI, const uint8_t *tx, uint8_t *rx, size_t length) {
+    spi_transfer_start(pSPI, tx, rx, length);
+    /* Timeout 1 sec */
+    return spi_transfer_wait_complete(pSPI, 1000);
+}
+
 void spi_lock(spi_t *pSPI) {
     myASSERT(mutex_is_initialized(&pSPI->mutex));
     mutex_enter_blocking(&pSPI->mutex);
@@ -0,0 +1,193 @@
+/* block_cache.c
+Small cache of 512-byte card blocks between FatFs and the SD card driver.
+
+With FF_FS_TINY 0 FatFs keeps one window for the FAT and directory and one
+buffer per open file, so following a cluster chain or reading a file in
+small pieces reads the same few blocks from the card over and over. The
+cache keeps the last BLOCK_CACHE_BLOCKS single-block reads, replaced least
+recently used first.
+
+Blocks in the FAT, set with block_cache_pin_range() after the volume is
+mounted, are pinned: a data block never replaces one. Up to
+BLOCK_CACHE_PINNED_MAX entries can hold FAT blocks, after that a new FAT
+block replaces the least recently used FAT block.
+
+When single-block reads walk through consecutive blocks, the next miss reads
+BLOCK_CACHE_READAHEAD blocks with one multi-block read into a separate
+read-ahead buffer and the following reads are served from there.
+
+Multi-block reads from FatFs go straight to the card. Writes go straight
+through to the card and update any cached copy. Anything that writes to the
+card without going through FatFs must call block_cache_invalidate_range().
+The whole cache is dropped when the card is initialized, in case it was
+swapped.
+*/
+
+#include <string.h>
+//
+#include "block_cache.h"
+
+#define BLOCK_SIZE 512
+#define BLOCK_CACHE_BLOCKS 16
+#define BLOCK_CACHE_PINNED_MAX 8
+#define BLOCK_CACHE_READAHEAD 8
+
+typedef struct {
+    LBA_t sector;
+    uint32_t used;  // LRU stamp
+    bool valid;
+    bool pinned;
+} cache_entry_t;
+
+static cache_entry_t entries[BLOCK_CACHE_BLOCKS];
+static BYTE cache_data[BLOCK_CACHE_BLOCKS][BLOCK_SIZE] __attribute__((aligned(4)));
+static uint32_t lru_clock;
+
+static BYTE readahead_data[BLOCK_CACHE_READAHEAD][BLOCK_SIZE] __attribute__((aligned(4)));
+static LBA_t readahead_sector;  // first block in readahead_data
+static UINT readahead_count;    // number of valid blocks in readahead_data, 0 if none
+
+static LBA_t next_sector;       // block after the last single-block read
+static LBA_t fat_start;         // pinned range, see block_cache_pin_range()
+static LBA_t fat_count;
+
+static block_cache_stats_t stats;
+
+static bool is_fat_block(LBA_t sector) {
+    return (sector >= fat_start) && (sector - fat_start < fat_count);
+}
+
+static int cache_find(LBA_t sector) {
+    for (int i = 0; i < BLOCK_CACHE_BLOCKS; i++)
+        if (entries[i].valid && entries[i].sector == sector) return i;
+    return -1;
+}
+
+static BYTE *readahead_find(LBA_t sector) {
+    if (readahead_count && sector >= readahead_sector && sector - readahead_sector < readahead_count)
+        return readahead_data[sector - readahead_sector];
+    return NULL;
+}
+
+// pick the entry for a new block, a free one first, otherwise the least recently used one it may replace
+static int cache_victim(bool pinned) {
+    int pinned_entries = 0;
+    int lru_unpinned = -1;
+    int lru_pinned = -1;
+    for (int i = 0; i < BLOCK_CACHE_BLOCKS; i++) {
+        if (!entries[i].valid) return i;
+        if (entries[i].pinned) {
+            pinned_entries++;
+            if (lru_pinned < 0 || (int32_t)(entries[i].used - entries[lru_pinned].used) < 0) lru_pinned = i;
+        } else if (lru_unpinned < 0 || (int32_t)(entries[i].used - entries[lru_unpinned].used) < 0) {
+            lru_unpinned = i;
+        }
+    }
+    if (pinned && (pinned_entries >= BLOCK_CACHE_PINNED_MAX || lru_unpinned < 0)) return lru_pinned;
+    return lru_unpinned;
+}
+
+static void cache_insert(LBA_t sector, const BYTE *data) {
+    int i = cache_find(sector);
+    if (i < 0) {
+        bool pinned = is_fat_block(sector);
+        i = cache_victim(pinned);
+        entries[i].sector = sector;
+        entries[i].pinned = pinned;
+        entries[i].valid = true;
+    }
+    memcpy(cache_data[i], data, BLOCK_SIZE);
+    entries[i].used = ++lru_clock;
+}
+
+// read a block that isn't cached, with read-ahead when the reads are sequential
+static int read_miss(sd_card_t *p_sd, BYTE *buff, LBA_t sector) {
+    if (sector == next_sector && sector != 0) {
+        UINT n = BLOCK_CACHE_READAHEAD;
+        uint64_t sectors = p_sd->sectors;
+        if (sector + n > sectors) n = (UINT)(sectors - sector);
+        if (n > 1) {
+            readahead_count = 0;
+            int rc = p_sd->read_blocks(p_sd, readahead_data[0], sector, n);
+            if (SD_BLOCK_DEVICE_ERROR_NONE != rc) return rc;
+            readahead_sector = sector;
+            readahead_count = n;
+            stats.prefetches++;
+            stats.prefetch_blocks += n;
+            memcpy(buff, readahead_data[0], BLOCK_SIZE);
+            return SD_BLOCK_DEVICE_ERROR_NONE;
+        }
+    }
+    return p_sd->read_blocks(p_sd, buff, sector, 1);
+}
+
+int block_cache_read(sd_card_t *p_sd, BYTE *buff, LBA_t sector, UINT count) {
+    if (count != 1) {
+        stats.direct++;
+        return p_sd->read_blocks(p_sd, buff, sector, count);
+    }
+    int i = cache_find(sector);
+    if (i >= 0) {
+        stats.hits++;
+        memcpy(buff, cache_data[i], BLOCK_SIZE);
+        entries[i].used = ++lru_clock;
+    } else {
+        BYTE *p = readahead_find(sector);
+        if (p) {
+            stats.prefetch_hits++;
+            memcpy(buff, p, BLOCK_SIZE);
+        } else {
+            stats.misses++;
+            int rc = read_miss(p_sd, buff, sector);
+            if (SD_BLOCK_DEVICE_ERROR_NONE != rc) return rc;
+        }
+        cache_insert(sector, buff);
+    }
+    next_sector = sector + 1;
+    return SD_BLOCK_DEVICE_ERROR_NONE;
+}
+
+int block_cache_write(sd_card_t *p_sd, const BYTE *buff, LBA_t sector, UINT count) {
+    stats.writes++;
+    int rc = p_sd->write_blocks(p_sd, buff, sector, count);
+    if (SD_BLOCK_DEVICE_ERROR_NONE != rc) {
+        // the blocks on the card are unknown now
+        block_cache_invalidate_range(sector, count);
+        return rc;
+    }
+    for (UINT n = 0; n < count; n++) {
+        const BYTE *data = buff + n * BLOCK_SIZE;
+        int i = cache_find(sector + n);
+        if (i >= 0) memcpy(cache_data[i], data, BLOCK_SIZE);
+        BYTE *p = readahead_find(sector + n);
+        if (p) memcpy(p, data, BLOCK_SIZE);
+    }
+    return rc;
+}
+
+void block_cache_invalidate(void) {
+    for (int i = 0; i < BLOCK_CACHE_BLOCKS; i++) entries[i].valid = false;
+    readahead_count = 0;
+    next_sector = 0;
+}
+
+void block_cache_invalidate_range(LBA_t sector, UINT count) {
+    for (int i = 0; i < BLOCK_CACHE_BLOCKS; i++)
+        if (entries[i].valid && entries[i].sector >= sector && entries[i].sector - sector < count)
+            entries[i].valid = false;
+    if (readahead_count && sector < readahead_sector + readahead_count && readahead_sector < sector + count)
+        readahead_count = 0;
+}
+
+// the FAT blocks, normally fatbase and fsize * n_fats from the FATFS object after f_mount()
+void block_cache_pin_range(LBA_t sector, LBA_t count) {
+    fat_start = sector;
+    fat_count = count;
+    for (int i = 0; i < BLOCK_CACHE_BLOCKS; i++) entries[i].pinned = is_fat_block(entries[i].sector);
+}
+
+void block_cache_get_stats(block_cache_stats_t *p) { *p = stats; }
+
+void block_cache_reset_stats(void) { memset(&stats, 0, sizeof stats); }
+
+/* [] END OF FILE */
@@ -28,6 +28,7 @@ specific language governing permissions and limitations under the License.
 #include "hw_config.h"
 #include "my_debug.h"
 #include "sd_card.h"
+#include "block_cache.h"
 
 #define TRACE_PRINTF(fmt, args...)
 //#define TRACE_PRINTF printf  // task_printf
@@ -59,10 +60,18 @@ DSTATUS disk_initialize(
 
     sd_card_t *p_sd = sd_get_by_num(pdrv);
     if (!p_sd) return RES_PARERR;
+    // a new initialization may be a different card
+    if (p_sd->m_Status & STA_NOINIT) block_cache_invalidate();
     // See http://elm-chan.org/fsw/ff/doc/dstat.html
     return p_sd->init(p_sd);  
 }
 
+/* Called after a CRC error, the application can lower the SPI clock and return true to retry the transfer once. */
+__attribute__((weak)) bool sd_clock_fallback(sd_card_t *p_sd) {
+    (void)p_sd;
+    return false;
+}
+
 static int sdrc2dresult(int sd_rc) {
     switch (sd_rc) {
         case SD_BLOCK_DEVICE_ERROR_NONE:
@@ -98,7 +107,9 @@ DRESULT disk_read(BYTE pdrv,  /* Physical drive nmuber to identify the drive */
     TRACE_PRINTF(">>> %s\n", __FUNCTION__);
     sd_card_t *p_sd = sd_get_by_num(pdrv);
     if (!p_sd) return RES_PARERR;
-    int rc = p_sd->read_blocks(p_sd, buff, sector, count);
+    int rc = block_cache_read(p_sd, buff, sector, count);
+    if ((SD_BLOCK_DEVICE_ERROR_CRC == rc) && sd_clock_fallback(p_sd))
+        rc = block_cache_read(p_sd, buff, sector, count);
     return sdrc2dresult(rc);
 }
 
@@ -116,7 +127,9 @@ DRESULT disk_write(BYTE pdrv, /* Physical drive nmuber to identify the drive */
     TRACE_PRINTF(">>> %s\n", __FUNCTION__);
     sd_card_t *p_sd = sd_get_by_num(pdrv);
     if (!p_sd) return RES_PARERR;
-    int rc = p_sd->write_blocks(p_sd, buff, sector, count);
+    int rc = block_cache_write(p_sd, buff, sector, count);
+    if ((SD_BLOCK_DEVICE_ERROR_CRC == rc) && sd_clock_fallback(p_sd))
+        rc = block_cache_write(p_sd, buff, sector, count);
     return sdrc2dresult(rc);
 }
 
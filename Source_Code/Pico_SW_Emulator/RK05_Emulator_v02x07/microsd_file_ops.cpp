@@ -5,7 +5,9 @@
 // 
 #include <stdio.h>
 #include "pico/stdlib.h"
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 //#include "hardware/spi.h"
 #include "ff.h" /* Obtains integer types */
@@ -13,14 +15,18 @@
 #include "sd_card.h"
 #include "ff.h"
 #include "hw_config.h"
+#include "block_cache.h"
 
 #include "disk_state_definitions.h"
 #include "display_functions.h"
 #include "emulator_state_definitions.h"
 #include "emulator_hardware.h"
+#include "emulator_transfer.h"
+#include "emulator_events.h"
+#include "image_codec.h"
+#include "sd_clock.h"
+#include "microsd_file_ops.h"
 
-// max sector for 4 sector pack, 2% speed variation, ((40 msec / 4 sectors) * 1.6e6 bits/sec * 1.02) / 8 bits/byte + 4 bytes length fields = 2044
-#define MAX_SECTOR_SIZE 2044 
 #define FILE_OPS_OKAY   0
 #define FILE_OPS_ERROR  1
 
@@ -30,7 +36,47 @@ static int ret;
 
 //const char configfilename[] = "config.txt";
 static char diskimagefilename[FF_LFN_BUF + 1] = "";
-static uint8_t sectordata[MAX_SECTOR_SIZE];  // largest possible sector data is 580 for RK11-E
+static uint8_t sectordata[MAX_SECTOR_SIZE];
+
+// image file format versions, format 2.0 adds an encoding to every sector record (see image_codec.h)
+// Files in either format are loaded. A full save keeps the format the file was loaded in, so format 1.1 images stay
+// readable by the RK11D Utility and the other tools that only know format 1.1. Set IMAGE_WRITE_FORMAT to
+// IMAGE_FORMAT_2_0 to convert format 1.1 images to format 2.0 when they are saved. An in-place save always keeps
+// the format of the file.
+#define IMAGE_FORMAT_1_1 11
+#define IMAGE_FORMAT_2_0 20
+#ifndef IMAGE_WRITE_FORMAT
+#define IMAGE_WRITE_FORMAT IMAGE_FORMAT_1_1
+#endif
+#define IMAGE_WRITE_FLAGS IMAGE_FLAG_CRC32  // format 2.0 records of a full save carry a CRC-32, set to 0 to leave it out
+#define MAX_IMAGE_RECORD_SIZE (MAX_SECTOR_SIZE + IMAGE_RECORD_HEADER_V2_MAX - 4) // largest sector record in the file
+static int imageformat = IMAGE_FORMAT_1_1;  // format of the open image file
+static int imagerecordflags = 0;            // flags of every format 2.0 record in the open file, -1 if they are not all the same
+static uint8_t recorddata[MAX_IMAGE_RECORD_SIZE]; // a sector record encoded for the file
+
+// file offset of every sector record, recorded during the load so the sectors written by the controller can be
+// rewritten in place at unload. The extra entry at the end is the offset of the end of the image data.
+#define MAX_SECTOR_RECORDS (TRACK_MAX_CYLINDERS * TRACK_MAX_HEADS * TRACK_MAX_SECTORS)
+static uint32_t sectoroffset[MAX_SECTOR_RECORDS + 1];
+static bool sectoroffset_valid = false;
+static int sectoroffset_heads;      // geometry the sector offset index was built for
+static int sectoroffset_sectors;
+
+// cluster link map table for the open image file so f_lseek() to a sector record doesn't walk the FAT chain
+// Each fragment of the file takes 2 entries, plus 1 for the table size and 1 for the terminator.
+#define IMAGE_LINKMAP_SIZE 256
+static DWORD imagelinkmap[IMAGE_LINKMAP_SIZE];
+
+// When the image file is one contiguous run of clusters, the bulk load and save bypass FatFs and transfer whole
+// 512-byte blocks straight between the chunk buffer and the card with multi-block reads and writes.
+// The full rewrite at unload preallocates the file with f_expand() so it stays contiguous.
+#define IMAGE_HEADER_RESERVE 1024  // more than the largest header, the file is truncated to its real length after the save
+// image catalog, see the catalog section at the end of the file
+static bool catalog_select_image(int driveaddress);
+static void catalog_update(const char* imagename);
+
+static bool imageraw = false;      // the open image file is contiguous and imagelba is valid
+static LBA_t imagelba;             // card block number of the first byte of the image file
 
 static void force_unmount()
 {
@@ -39,6 +85,55 @@ static void force_unmount()
     // Force SD card reinitialization.
     sd_card_t *pSD = sd_get_by_num(0);
     pSD->m_Status |= STA_NOINIT;
+    sd_clock_reset();
+}
+
+// mount the card and tell the block cache where the FAT is so its blocks stay cached
+static FRESULT mount_card()
+{
+    FRESULT fr = f_mount(&fs, "0:", 1);
+    if (fr == FR_OK)
+        block_cache_pin_range(fs.fatbase, (LBA_t)fs.fsize * fs.n_fats);
+    return(fr);
+}
+
+// build the cluster link map for the open image file, if the file is too fragmented for the table
+// the file is still usable, seeks just fall back to following the FAT chain
+static void image_fast_seek_enable()
+{
+    imagelinkmap[0] = IMAGE_LINKMAP_SIZE;
+    fil.cltbl = imagelinkmap;
+    FRESULT fr = f_lseek(&fil, CREATE_LINKMAP);
+    imageraw = false;
+    if (fr != FR_OK){
+        printf("  fast seek not available for '%s' (%d), %d table entries needed\r\n", diskimagefilename, fr, (int)imagelinkmap[0]);
+        fil.cltbl = NULL;
+    }
+    else if ((imagelinkmap[0] == 4) && (fil.obj.sclust >= 2)){
+        // a single fragment takes 4 table entries, size + one (length, start cluster) pair + terminator
+        imagelba = fs.database + ((LBA_t)(fil.obj.sclust - 2) * fs.csize);
+        imageraw = true;
+    }
+}
+
+// total length of the sector records in the FPGA DRAM, read from the 4-byte length field at the start of each sector
+static FSIZE_t dram_image_data_size(struct Disk_State* dstate)
+{
+    FSIZE_t total = 0;
+    uint8_t lengthfields[4];
+
+    for (int cylindercount = 0; cylindercount < dstate->numberOfCylinders; cylindercount++){
+        for (int headcount = 0; headcount < dstate->numberOfHeads; headcount++){
+            for (int sectorcount = 0; sectorcount < dstate->numberOfSectorsPerTrack; sectorcount++){
+                load_ram_address((cylindercount << 14) | (headcount << 13) | (sectorcount << 9));
+                readbytes(lengthfields, 4);
+                int sector_data_bit_count = (lengthfields[3] << 8) | lengthfields[2];
+                // a format 2.0 record is never longer than the raw sector plus the longer record header
+                total += (((sector_data_bit_count + 15) >> 4) * 2) + IMAGE_RECORD_HEADER_V2_MAX;
+            }
+        }
+    }
+    return(total);
 }
 
 int file_init_and_mount()
@@ -53,32 +148,36 @@ int file_init_and_mount()
     return(FILE_OPS_OKAY);
 }
 
-int file_open_read_disk_image()
+int file_open_read_disk_image(struct Disk_State* dstate)
 {
     DIR dir;
     FILINFO fno;
     FRESULT fr;
     printf("file_open_read_disk_image\r\n");
-    if ((fr = f_mount(&fs, "0:", 1)) != FR_OK){
+    if ((fr = mount_card()) != FR_OK){
         printf("*** ERROR, could not mount filesystem before open for read (%d)\r\n", fr);
         display_error((char *) "cannot mount", (char *) "filesystem");
         return(fr);
     }
+    sd_clock_setup();
 
-    // Find first disk image file name
-    fr = f_findfirst(&dir, &fno, "", "?*.rke");
-    f_closedir(&dir);
+    // Look up the image for the drive address in the catalog. If there is no usable catalog, for example on a
+    // write protected card, fall back to the first disk image file name in the directory.
+    if (!catalog_select_image(dstate->Drive_Address)) {
+        fr = f_findfirst(&dir, &fno, "", "?*.rke");
+        f_closedir(&dir);
 
-    if (fr != FR_OK) {
-        printf("*** ERROR, no disk image file available (%d)\r\n", fr);
-        display_error((char *) "no disk", (char *) "image found");
-        force_unmount();
-        return(fr);
-    }
+        if ((fr != FR_OK) || (fno.fname[0] == '\0')) {
+            printf("*** ERROR, no disk image file available (%d)\r\n", fr);
+            display_error((char *) "no disk", (char *) "image found");
+            force_unmount();
+            return((fr != FR_OK) ? fr : FR_NO_FILE);
+        }
 
-    // Save the file name
-    strncpy(diskimagefilename, fno.fname, FF_LFN_BUF);
-    diskimagefilename[FF_LFN_BUF] = '\0';
+        // Save the file name
+        strncpy(diskimagefilename, fno.fname, FF_LFN_BUF);
+        diskimagefilename[FF_LFN_BUF] = '\0';
+    }
 
     if ((fr = f_open(&fil, diskimagefilename, FA_READ))!= FR_OK){
         printf("*** ERROR, could not open disk image file for read (%d)\r\n", fr);
@@ -86,25 +185,59 @@ int file_open_read_disk_image()
         force_unmount();
         return(fr);
     }
+    image_fast_seek_enable();
     return(FILE_OPS_OKAY);
 }
 
-int file_open_write_disk_image()
+// create the image file and preallocate it as one contiguous run of clusters so the save can use raw block writes
+// If the card doesn't have enough contiguous free space then the file is written through FatFs as before.
+int file_open_write_disk_image(struct Disk_State* dstate)
 {
     FRESULT fr;
     printf("file_open_write_disk_image\r\n");
-    if ((fr = f_mount(&fs, "0:", 1)) != FR_OK){
+    if ((fr = mount_card()) != FR_OK){
         printf("*** ERROR, could not mount filesystem before open for write (%d)\r\n", fr);
         display_error((char *) "cannot mount", (char *) "filesystem");
         return(fr);
     }
 
-    if((fr = f_open(&fil, diskimagefilename, FA_WRITE | FA_CREATE_ALWAYS))!= FR_OK){
+    // read access is needed to merge the end of the header into the first raw block
+    if((fr = f_open(&fil, diskimagefilename, FA_WRITE | FA_READ | FA_CREATE_ALWAYS))!= FR_OK){
         printf("*** ERROR, could not open disk image file for write (%d)\r\n", fr);
         display_error((char *) "cannot open", (char *) "disk image");
         force_unmount();
         return(fr);
     }
+    FSIZE_t imagesize = IMAGE_HEADER_RESERVE + dram_image_data_size(dstate);
+    fr = f_expand(&fil, imagesize, 1);
+    if (fr == FR_OK)
+        image_fast_seek_enable();
+    else{
+        printf("  no contiguous space for %d bytes (%d), writing the image through the filesystem\r\n", (int)imagesize, fr);
+        imageraw = false;
+    }
+    return(FILE_OPS_OKAY);
+}
+
+// open the existing disk image file to rewrite individual sector records in place
+int file_open_update_disk_image()
+{
+    FRESULT fr;
+    printf("file_open_update_disk_image\r\n");
+    if ((fr = mount_card()) != FR_OK){
+        printf("*** ERROR, could not mount filesystem before open for update (%d)\r\n", fr);
+        display_error((char *) "cannot mount", (char *) "filesystem");
+        return(fr);
+    }
+
+    if((fr = f_open(&fil, diskimagefilename, FA_WRITE | FA_READ))!= FR_OK){
+        printf("*** ERROR, could not open disk image file for update (%d)\r\n", fr);
+        display_error((char *) "cannot open", (char *) "disk image");
+        force_unmount();
+        return(fr);
+    }
+    // the sector records are rewritten in place so the file size never changes while the link map is in use
+    image_fast_seek_enable();
     return(FILE_OPS_OKAY);
 }
 
@@ -112,11 +245,15 @@ int file_close_disk_image()
 {
     // Close file
     FRESULT fr;
+    imageraw = false;
     fr = f_close(&fil);
     if (fr != FR_OK) {
         printf("ERROR: Could not close file (%d)\r\n", fr);
         return(fr);
     }
+    // the image file may have been written
+    catalog_update(diskimagefilename);
+    sd_clock_save();
     //unmount the drive
     if ((fr = f_unmount("0:")) != FR_OK){
         printf("*** ERROR, could not unmount filesystem (%d)\r\n", fr);
@@ -127,22 +264,65 @@ int file_close_disk_image()
     // Force SD card reinitialization in case it has been swapped or removed and the volume is remounted.
     sd_card_t *pSD = sd_get_by_num(0);
     pSD->m_Status |= STA_NOINIT;
+    sd_clock_reset();
 
     return(FILE_OPS_OKAY);
 }
 
-bool deserialize_int(int *vp)
+// *************** image file header ***************
+// The whole header is read from the file with one f_read and the fields are parsed from memory.
+// Header version 2.1 has the same sector records as format 2.0 and ends the header with a tag-length-value
+// trailer so fields can be added without a new format. Each entry is a 16-bit tag and a 16-bit value length,
+// big endian like the other header values, then the value bytes. The trailer ends with IMAGE_TAG_END and a
+// length of 0. Tags that this firmware doesn't know are skipped, so a newer image can still be loaded.
+// A version 2.0 header has no trailer and ends after microsecondsPerSector, those images are still loaded and
+// are saved as version 2.1. The whole header is at most IMAGE_HEADER_MAX bytes.
+//
+#define IMAGE_HEADER_MAX 1024
+#define IMAGE_TAG_END 0
+static uint8_t headerbuf[IMAGE_HEADER_MAX];
+static int headerlen;   // number of valid bytes in headerbuf
+static int headerpos;   // offset of the next unparsed byte in headerbuf
+
+// read the start of the file into headerbuf, the image data after the header is read too and ignored
+static bool header_buffer_read()
 {
     FRESULT fr;
     UINT nr;
-    uint8_t buf[4];
-    int value = 0;
 
-    fr = f_read(&fil, buf, 4, &nr);
-    if (fr != FR_OK || nr != 4) {
+    headerlen = 0;
+    headerpos = 0;
+    fr = f_read(&fil, headerbuf, sizeof(headerbuf), &nr);
+    if (fr != FR_OK) {
         printf("###ERROR, Header data read error fr=%d, nr=%u\r\n", fr, nr);
         return(false);
     }
+    headerlen = nr;
+    return(true);
+}
+
+// leave the file positioned at the first sector record, the header is always at the start of the file
+static bool header_buffer_done()
+{
+    FRESULT fr = f_lseek(&fil, headerpos);
+    if (fr != FR_OK) {
+        printf("###ERROR, Header seek error fr=%d\r\n", fr);
+        return(false);
+    }
+    return(true);
+}
+
+bool deserialize_int(int *vp)
+{
+    uint8_t* buf;
+    int value = 0;
+
+    if ((headerpos + 4) > headerlen) {
+        printf("###ERROR, Header data read error, file too short\r\n");
+        return(false);
+    }
+    buf = &headerbuf[headerpos];
+    headerpos += 4;
 
     value  = buf[0] << 24;
     value |= buf[1] << 16;
@@ -175,14 +355,56 @@ bool serialize_int(int value)
 }
 
 bool deserialize_string(char *cp, int size)
+{
+    if ((headerpos + size) > headerlen) {
+        printf("###ERROR, Header data read error, file too short\r\n");
+        return(false);
+    }
+    memcpy(cp, &headerbuf[headerpos], size);
+    headerpos += size;
+
+    return(true);
+}
+
+// parse the tag-length-value trailer of a version 2.1 header
+bool deserialize_trailer()
+{
+    int skipped = 0;
+
+    while (true) {
+        if ((headerpos + 4) > headerlen) {
+            printf("###ERROR, Header trailer is not terminated\r\n");
+            return(false);
+        }
+        int tag = (headerbuf[headerpos] << 8) | headerbuf[headerpos + 1];
+        int length = (headerbuf[headerpos + 2] << 8) | headerbuf[headerpos + 3];
+        headerpos += 4;
+        if ((headerpos + length) > headerlen) {
+            printf("###ERROR, Header trailer tag %d is too long (%d)\r\n", tag, length);
+            return(false);
+        }
+        if (tag == IMAGE_TAG_END)
+            break;
+        // no other tags are defined yet
+        headerpos += length;
+        skipped++;
+    }
+    if (skipped > 0)
+        printf("  skipped %d unknown header tags\r\n", skipped);
+
+    return(true);
+}
+
+// write the tag-length-value trailer of a version 2.1 header, there are no tags to write yet
+bool serialize_trailer()
 {
     FRESULT fr;
-    UINT nr;
-    int value = 0;
+    UINT nw;
+    uint8_t buf[4] = { (IMAGE_TAG_END >> 8) & 0xFF, IMAGE_TAG_END & 0xFF, 0, 0 };
 
-    fr = f_read(&fil, cp, size, &nr);
-    if (fr != FR_OK || nr != size) {
-        printf("###ERROR, Header data read error fr=%d, nr=%u\r\n", fr, nr);
+    fr = f_write(&fil, buf, 4, &nw);
+    if (fr != FR_OK || nw != 4) {
+        printf("###ERROR, Header data write error fr=%d, nw=%u\r\n", fr, nw);
         return(false);
     }
 
@@ -216,6 +438,9 @@ bool serialize_string(char *cp, int size)
 
 static char magicNumber[10] = "\x89RK05\r\n\x1A"; 
 static char versionNumber[4] = "1.1";
+static char versionNumber2[4] = "2.0";    // format 2.0 records, no header trailer
+static char versionNumber21[4] = "2.1";   // format 2.0 records, header trailer
+static bool imagetrailer = false;         // the header of the open image file has the trailer
 
 int read_image_file_header(struct Disk_State* dstate)
 {
@@ -224,12 +449,23 @@ int read_image_file_header(struct Disk_State* dstate)
 
     printf("Reading header from file '%s'\r\n", diskimagefilename);
 
+    if (!header_buffer_read())
+        return 1;
+
     if (!deserialize_string(tmp, sizeof(magicNumber)) || strncmp(tmp, magicNumber, sizeof(magicNumber)) != 0) {
         // invalid magic
         return 2;
     }
 
-    if (!deserialize_string(tmp, sizeof(versionNumber)) || strncmp(tmp, versionNumber, sizeof(versionNumber)) != 0) {
+    if (!deserialize_string(tmp, sizeof(versionNumber)))
+        return 3;
+    if (strncmp(tmp, versionNumber, sizeof(versionNumber)) == 0)
+        imageformat = IMAGE_FORMAT_1_1;
+    else if (strncmp(tmp, versionNumber2, sizeof(versionNumber2)) == 0)
+        imageformat = IMAGE_FORMAT_2_0;
+    else if (strncmp(tmp, versionNumber21, sizeof(versionNumber21)) == 0)
+        imageformat = IMAGE_FORMAT_2_0;
+    else {
         // unexpected version
         return 3;
     }
@@ -248,6 +484,10 @@ int read_image_file_header(struct Disk_State* dstate)
     rc = rc && deserialize_int(&dstate->numberOfSectorsPerTrack); 
     rc = rc && deserialize_int(&dstate->numberOfHeads);           
     rc = rc && deserialize_int(&dstate->microsecondsPerSector);
+    imagetrailer = (strncmp(tmp, versionNumber21, sizeof(versionNumber21)) == 0);
+    if (imagetrailer)
+        rc = rc && deserialize_trailer();
+    rc = rc && header_buffer_done();
 
     if (rc) {
         printf("controller = %s\r\n", dstate->controller);
@@ -275,8 +515,13 @@ int write_image_file_header(struct Disk_State* dstate)
 
     printf("Writing header to file '%s'\r\n", diskimagefilename);
 
+    // imageformat is still the format the file was loaded in, a full save never goes back to an older one
+    if (imageformat < IMAGE_WRITE_FORMAT)
+        imageformat = IMAGE_WRITE_FORMAT;
     rc =       serialize_string(magicNumber, sizeof(magicNumber));
-    rc = rc && serialize_string(versionNumber, sizeof(versionNumber));
+    // format 2.0 images are always written with the header trailer
+    imagetrailer = (imageformat == IMAGE_FORMAT_2_0);
+    rc = rc && serialize_string(imagetrailer ? versionNumber21 : versionNumber, sizeof(versionNumber));
     rc = rc && serialize_string(dstate->imageName, sizeof(dstate->imageName));
     rc = rc && serialize_string(dstate->imageDescription, sizeof(dstate->imageDescription));
     rc = rc && serialize_string(dstate->imageDate, sizeof(dstate->imageDate));
@@ -290,84 +535,473 @@ int write_image_file_header(struct Disk_State* dstate)
     rc = rc && serialize_int(dstate->numberOfSectorsPerTrack); 
     rc = rc && serialize_int(dstate->numberOfHeads);           
     rc = rc && serialize_int(dstate->microsecondsPerSector);   
+    if (imagetrailer)
+        rc = rc && serialize_trailer();
 
     return rc ? 0 : 1;
 
 }
 
-int read_disk_image_data(struct Disk_State* dstate)
+// *************** image file fingerprint ***************
+//
+// make the name of a file that goes with the image file, same name with a different extension
+static void make_sidecar_filename(char* name, const char* extension)
+{
+    strncpy(name, diskimagefilename, FF_LFN_BUF - 4);
+    name[FF_LFN_BUF - 4] = '\0';
+    char* dot = strrchr(name, '.');
+    if (dot != NULL)
+        *dot = '\0';
+    strcat(name, extension);
+}
+
+static void put_le32(uint8_t* bp, uint32_t value)
+{
+    bp[0] = value & 0xff;
+    bp[1] = (value >> 8) & 0xff;
+    bp[2] = (value >> 16) & 0xff;
+    bp[3] = (value >> 24) & 0xff;
+}
+
+// hash the header of the open image file, the file position is left where it was
+static bool image_header_hash(FSIZE_t headerlength, uint32_t* hash)
 {
     FRESULT fr;
     UINT nr;
-    uint8_t *bp;
-    //int bytecount = dstate->dataLength / 8;
-    //int bytecount = (dstate->dataLength / 8) + 4 + 6;
-    int bytecount;
-    int sectorcount;
-    int headcount;
-    int cylindercount;
-    int ramaddress;
-    char display_line_2[30];
+    FSIZE_t savedposition = f_tell(&fil);
+    uint32_t h = 2166136261u;
 
-    printf("Reading disk data from file '%s'\r\n", diskimagefilename);
-    printf("  %s\r\n", dstate->controller);
-    printf(" cylinders=%d, heads=%d, sectors=%d\r\n", dstate->numberOfCylinders, dstate->numberOfHeads, dstate->numberOfSectorsPerTrack);
-    for (cylindercount = 0; cylindercount < dstate->numberOfCylinders; cylindercount++){
-        if ((cylindercount % 20) == 0)
-            printf("  cylindercount = %d\r\n", cylindercount);
-        if ((cylindercount % 10) == 0){
-            sprintf(display_line_2," Cyl %d", cylindercount);
-            display_status((char *) "Read card", display_line_2);
-        }
-        for (headcount = 0; headcount < dstate->numberOfHeads; headcount++){
-            for( sectorcount = 0; sectorcount < dstate->numberOfSectorsPerTrack; sectorcount++){
-                // first read the two parameters:
-                //   1. Bit times from sector pulse to start bit (16-bit value)
-                //   2. Number of data bits after the start bit (16-bit value)
-                bytecount = 4;
-                fr = f_read(&fil, sectordata, bytecount, &nr);
-                if (fr != FR_OK || nr != bytecount) {
-                    printf("###ERROR, Image data read error fr=%d, nr=%u\r\n", fr, nr);
-                    return(FILE_OPS_ERROR);
-                }
+    fr = f_lseek(&fil, 0);
+    for (FSIZE_t done = 0; (fr == FR_OK) && (done < headerlength); done += nr){
+        UINT toread = ((headerlength - done) > MAX_SECTOR_SIZE) ? MAX_SECTOR_SIZE : (UINT)(headerlength - done);
+        fr = f_read(&fil, sectordata, toread, &nr);
+        if ((fr == FR_OK) && (nr != toread))
+            fr = FR_INT_ERR;
+        for (UINT i = 0; (fr == FR_OK) && (i < nr); i++)
+            h = (h ^ sectordata[i]) * 16777619u;
+    }
+    if (fr == FR_OK)
+        fr = f_lseek(&fil, savedposition);
+    *hash = h;
+    return(fr == FR_OK);
+}
 
-                ramaddress = (cylindercount << 14) | (headcount << 13) | (sectorcount << 9);
-                load_ram_address(ramaddress);
+// Fingerprint of the open image file, taken at every load and stored in the journal so a journal is only replayed
+// into the image file it was written for. All values are little endian:
+//   bytes 0-3    size of the image file
+//   bytes 4-7    length of the image file header
+//   bytes 8-11   FNV-1a hash of the image file header
+//   bytes 12-13  file date, FAT format
+//   bytes 14-15  file time, FAT format
+#define IMAGE_FINGERPRINT_SIZE 16
+static uint8_t imagefingerprint[IMAGE_FINGERPRINT_SIZE];
+static bool imagefingerprint_valid = false;
 
-                // copy the first four bytes to DRAM and compute the wordcount and bytecount
-                //printf("  C=%3d H=%d S=%2d, %2x %2x %2x %2x,", cylindercount, headcount, sectorcount, sectordata[0], sectordata[1], sectordata[2], sectordata[3]);
-                bp = sectordata;
-                for (int i = 0; i < bytecount; i++){
-                    storebyte(*bp++);
-                }
-                int sector_data_bit_count = (sectordata[3] << 8) | sectordata[2];
-                int wordcount = (sector_data_bit_count + 15) >> 4; // round the word count up to the next integer value
-                bytecount = wordcount * 2;
-                //printf("  bc=%d\r\n", bytecount);
+static void image_fingerprint_make(FSIZE_t headerlength)
+{
+    FILINFO fno;
+    uint32_t hash;
 
-                fr = f_read(&fil, sectordata, bytecount, &nr);
-                if (fr != FR_OK || nr != bytecount) {
-                    printf("###ERROR, Image data read error fr=%d, nr=%u\r\n", fr, nr);
-                    return(FILE_OPS_ERROR);
-                }
+    imagefingerprint_valid = image_header_hash(headerlength, &hash) && (f_stat(diskimagefilename, &fno) == FR_OK);
+    if (!imagefingerprint_valid)
+        return;
+    put_le32(&imagefingerprint[0], (uint32_t)f_size(&fil));
+    put_le32(&imagefingerprint[4], (uint32_t)headerlength);
+    put_le32(&imagefingerprint[8], hash);
+    imagefingerprint[12] = fno.fdate & 0xff;
+    imagefingerprint[13] = (fno.fdate >> 8) & 0xff;
+    imagefingerprint[14] = fno.ftime & 0xff;
+    imagefingerprint[15] = (fno.ftime >> 8) & 0xff;
+}
 
-                //gpio_put(22, 1); // for debugging to time the loop
-                bp = sectordata;
-                for (int i = 0; i < bytecount; i++){
-                    storebyte(*bp++);
-                }
-                //gpio_put(22, 0); // for debugging to time the loop
-            }
+// *************** microSD telemetry ***************
+// The SD driver counts the block transfers by command with latency histograms, the busy time, retries and errors
+// (see sd_card.c). The counters are cleared at the start of each image load, save and changed-sector rewrite and
+// copied at the end, so the last transfer of each kind can be shown with the bytes moved and the elapsed time.
+// The counters from before are added to a running total first. If the file RK05SD.CSV exists on the card a line
+// is appended to it after every transfer, which keeps a history of that card to find the ones getting slower.
+// The SDSTATS LOG console command creates the file, delete it to stop the logging.
+//
+#define TELEMETRY_FILENAME "RK05SD.CSV"
+#define TELEMETRY_LOAD 0
+#define TELEMETRY_SAVE 1
+#define TELEMETRY_REWRITE 2
+#define TELEMETRY_KINDS 3
+
+struct Transfer_Telemetry {
+    bool valid;
+    int bytes;
+    int elapsed_us;
+    sd_stats_t sd;  // driver counters for this transfer only
+};
+
+static const char* telemetry_names[TELEMETRY_KINDS] = {"load", "save", "rewrite"};
+static const char* telemetry_commands[SD_STATS_COMMANDS] = {"CMD17 read block", "CMD18 read blocks", "CMD24 write block", "CMD25 write blocks"};
+static Transfer_Telemetry telemetry[TELEMETRY_KINDS];
+static sd_stats_t telemetrytotal;  // driver counters up to the last sd_reset_stats()
+static FIL logfil;
+
+static void sd_stats_add(sd_stats_t* total, const sd_stats_t* stats)
+{
+    for (int i = 0; i < SD_STATS_COMMANDS; i++){
+        sd_command_stats_t* t = &total->command[i];
+        const sd_command_stats_t* s = &stats->command[i];
+        t->count += s->count;
+        t->blocks += s->blocks;
+        t->total_us += s->total_us;
+        if (s->max_us > t->max_us)
+            t->max_us = s->max_us;
+        for (int bucket = 0; bucket < SD_STATS_BUCKETS; bucket++)
+            t->histogram[bucket] += s->histogram[bucket];
+    }
+    total->busy_us += stats->busy_us;
+    total->retries += stats->retries;
+    total->crc_errors += stats->crc_errors;
+    total->timeouts += stats->timeouts;
+    total->errors += stats->errors;
+}
+
+// move the driver counters to the running total so they only count the transfer that is starting
+static void telemetry_begin()
+{
+    sd_stats_t stats;
+    sd_get_stats(&stats);
+    sd_stats_add(&telemetrytotal, &stats);
+    sd_reset_stats();
+}
+
+// append a line for the transfer to the log file, if there is one
+static void telemetry_log(int kind)
+{
+    Transfer_Telemetry* t = &telemetry[kind];
+    char line[200];
+
+    if (f_open(&logfil, TELEMETRY_FILENAME, FA_WRITE | FA_OPEN_EXISTING) != FR_OK)
+        return;
+    int len = snprintf(line, sizeof(line), "%lu,%s,%s,%d,%d,%.2f", (unsigned long)(time_us_64() / 1000), telemetry_names[kind],
+        diskimagefilename, t->bytes, t->elapsed_us / 1000, (t->elapsed_us > 0) ? (float)t->bytes / (float)t->elapsed_us : 0.0f);
+    for (int i = 0; i < SD_STATS_COMMANDS; i++)
+        len += snprintf(&line[len], sizeof(line) - len, ",%lu,%lu", (unsigned long)t->sd.command[i].count, (unsigned long)t->sd.command[i].max_us);
+    len += snprintf(&line[len], sizeof(line) - len, ",%lu,%lu,%lu,%lu,%lu\r\n", (unsigned long)(t->sd.busy_us / 1000),
+        (unsigned long)t->sd.retries, (unsigned long)t->sd.crc_errors, (unsigned long)t->sd.timeouts, (unsigned long)t->sd.errors);
+    UINT nw;
+    FRESULT fr = f_lseek(&logfil, f_size(&logfil));
+    if (fr == FR_OK)
+        fr = f_write(&logfil, line, len, &nw);
+    if (fr != FR_OK)
+        printf("###ERROR, could not append to the telemetry log fr=%d\r\n", fr);
+    f_close(&logfil);
+}
+
+// keep the driver counters for the transfer that just finished and log it
+static void telemetry_end(int kind, int bytes, int elapsed_us)
+{
+    Transfer_Telemetry* t = &telemetry[kind];
+    t->valid = true;
+    t->bytes = bytes;
+    t->elapsed_us = elapsed_us;
+    sd_get_stats(&t->sd);
+    if ((t->sd.retries > 0) || (t->sd.crc_errors > 0) || (t->sd.timeouts > 0))
+        printf("  microSD retries %lu, CRC errors %lu, timeouts %lu\r\n", (unsigned long)t->sd.retries,
+            (unsigned long)t->sd.crc_errors, (unsigned long)t->sd.timeouts);
+    telemetry_log(kind);
+}
+
+static void telemetry_print_commands(const sd_stats_t* stats)
+{
+    for (int i = 0; i < SD_STATS_COMMANDS; i++){
+        const sd_command_stats_t* c = &stats->command[i];
+        if (c->count == 0)
+            continue;
+        printf("    %-18s %lu transfers, %lu blocks, average %lu us, max %lu us\r\n", telemetry_commands[i], (unsigned long)c->count,
+            (unsigned long)c->blocks, (unsigned long)(c->total_us / c->count), (unsigned long)c->max_us);
+        printf("     ");
+        for (int bucket = 0; bucket < SD_STATS_BUCKETS; bucket++){
+            if (c->histogram[bucket] == 0)
+                continue;
+            uint32_t limit_us = 128u << bucket;
+            if (bucket == SD_STATS_BUCKETS - 1)
+                printf(" >=%lums:%lu", (unsigned long)(limit_us / 2000), (unsigned long)c->histogram[bucket]);
+            else if (limit_us < 1000)
+                printf(" <%luus:%lu", (unsigned long)limit_us, (unsigned long)c->histogram[bucket]);
+            else
+                printf(" <%lums:%lu", (unsigned long)(limit_us / 1000), (unsigned long)c->histogram[bucket]);
         }
+        printf("\r\n");
     }
+    printf("    busy %lu msec, retries %lu, CRC errors %lu, timeouts %lu, failed transfers %lu\r\n", (unsigned long)(stats->busy_us / 1000),
+        (unsigned long)stats->retries, (unsigned long)stats->crc_errors, (unsigned long)stats->timeouts, (unsigned long)stats->errors);
+}
 
-    return(FILE_OPS_OKAY);
+// print the microSD counters since the last reset and for the last transfer of each kind, then clear them if reset is set
+void card_telemetry(bool reset)
+{
+    sd_stats_t stats;
+    sd_get_stats(&stats);
+    sd_stats_add(&stats, &telemetrytotal);
+    printf("  microSD telemetry, all transfers\r\n");
+    telemetry_print_commands(&stats);
+    for (int kind = 0; kind < TELEMETRY_KINDS; kind++){
+        Transfer_Telemetry* t = &telemetry[kind];
+        if (!t->valid)
+            continue;
+        printf("  last %s, %d bytes in %d msec, %.2f MB/s\r\n", telemetry_names[kind], t->bytes, t->elapsed_us / 1000,
+            (t->elapsed_us > 0) ? (float)t->bytes / (float)t->elapsed_us : 0.0f);
+        telemetry_print_commands(&t->sd);
+    }
+    if (reset){
+        memset(&telemetrytotal, 0, sizeof(telemetrytotal));
+        memset(telemetry, 0, sizeof(telemetry));
+        sd_reset_stats();
+        printf("  counters cleared\r\n");
+    }
 }
 
-int write_disk_image_data(struct Disk_State* dstate)
+// create the telemetry log file with its heading line, from then on every transfer is appended to it
+void card_telemetry_log_start()
 {
     FRESULT fr;
     UINT nw;
+    const char* heading = "uptime_ms,operation,image,bytes,msec,MBps,cmd17,cmd17_max_us,cmd18,cmd18_max_us,"
+        "cmd24,cmd24_max_us,cmd25,cmd25_max_us,busy_ms,retries,crc_errors,timeouts,errors\r\n";
+
+    if ((fr = mount_card()) != FR_OK){
+        printf("###ERROR, could not mount filesystem to start the telemetry log (%d)\r\n", fr);
+        force_unmount();
+        return;
+    }
+    fr = f_open(&logfil, TELEMETRY_FILENAME, FA_WRITE | FA_CREATE_NEW);
+    if (fr == FR_EXIST){
+        printf("  telemetry log '%s' already exists\r\n", TELEMETRY_FILENAME);
+        force_unmount();
+        return;
+    }
+    if (fr == FR_OK){
+        fr = f_write(&logfil, heading, strlen(heading), &nw);
+        f_close(&logfil);
+    }
+    if (fr != FR_OK)
+        printf("###ERROR, could not create the telemetry log fr=%d\r\n", fr);
+    else
+        printf("  created telemetry log '%s', delete it to stop logging\r\n", TELEMETRY_FILENAME);
+    force_unmount();
+}
+
+// *************** chunked image data reads ***************
+// The image data is read from the file in large chunks and the variable-length sector records are parsed
+// from memory, instead of two small f_read calls per sector. The reads are kept aligned to the 512-byte
+// microSD sectors so FatFs can transfer them straight into the buffer with multi-sector reads. A record
+// that straddles the end of a chunk is moved to the front of the buffer before the next chunk is appended.
+//
+#define IMAGE_CHUNK_SIZE (16 * 1024)
+static uint8_t imagechunk[MAX_IMAGE_RECORD_SIZE + IMAGE_CHUNK_SIZE];
+static int chunklen;   // number of valid bytes in imagechunk
+static int chunkpos;   // offset of the next unparsed byte in imagechunk
+static FSIZE_t chunkfileoffset; // file offset of the byte after the last one in imagechunk
+
+// The raw block transfers run in the background with the SD driver's asynchronous reads and writes. During a load
+// the next chunk is read into imageasync[] while core 0 parses the current one, during a save each full chunk is
+// copied to imageasync[] and written while the next one is staged. The caller polls the transfer once per sector.
+static uint8_t imageasync[IMAGE_CHUNK_SIZE];
+static bool imageasync_busy;            // a transfer to or from imageasync[] is running
+static int imageasync_status;           // SD driver status of the last transfer
+static FSIZE_t prefetchoffset;          // file offset of the block read into imageasync[], -1 if none
+static LBA_t imageasync_lba;            // first block of the background write
+static int imageasync_blocks;           // number of blocks in the background write
+
+// The raw block transfers bypass the FatFs glue, so they do the glue's CRC error fallback themselves: after a CRC
+// error or a timeout the SPI clock is lowered and the transfer is tried again, until the slowest clock has failed.
+static bool image_block_fallback(sd_card_t *pSD, int status)
+{
+    if ((status != SD_BLOCK_DEVICE_ERROR_CRC) && (status != SD_BLOCK_DEVICE_ERROR_NO_RESPONSE))
+        return(false);
+    return(sd_clock_fallback(pSD));
+}
+
+static int image_read_blocks(sd_card_t *pSD, uint8_t* bp, LBA_t lba, int nblocks)
+{
+    int status;
+    do
+        status = pSD->read_blocks(pSD, bp, lba, nblocks);
+    while (image_block_fallback(pSD, status));
+    return(status);
+}
+
+static int image_write_blocks(sd_card_t *pSD, const uint8_t* bp, LBA_t lba, int nblocks)
+{
+    int status;
+    do
+        status = pSD->write_blocks(pSD, bp, lba, nblocks);
+    while (image_block_fallback(pSD, status));
+    return(status);
+}
+
+// completion callback from the SD driver
+static void image_async_done(sd_card_t *pSD, int status, void *context)
+{
+    imageasync_status = status;
+    imageasync_busy = false;
+}
+
+// move the background transfer along, called between sectors
+static void image_async_poll()
+{
+    if (imageasync_busy)
+        sd_async_poll(sd_get_by_num(0));
+}
+
+// wait for the background transfer to finish and return its status
+static int image_async_wait()
+{
+    if (imageasync_busy)
+        sd_async_wait(sd_get_by_num(0));
+    return(imageasync_status);
+}
+
+// wait for the background write to finish, a write that failed with a CRC error or a timeout is done again
+static int image_async_write_wait()
+{
+    sd_card_t *pSD = sd_get_by_num(0);
+    int status = image_async_wait();
+    if ((status != SD_BLOCK_DEVICE_ERROR_NONE) && image_block_fallback(pSD, status)){
+        status = image_write_blocks(pSD, imageasync, imageasync_lba, imageasync_blocks);
+        imageasync_status = status;
+    }
+    return(status);
+}
+
+// start reading nblocks from the image file at blockoffset into imageasync[]
+static void image_prefetch_start(FSIZE_t blockoffset, int nblocks)
+{
+    sd_card_t *pSD = sd_get_by_num(0);
+    imageasync_busy = true;
+    imageasync_status = sd_read_blocks_async(pSD, imageasync, imagelba + (blockoffset / FF_MIN_SS), nblocks, image_async_done, NULL);
+    if (imageasync_status != SD_BLOCK_DEVICE_ERROR_NONE){
+        // not started, the next chunk is read the normal way
+        imageasync_busy = false;
+        prefetchoffset = -1;
+        return;
+    }
+    prefetchoffset = blockoffset;
+}
+
+static void image_chunk_reset()
+{
+    chunklen = 0;
+    chunkpos = 0;
+    chunkfileoffset = f_tell(&fil);
+    prefetchoffset = -1;
+}
+
+// file offset of the next unparsed byte
+static FSIZE_t image_chunk_offset()
+{
+    return(chunkfileoffset - (chunklen - chunkpos));
+}
+
+// read the next chunk straight from the card, the image file is contiguous so no FatFs lookups are needed
+// The first read after the header starts at the beginning of the 512-byte block holding the end of the header.
+static FRESULT image_chunk_read_raw(int* nbytes)
+{
+    int skip = chunkfileoffset % FF_MIN_SS;
+    FSIZE_t blockoffset = chunkfileoffset - skip;
+    FSIZE_t available = f_size(&fil) - blockoffset;
+    int nblocks = IMAGE_CHUNK_SIZE / FF_MIN_SS;
+    if (available < IMAGE_CHUNK_SIZE)
+        nblocks = (int)((available + FF_MIN_SS - 1) / FF_MIN_SS);
+    *nbytes = 0;
+    if (nblocks == 0)
+        return(FR_OK);
+    int valid = (available < (FSIZE_t)(nblocks * FF_MIN_SS)) ? (int)available : (nblocks * FF_MIN_SS);
+    // skip is only non-zero on the first read, when the buffer is empty
+    sd_card_t *pSD = sd_get_by_num(0);
+    int status;
+    if (prefetchoffset == blockoffset){
+        // normally the chunk was read in the background while the last one was parsed
+        status = image_async_wait();
+        if (status == SD_BLOCK_DEVICE_ERROR_NONE)
+            memcpy(&imagechunk[chunklen], imageasync, valid);
+        else if (image_block_fallback(pSD, status))
+            status = image_read_blocks(pSD, &imagechunk[chunklen], imagelba + (blockoffset / FF_MIN_SS), nblocks);
+    }
+    else{
+        image_async_wait();
+        status = image_read_blocks(pSD, &imagechunk[chunklen], imagelba + (blockoffset / FF_MIN_SS), nblocks);
+    }
+    prefetchoffset = -1;
+    if (status != SD_BLOCK_DEVICE_ERROR_NONE){
+        printf("###ERROR, Image data block read error %d\r\n", status);
+        return(FR_DISK_ERR);
+    }
+    if (skip != 0){
+        memmove(&imagechunk[chunklen], &imagechunk[chunklen + skip], valid - skip);
+    }
+    *nbytes = valid - skip;
+
+    // start reading the chunk after this one
+    FSIZE_t nextoffset = blockoffset + (nblocks * FF_MIN_SS);
+    if (nextoffset < f_size(&fil)){
+        FSIZE_t nextavailable = f_size(&fil) - nextoffset;
+        int nextblocks = (nextavailable < IMAGE_CHUNK_SIZE) ? (int)((nextavailable + FF_MIN_SS - 1) / FF_MIN_SS) : (IMAGE_CHUNK_SIZE / FF_MIN_SS);
+        image_prefetch_start(nextoffset, nextblocks);
+    }
+    return(FR_OK);
+}
+
+// make sure at least count bytes of image data are available at &imagechunk[chunkpos], count must be <= MAX_IMAGE_RECORD_SIZE
+static FRESULT image_chunk_ensure(int count)
+{
+    FRESULT fr;
+    UINT nr;
+    int remaining = chunklen - chunkpos;
+
+    if (remaining >= count)
+        return(FR_OK);
+    memmove(imagechunk, &imagechunk[chunkpos], remaining);
+    chunkpos = 0;
+    chunklen = remaining;
+
+    if (imageraw){
+        int nbytes;
+        fr = image_chunk_read_raw(&nbytes);
+        if (fr != FR_OK)
+            return(fr);
+        nr = nbytes;
+    }
+    else{
+        // the first read after the header ends on a 512-byte boundary, after that every read is a whole number of sectors
+        UINT toread = IMAGE_CHUNK_SIZE - (chunkfileoffset % FF_MIN_SS);
+        fr = f_read(&fil, &imagechunk[chunklen], toread, &nr);
+        if (fr != FR_OK) {
+            printf("###ERROR, Image data read error fr=%d, nr=%u\r\n", fr, nr);
+            return(fr);
+        }
+    }
+    chunklen += nr;
+    chunkfileoffset += nr;
+    if (chunklen < count) {
+        printf("###ERROR, Image data read error, end of file, needed %d bytes, %d available\r\n", count, chunklen);
+        return(FR_INVALID_PARAMETER);
+    }
+    return(FR_OK);
+}
+
+// set up the sector offset table for the pack geometry, returns false if the geometry is too big for the table
+static bool sector_offsets_reset(struct Disk_State* dstate)
+{
+    sectoroffset_valid = (dstate->numberOfCylinders <= TRACK_MAX_CYLINDERS) && (dstate->numberOfHeads <= TRACK_MAX_HEADS)
+                      && (dstate->numberOfSectorsPerTrack <= TRACK_MAX_SECTORS);
+    sectoroffset_heads = dstate->numberOfHeads;
+    sectoroffset_sectors = dstate->numberOfSectorsPerTrack;
+    return(sectoroffset_valid);
+}
+
+// read the sector data from the image file and load it into the FPGA DRAM
+// Core 0 reads and parses the image file and passes each sector to core 1 through the transfer ring.
+// Core 1 sends the sectors to the FPGA by DMA, so the microSD card and the FPGA link run in parallel.
+// The times are printed at the end so it is clear whether the microSD card or the FPGA link is the bottleneck.
+int read_disk_image_data(struct Disk_State* dstate)
+{
     uint8_t *bp;
     //int bytecount = dstate->dataLength / 8;
     //int bytecount = (dstate->dataLength / 8) + 4 + 6;
@@ -375,48 +1009,1342 @@ int write_disk_image_data(struct Disk_State* dstate)
     int sectorcount;
     int headcount;
     int cylindercount;
-    int ramaddress;
     char display_line_2[30];
+    int totalbytes = 0;
+    uint64_t t0;
+    uint64_t sd_us = 0;     // time spent reading and parsing the image chunks
+    int fillsectors = 0;
+    int crcsectors = 0;
+    int crcerrors = 0;
+    int retval = FILE_OPS_OKAY;
 
-    printf("Writing disk image data to file '%s':\r\n", diskimagefilename);
+    printf("Reading disk data from file '%s'\r\n", diskimagefilename);
+    printf("  %s\r\n", dstate->controller);
     printf(" cylinders=%d, heads=%d, sectors=%d\r\n", dstate->numberOfCylinders, dstate->numberOfHeads, dstate->numberOfSectorsPerTrack);
-    for (cylindercount = 0; cylindercount < dstate->numberOfCylinders; cylindercount++){
+    telemetry_begin();
+    uint64_t start_time = time_us_64();
+    int recordcount = dstate->numberOfCylinders * dstate->numberOfHeads * dstate->numberOfSectorsPerTrack;
+    sector_offsets_reset(dstate);
+    imagefingerprint_valid = false;
+    int recordindex = 0;
+    FSIZE_t headerlength = f_tell(&fil);
+    image_chunk_reset();
+    imagerecordflags = 0;
+    xfer_start_load();
+    for (cylindercount = 0; (cylindercount < dstate->numberOfCylinders) && (retval == FILE_OPS_OKAY); cylindercount++){
         if ((cylindercount % 20) == 0)
             printf("  cylindercount = %d\r\n", cylindercount);
         if ((cylindercount % 10) == 0){
-            sprintf(display_line_2,"Cyl %d", cylindercount);
-            display_status((char *) "Write card", display_line_2);
+            sprintf(display_line_2," Cyl %d", cylindercount);
+            display_status((char *) "Read card", display_line_2);
         }
-        for (headcount = 0; headcount < dstate->numberOfHeads; headcount++){
+        for (headcount = 0; (headcount < dstate->numberOfHeads) && (retval == FILE_OPS_OKAY); headcount++){
             for( sectorcount = 0; sectorcount < dstate->numberOfSectorsPerTrack; sectorcount++){
-                ramaddress = (cylindercount << 14) | (headcount << 13) | (sectorcount << 9);
-                load_ram_address(ramaddress);
-
-                //gpio_put(22, 1); // for debugging to time the loop
-                bytecount = 4;
-                bp = sectordata;
-                for (int i = 0; i < bytecount; i++){
-                    *bp++ = readbyte();
+                // first parse the two parameters:
+                //   1. Bit times from sector pulse to start bit (16-bit value)
+                //   2. Number of data bits after the start bit (16-bit value)
+                //   format 2.0 adds the body encoding, flags, the number of body bytes stored in the file and an optional CRC
+                t0 = time_us_64();
+                int recordheader = (imageformat == IMAGE_FORMAT_2_0) ? IMAGE_RECORD_HEADER_V2 : 4;
+                image_async_poll();
+                if (image_chunk_ensure(recordheader) != FR_OK) {
+                    retval = FILE_OPS_ERROR;
+                    break;
                 }
-                int sector_data_bit_count = (sectordata[3] << 8) | sectordata[2];
+                bp = &imagechunk[chunkpos];
+                if (sectoroffset_valid)
+                    sectoroffset[recordindex++] = image_chunk_offset();
+                int sector_data_bit_count = (bp[3] << 8) | bp[2];
                 int wordcount = (sector_data_bit_count + 15) >> 4; // round the word count up to the next integer value
                 bytecount = wordcount * 2;
+                int encoding = IMAGE_ENC_RAW;
+                int storedcount = bytecount;
+                if (imageformat == IMAGE_FORMAT_2_0){
+                    encoding = bp[4];
+                    storedcount = (bp[7] << 8) | bp[6];
+                    recordheader = image_record_header_length(bp[5]);
+                    if ((cylindercount == 0) && (headcount == 0) && (sectorcount == 0))
+                        imagerecordflags = bp[5];
+                    else if (imagerecordflags != bp[5])
+                        imagerecordflags = -1;
+                }
+                if (((bytecount + 4) > MAX_SECTOR_SIZE) || ((storedcount + 4) > MAX_SECTOR_SIZE)) {
+                    printf("###ERROR, sector too long C=%d H=%d S=%d, bytecount=%d\r\n", cylindercount, headcount, sectorcount, bytecount);
+                    retval = FILE_OPS_ERROR;
+                    break;
+                }
 
-                // bp is already pointing to the proper place in the sectordata array
-                for (int i = 0; i < bytecount; i++){
-                    *bp++ = readbyte();
+                if (image_chunk_ensure(recordheader + storedcount) != FR_OK) {
+                    retval = FILE_OPS_ERROR;
+                    break;
+                }
+                bp = &imagechunk[chunkpos];
+                chunkpos += recordheader + storedcount;
+                // the CRC is checked while the record is still in the chunk buffer, the load carries on so every bad sector is reported
+                if ((imageformat == IMAGE_FORMAT_2_0) && (bp[5] & IMAGE_FLAG_CRC32)) {
+                    crcsectors++;
+                    if (!image_record_crc_ok(bp)) {
+                        printf("###ERROR, CRC mismatch C=%d H=%d S=%d\r\n", cylindercount, headcount, sectorcount);
+                        if (crcerrors++ == 0) {
+                            sprintf(display_line_2, "C%d H%d S%d", cylindercount, headcount, sectorcount);
+                            display_error((char *) "CRC error", display_line_2);
+                        }
+                    }
                 }
-                //gpio_put(22, 0); // for debugging to time the loop
+                sd_us += time_us_64() - t0;
 
-                bytecount += 4; // add 4 bytes to account for the two 16-bit length fields
-                fr = f_write(&fil, sectordata, bytecount, &nw);
-                if (fr != FR_OK || nw != bytecount) {
-                    printf("###ERROR, Image data write error fr=%d, nw=%u\r\n", fr, nw);
-                    return(FILE_OPS_ERROR);
+                // decode the sector straight into the transfer slot and hand it to core 1,
+                // a fill record is passed on as its fill word and core 1 streams it from a cached pattern
+                Xfer_Slot* slot = xfer_producer_slot();
+                slot->ramaddress = (cylindercount << 14) | (headcount << 13) | (sectorcount << 9);
+                slot->count = bytecount + 4;
+                slot->fillword = -1;
+                memcpy(slot->data, bp, 4);
+                if ((encoding == IMAGE_ENC_FILL) && (storedcount >= 2) && (bytecount >= 2)) {
+                    slot->fillword = (bp[recordheader + 1] << 8) | bp[recordheader];
+                    fillsectors++;
+                }
+                else if (!image_decode_body(encoding, &bp[recordheader], storedcount, &slot->data[4], bytecount)) {
+                    printf("###ERROR, bad sector record C=%d H=%d S=%d, encoding=%d\r\n", cylindercount, headcount, sectorcount, encoding);
+                    retval = FILE_OPS_ERROR;
+                    break;
                 }
+                xfer_producer_commit();
+                totalbytes += recordheader + storedcount;
             }
         }
     }
+    xfer_finish(retval != FILE_OPS_OKAY);
+    image_async_wait(); // a read past the last record may still be running
+    if ((retval == FILE_OPS_OKAY) && (crcerrors > 0)) {
+        printf("###ERROR, %d of %d sectors failed the CRC check\r\n", crcerrors, crcsectors);
+        retval = FILE_OPS_CRC_ERROR;
+    }
+    if (retval != FILE_OPS_OKAY){
+        sectoroffset_valid = false;
+        return(retval);
+    }
+    if (sectoroffset_valid)
+        sectoroffset[recordcount] = image_chunk_offset();
+
+    int elapsed_us = (int)(time_us_64() - start_time);
+    printf("  loaded %d bytes in %d msec, %.2f MB/s\r\n", totalbytes, elapsed_us / 1000, (elapsed_us > 0) ? (float)totalbytes / (float)elapsed_us : 0.0f);
+    printf("  microSD read %d msec, waiting for FPGA transfers %d msec\r\n", (int)(sd_us / 1000), xfer_stall_us() / 1000);
+    if (fillsectors > 0)
+        printf("  %d fill sectors\r\n", fillsectors);
+    if (crcsectors > 0)
+        printf("  %d sectors passed the CRC check\r\n", crcsectors);
+    telemetry_end(TELEMETRY_LOAD, totalbytes, elapsed_us);
+    image_fingerprint_make(headerlength);
+
     return(FILE_OPS_OKAY);
 }
 
+// *************** staged image writes ***************
+// The sector records are staged in the chunk buffer and written to the card in large aligned pieces.
+// When the image file is preallocated and contiguous they are written IMAGE_CHUNK_SIZE bytes at a time with raw
+// multi-block writes. The staging buffer always starts on a 512-byte block boundary, so the end of the header that
+// shares the first block is read back into it first.
+// Otherwise they are written through FatFs, one f_write for each stretch of the file that ends on an IMAGE_CHUNK_SIZE
+// boundary. That is a whole number of clusters for clusters up to IMAGE_CHUNK_SIZE, so FatFs writes whole sectors
+// straight from the buffer with multi-block writes instead of one partial sector per record through its own buffer.
+//
+static FSIZE_t stagefileoffset;  // file offset of imagechunk[0], a multiple of FF_MIN_SS for raw writes
+static int stagelen;             // number of bytes staged in imagechunk
+static int stagewrites;          // number of writes to the card, printed after the save
+
+static FRESULT image_stage_start()
+{
+    FRESULT fr;
+    UINT nr;
+    FSIZE_t headerend = f_tell(&fil);
+
+    stagewrites = 0;
+    if (!imageraw){
+        // the staged records follow the header, which stays in the FatFs buffer until the first write
+        stagefileoffset = headerend;
+        stagelen = 0;
+        return(FR_OK);
+    }
+    fr = f_sync(&fil); // the header is in the FatFs buffer, make sure it is on the card before the raw writes
+    stagefileoffset = headerend - (headerend % FF_MIN_SS);
+    stagelen = (int)(headerend - stagefileoffset);
+    if ((fr == FR_OK) && (stagelen > 0)){
+        fr = f_lseek(&fil, stagefileoffset);
+        if (fr == FR_OK)
+            fr = f_read(&fil, imagechunk, stagelen, &nr);
+        if ((fr == FR_OK) && (nr != stagelen))
+            fr = FR_INT_ERR;
+    }
+    if (fr != FR_OK)
+        printf("###ERROR, could not read back the image header fr=%d\r\n", fr);
+    return(fr);
+}
+
+// write the first count staged bytes through FatFs and move the rest to the front of the buffer
+static FRESULT image_stage_write_fatfs(int count)
+{
+    UINT nw;
+    FRESULT fr = f_write(&fil, imagechunk, count, &nw);
+    if ((fr == FR_OK) && (nw != (UINT)count))
+        fr = FR_DENIED; // the card is full
+    if (fr != FR_OK){
+        printf("###ERROR, Image data write error fr=%d, nw=%u\r\n", fr, nw);
+        return(fr);
+    }
+    stagewrites++;
+    stagelen -= count;
+    memmove(imagechunk, &imagechunk[count], stagelen);
+    stagefileoffset += count;
+    return(FR_OK);
+}
+
+static FRESULT image_stage_write(int nblocks)
+{
+    sd_card_t *pSD = sd_get_by_num(0);
+    block_cache_invalidate_range(imagelba + (stagefileoffset / FF_MIN_SS), nblocks);
+    int status = image_write_blocks(pSD, imagechunk, imagelba + (stagefileoffset / FF_MIN_SS), nblocks);
+    stagewrites++;
+    if (status != SD_BLOCK_DEVICE_ERROR_NONE){
+        printf("###ERROR, Image data block write error %d\r\n", status);
+        return(FR_DISK_ERR);
+    }
+    return(FR_OK);
+}
+
+// write a full chunk in the background, after the write of the last one has finished
+static FRESULT image_stage_write_async()
+{
+    sd_card_t *pSD = sd_get_by_num(0);
+    int status = image_async_write_wait();
+    if (status == SD_BLOCK_DEVICE_ERROR_NONE){
+        memcpy(imageasync, imagechunk, IMAGE_CHUNK_SIZE);
+        imageasync_lba = imagelba + (stagefileoffset / FF_MIN_SS);
+        imageasync_blocks = IMAGE_CHUNK_SIZE / FF_MIN_SS;
+        block_cache_invalidate_range(imageasync_lba, imageasync_blocks);
+        imageasync_busy = true;
+        status = sd_write_blocks_async(pSD, imageasync, imageasync_lba, imageasync_blocks, image_async_done, NULL);
+        stagewrites++;
+        if (status != SD_BLOCK_DEVICE_ERROR_NONE)
+            imageasync_busy = false;
+    }
+    if (status != SD_BLOCK_DEVICE_ERROR_NONE){
+        printf("###ERROR, Image data block write error %d\r\n", status);
+        return(FR_DISK_ERR);
+    }
+    return(FR_OK);
+}
+
+static FRESULT image_stage_append(const uint8_t* bp, int count)
+{
+    memcpy(&imagechunk[stagelen], bp, count);
+    stagelen += count;
+    if (!imageraw){
+        int flushsize = IMAGE_CHUNK_SIZE - (int)(stagefileoffset % IMAGE_CHUNK_SIZE);
+        if (stagelen < flushsize)
+            return(FR_OK);
+        return(image_stage_write_fatfs(flushsize));
+    }
+    if (stagelen < IMAGE_CHUNK_SIZE)
+        return(FR_OK);
+    FRESULT fr = image_stage_write_async();
+    stagelen -= IMAGE_CHUNK_SIZE;
+    memmove(imagechunk, &imagechunk[IMAGE_CHUNK_SIZE], stagelen);
+    stagefileoffset += IMAGE_CHUNK_SIZE;
+    return(fr);
+}
+
+// write the last partial chunk and cut the preallocated file back to the real end of the image data
+static FRESULT image_stage_finish()
+{
+    FRESULT fr = FR_OK;
+    FSIZE_t imageend = stagefileoffset + stagelen;
+    if (!imageraw)
+        return((stagelen > 0) ? image_stage_write_fatfs(stagelen) : FR_OK);
+    int status = image_async_write_wait();
+    if (status != SD_BLOCK_DEVICE_ERROR_NONE){
+        printf("###ERROR, Image data block write error %d\r\n", status);
+        fr = FR_DISK_ERR;
+    }
+    else if (stagelen > 0){
+        int nblocks = (stagelen + FF_MIN_SS - 1) / FF_MIN_SS;
+        memset(&imagechunk[stagelen], 0, (nblocks * FF_MIN_SS) - stagelen);
+        fr = image_stage_write(nblocks);
+    }
+    if (fr == FR_OK){
+        // the file only shrinks from here, leave fast seek mode so f_truncate() follows the FAT chain
+        fil.cltbl = NULL;
+        fr = f_lseek(&fil, imageend);
+        if (fr == FR_OK)
+            fr = f_truncate(&fil);
+        if (fr != FR_OK)
+            printf("###ERROR, could not truncate the image file fr=%d\r\n", fr);
+    }
+    return(fr);
+}
+
+// read the sector data from the FPGA DRAM and write it to the image file
+// Core 1 reads the sectors from DRAM into the transfer ring while core 0 writes them to the microSD card.
+int write_disk_image_data(struct Disk_State* dstate)
+{
+    FRESULT fr;
+    char display_line_2[30];
+    int lastcylinder = -1;
+    int sectorswritten = 0;
+    int totalbytes = 0;
+    int retval = FILE_OPS_OKAY;
+    Xfer_Slot* slot;
+
+    printf("Writing disk image data to file '%s':\r\n", diskimagefilename);
+    printf(" cylinders=%d, heads=%d, sectors=%d\r\n", dstate->numberOfCylinders, dstate->numberOfHeads, dstate->numberOfSectorsPerTrack);
+    telemetry_begin();
+    uint64_t start_time = time_us_64();
+    // the records are written back to back after the header, so the new sector offsets are known as they are written.
+    // They can differ from the loaded ones, and the pack can run again after the save without a reload.
+    FSIZE_t recordoffset = f_tell(&fil);
+    int recordindex = 0;
+    bool trackoffsets = sector_offsets_reset(dstate);
+    imageasync_status = SD_BLOCK_DEVICE_ERROR_NONE;
+    if (image_stage_start() != FR_OK)
+        return(FILE_OPS_ERROR);
+    xfer_start_unload(dstate->numberOfCylinders, dstate->numberOfHeads, dstate->numberOfSectorsPerTrack);
+    while ((slot = xfer_consumer_slot()) != NULL){
+        int cylindercount = slot->ramaddress >> 14;
+        if (cylindercount != lastcylinder){
+            lastcylinder = cylindercount;
+            if ((cylindercount % 20) == 0)
+                printf("  cylindercount = %d\r\n", cylindercount);
+            if ((cylindercount % 10) == 0){
+                sprintf(display_line_2,"Cyl %d", cylindercount);
+                display_status((char *) "Write card", display_line_2);
+            }
+        }
+
+        const uint8_t* recordp = slot->data;
+        int recordcount = slot->count;
+        if (imageformat == IMAGE_FORMAT_2_0){
+            recordcount = image_encode_record_v2(slot->data, slot->count, 0, IMAGE_WRITE_FLAGS, recorddata);
+            recordp = recorddata;
+        }
+        image_async_poll();
+        fr = image_stage_append(recordp, recordcount);
+        if (fr != FR_OK) {
+            retval = FILE_OPS_ERROR;
+            break;
+        }
+        if (trackoffsets)
+            sectoroffset[recordindex++] = recordoffset;
+        recordoffset += recordcount;
+        totalbytes += recordcount;
+        sectorswritten++;
+        xfer_consumer_release();
+    }
+    if (!xfer_finish(retval != FILE_OPS_OKAY)) {
+        printf("###ERROR, bad sector length in DRAM after %d sectors\r\n", sectorswritten);
+        retval = FILE_OPS_ERROR;
+    }
+    if ((retval == FILE_OPS_OKAY) && (image_stage_finish() != FR_OK))
+        retval = FILE_OPS_ERROR;
+    image_async_wait(); // the card must be free before the file is touched again
+    if (retval != FILE_OPS_OKAY){
+        sectoroffset_valid = false;
+        return(retval);
+    }
+    if (trackoffsets)
+        sectoroffset[recordindex] = recordoffset;
+    imagerecordflags = IMAGE_WRITE_FLAGS;
+
+    int elapsed_us = (int)(time_us_64() - start_time);
+    printf("  saved %d bytes in %d msec, %.2f MB/s, waiting for FPGA transfers %d msec\r\n", totalbytes, elapsed_us / 1000,
+        (elapsed_us > 0) ? (float)totalbytes / (float)elapsed_us : 0.0f, xfer_stall_us() / 1000);
+    printf("  %d %s writes to the card\r\n", stagewrites, imageraw ? "raw block" : "filesystem");
+    telemetry_end(TELEMETRY_SAVE, totalbytes, elapsed_us);
+    return(FILE_OPS_OKAY);
+}
+
+// move the file pointer of the open image file to the start of the sector record for cylinder/head/sector
+// and return the length of the record in bytes, or -1 if the sector offset index isn't available
+// The index is built during the load and the image file has a cluster link map, so this never reads the card.
+static int seek_sector_record(int cylinder, int head, int sector)
+{
+    if (!sectoroffset_valid)
+        return(-1);
+    int recordindex = (((cylinder * sectoroffset_heads) + head) * sectoroffset_sectors) + sector;
+    if (f_lseek(&fil, sectoroffset[recordindex]) != FR_OK)
+        return(-1);
+    return((int)(sectoroffset[recordindex + 1] - sectoroffset[recordindex]));
+}
+
+// rewrite only the sector records that the controller has written since the load, in place in the open image file
+// Returns FILE_OPS_FULL_REWRITE if the dirty sectors can't be rewritten in place, either because a sector record
+// changed length or because the write tracking doesn't cover the whole pack. Then the whole image file must be rewritten.
+int write_dirty_sectors(struct Disk_State* dstate)
+{
+    FRESULT fr;
+    UINT nw;
+    int rewritten = 0;
+
+    if (!sectoroffset_valid || dirty_all_marked()){
+        printf("  sector tracking incomplete, rewriting the whole image\r\n");
+        return(FILE_OPS_FULL_REWRITE);
+    }
+    printf("Writing %d changed sectors to file '%s'\r\n", dirty_sector_count(), diskimagefilename);
+    telemetry_begin();
+    uint64_t start_time = time_us_64();
+    int totalbytes = 0;
+    for (int cylindercount = 0; cylindercount < dstate->numberOfCylinders; cylindercount++){
+        for (int headcount = 0; headcount < dstate->numberOfHeads; headcount++){
+            for (int sectorcount = 0; sectorcount < dstate->numberOfSectorsPerTrack; sectorcount++){
+                if (!dirty_is_marked(cylindercount, headcount, sectorcount))
+                    continue;
+                int ramaddress = (cylindercount << 14) | (headcount << 13) | (sectorcount << 9);
+                load_ram_address(ramaddress);
+
+                readbytes(sectordata, 4);
+                int sector_data_bit_count = (sectordata[3] << 8) | sectordata[2];
+                int wordcount = (sector_data_bit_count + 15) >> 4; // round the word count up to the next integer value
+                int bytecount = wordcount * 2 + 4;
+                int recordlength = seek_sector_record(cylindercount, headcount, sectorcount);
+                if (recordlength < 0){
+                    printf("###ERROR, cannot seek to sector record C=%d H=%d S=%d\r\n", cylindercount, headcount, sectorcount);
+                    return(FILE_OPS_ERROR);
+                }
+                // a format 1.1 record must keep its length, a format 2.0 record must fit in the body bytes it has in the file
+                // and keep the record flags, which have to be the same for every record so the header length is known
+                if ((bytecount > MAX_SECTOR_SIZE) || ((imageformat != IMAGE_FORMAT_2_0) && (bytecount != recordlength)) ||
+                    ((imageformat == IMAGE_FORMAT_2_0) && (imagerecordflags < 0))){
+                    printf("  sector length changed C=%d H=%d S=%d, rewriting the whole image\r\n", cylindercount, headcount, sectorcount);
+                    return(FILE_OPS_FULL_REWRITE);
+                }
+                readbytes(&sectordata[4], bytecount - 4);
+                const uint8_t* recordp = sectordata;
+                if (imageformat == IMAGE_FORMAT_2_0){
+                    // a storedbody of 0 asks the encoder for the shortest record, so a record with no body can't be rewritten in place
+                    int storedbody = recordlength - image_record_header_length(imagerecordflags);
+                    if ((storedbody <= 0) || (image_encode_record_v2(sectordata, bytecount, storedbody, imagerecordflags, recorddata) < 0)){
+                        printf("  sector no longer fits C=%d H=%d S=%d, rewriting the whole image\r\n", cylindercount, headcount, sectorcount);
+                        return(FILE_OPS_FULL_REWRITE);
+                    }
+                    recordp = recorddata;
+                }
+
+                fr = f_write(&fil, recordp, recordlength, &nw);
+                if (fr != FR_OK || nw != recordlength) {
+                    printf("###ERROR, Image data write error C=%d H=%d S=%d fr=%d, nw=%u\r\n", cylindercount, headcount, sectorcount, fr, nw);
+                    return(FILE_OPS_ERROR);
+                }
+                rewritten++;
+                totalbytes += recordlength;
+            }
+        }
+    }
+    int elapsed_us = (int)(time_us_64() - start_time);
+    printf("  rewrote %d sectors in %d msec\r\n", rewritten, elapsed_us / 1000);
+    telemetry_end(TELEMETRY_REWRITE, totalbytes, elapsed_us);
+    return(FILE_OPS_OKAY);
+}
+
+// *************** sector journal ***************
+// The controller and the SPI port share the FPGA DRAM address register, so nothing can be read back from DRAM
+// while the pack is running without corrupting a controller transfer. When the pack is stopped with the WT PROT
+// switch held the door is opened without saving the image, and the sectors the controller wrote are read back
+// from DRAM first and written to a journal file next to the image file (same name with the .rkj extension).
+// The journal is replayed into DRAM at the next load and those sectors are saved into the image file at the next
+// unload, and the journal is removed once the image is saved.
+//
+// The journal is written to a new file (.rjn extension) that replaces the old journal only when it is complete,
+// so a power loss while it is written leaves the old journal in place. A journal left by an earlier session has
+// already been replayed into DRAM with its sectors marked as written, so the new journal holds them too.
+//
+// The journal starts with a 20-byte header, 'R' 'K' 'J' '1' then the fingerprint of the image file it was made
+// for (see image_fingerprint_make()). A journal that doesn't match the image file is not replayed.
+// Each journal record is a 10-byte record header followed by the sector record as it is in a format 1.1 image file:
+//   bytes 0-1  'J' 'R' record marker
+//   byte  2    cylinder
+//   byte  3    head
+//   byte  4    sector
+//   byte  5    0
+//   bytes 6-7  length of the sector record in bytes (little endian)
+//   bytes 8-9  16-bit sum of the sector record bytes (little endian)
+//
+#define JOURNAL_HEADER_SIZE (4 + IMAGE_FINGERPRINT_SIZE)
+#define JOURNAL_RECORD_HEADER_SIZE 10
+
+static FIL jfil;
+static char journalfilename[FF_LFN_BUF + 1] = "";
+static char journalnewfilename[FF_LFN_BUF + 1] = "";
+static bool journal_active = false;     // the filesystem is mounted while the pack is running
+static uint8_t journaldata[JOURNAL_RECORD_HEADER_SIZE + MAX_SECTOR_SIZE];
+
+static void make_journal_filename()
+{
+    make_sidecar_filename(journalfilename, ".rkj");
+    make_sidecar_filename(journalnewfilename, ".rjn");
+}
+
+static uint16_t journal_checksum(const uint8_t* bp, int count)
+{
+    uint16_t sum = 0;
+    for (int i = 0; i < count; i++)
+        sum += *bp++;
+    return(sum);
+}
+
+// replay the journal left by a previous session into DRAM and mark those sectors as written
+// Called after the image data is loaded while the image file is still open. A record that was cut short by a
+// power loss ends the replay.
+int journal_replay(struct Disk_State* dstate)
+{
+    FRESULT fr;
+    UINT nr;
+    int replayed = 0;
+
+    make_journal_filename();
+    fr = f_open(&jfil, journalfilename, FA_READ);
+    if ((fr == FR_NO_FILE) && (f_rename(journalnewfilename, journalfilename) == FR_OK)){
+        // power was lost after the old journal was removed and before the new one was renamed
+        fr = f_open(&jfil, journalfilename, FA_READ);
+    }
+    if (fr == FR_NO_FILE)
+        return(FILE_OPS_OKAY);
+    if (fr != FR_OK){
+        printf("###ERROR, could not open journal file '%s' (%d)\r\n", journalfilename, fr);
+        return(fr);
+    }
+    fr = f_read(&jfil, journaldata, JOURNAL_HEADER_SIZE, &nr);
+    if ((fr != FR_OK) || (nr != JOURNAL_HEADER_SIZE) || (memcmp(journaldata, "RKJ1", 4) != 0) || !imagefingerprint_valid
+            || (memcmp(&journaldata[4], imagefingerprint, IMAGE_FINGERPRINT_SIZE) != 0)){
+        printf("###ERROR, journal file '%s' was not written for this image file, it is not replayed\r\n", journalfilename);
+        f_close(&jfil);
+        return(FILE_OPS_OKAY);
+    }
+    printf("Replaying journal file '%s'\r\n", journalfilename);
+    while (true){
+        uint8_t* hp = journaldata;
+        uint8_t* bp = &journaldata[JOURNAL_RECORD_HEADER_SIZE];
+        fr = f_read(&jfil, hp, JOURNAL_RECORD_HEADER_SIZE, &nr);
+        if ((fr != FR_OK) || (nr == 0))
+            break;
+        int cylinder = hp[2];
+        int head = hp[3];
+        int sector = hp[4];
+        int recordsize = hp[6] | (hp[7] << 8);
+        if ((nr != JOURNAL_RECORD_HEADER_SIZE) || (hp[0] != 'J') || (hp[1] != 'R') || (cylinder >= dstate->numberOfCylinders)
+                || (head >= dstate->numberOfHeads) || (sector >= dstate->numberOfSectorsPerTrack) || (recordsize < 4) || (recordsize > MAX_SECTOR_SIZE)){
+            printf("  journal ends with an incomplete or invalid record header\r\n");
+            break;
+        }
+        fr = f_read(&jfil, bp, recordsize, &nr);
+        int sector_data_bit_count = (bp[3] << 8) | bp[2];
+        if ((fr != FR_OK) || (nr != recordsize) || (journal_checksum(bp, recordsize) != (hp[8] | (hp[9] << 8)))
+                || ((((sector_data_bit_count + 15) >> 4) * 2 + 4) != recordsize)){
+            printf("  journal ends with an incomplete record, C=%d H=%d S=%d\r\n", cylinder, head, sector);
+            break;
+        }
+        load_ram_address((cylinder << 14) | (head << 13) | (sector << 9));
+        storebytes(bp, recordsize);
+        dirty_mark(cylinder, head, sector);
+        replayed++;
+    }
+    f_close(&jfil);
+    printf("  replayed %d sectors from the journal\r\n", replayed);
+    return(FILE_OPS_OKAY);
+}
+
+// mount the filesystem while the pack is running for the journal and the command trace, called after the image
+// file is closed
+int journal_start()
+{
+    FRESULT fr;
+    journal_active = false;
+    if ((fr = mount_card()) != FR_OK){
+        printf("###ERROR, could not mount filesystem for the journal (%d)\r\n", fr);
+        return(fr);
+    }
+    journal_active = true;
+    return(FILE_OPS_OKAY);
+}
+
+// write the sectors written by the controller to the journal, called when the pack is stopped without saving the
+// image file. File_Ready must already be clear so the controller can't use DRAM while it is read back.
+int journal_save(struct Disk_State* dstate)
+{
+    FRESULT fr;
+    UINT nw;
+    int saved = 0;
+
+    if (!dirty_all_marked() && (dirty_sector_count() == 0))
+        return(FILE_OPS_OKAY);
+    if (!journal_active || !imagefingerprint_valid){
+        printf("###ERROR, the journal can't be written, the sectors written by the controller are lost\r\n");
+        return(FILE_OPS_ERROR);
+    }
+    printf("Writing the sectors written by the controller to journal file '%s'\r\n", journalfilename);
+    uint64_t start_time = time_us_64();
+    fr = f_open(&jfil, journalnewfilename, FA_WRITE | FA_CREATE_ALWAYS);
+    if (fr == FR_OK){
+        memcpy(journaldata, "RKJ1", 4);
+        memcpy(&journaldata[4], imagefingerprint, IMAGE_FINGERPRINT_SIZE);
+        fr = f_write(&jfil, journaldata, JOURNAL_HEADER_SIZE, &nw);
+        if ((fr == FR_OK) && (nw != JOURNAL_HEADER_SIZE))
+            fr = FR_DENIED;
+    }
+    for (int cylinder = 0; (fr == FR_OK) && (cylinder < dstate->numberOfCylinders); cylinder++){
+        for (int head = 0; (fr == FR_OK) && (head < dstate->numberOfHeads); head++){
+            for (int sector = 0; (fr == FR_OK) && (sector < dstate->numberOfSectorsPerTrack); sector++){
+                if (!dirty_is_marked(cylinder, head, sector))
+                    continue;
+                // read the sector record back from DRAM behind the record header
+                load_ram_address((cylinder << 14) | (head << 13) | (sector << 9));
+                readbytes(&journaldata[JOURNAL_RECORD_HEADER_SIZE], 4);
+                int sector_data_bit_count = (journaldata[JOURNAL_RECORD_HEADER_SIZE + 3] << 8) | journaldata[JOURNAL_RECORD_HEADER_SIZE + 2];
+                int recordsize = (((sector_data_bit_count + 15) >> 4) * 2) + 4;
+                if (recordsize > MAX_SECTOR_SIZE)
+                    continue;
+                readbytes(&journaldata[JOURNAL_RECORD_HEADER_SIZE + 4], recordsize - 4);
+                uint16_t sum = journal_checksum(&journaldata[JOURNAL_RECORD_HEADER_SIZE], recordsize);
+                journaldata[0] = 'J';
+                journaldata[1] = 'R';
+                journaldata[2] = cylinder;
+                journaldata[3] = head;
+                journaldata[4] = sector;
+                journaldata[5] = 0;
+                journaldata[6] = recordsize & 0xff;
+                journaldata[7] = (recordsize >> 8) & 0xff;
+                journaldata[8] = sum & 0xff;
+                journaldata[9] = (sum >> 8) & 0xff;
+                fr = f_write(&jfil, journaldata, JOURNAL_RECORD_HEADER_SIZE + recordsize, &nw);
+                if ((fr == FR_OK) && (nw != (UINT)(JOURNAL_RECORD_HEADER_SIZE + recordsize)))
+                    fr = FR_DENIED; // the card is full
+                if (fr == FR_OK)
+                    saved++;
+            }
+        }
+    }
+    FRESULT frclose = f_close(&jfil);
+    if (fr == FR_OK)
+        fr = frclose;
+    // replace the old journal only with a complete new one
+    if (fr == FR_OK){
+        fr = f_unlink(journalfilename);
+        if (fr == FR_NO_FILE)
+            fr = FR_OK;
+    }
+    if (fr == FR_OK)
+        fr = f_rename(journalnewfilename, journalfilename);
+    if (fr != FR_OK){
+        printf("###ERROR, journal write error (%d), the sectors written by the controller are lost\r\n", fr);
+        display_error((char *) "journal", (char *) "write fail");
+        f_unlink(journalnewfilename);
+        return(fr);
+    }
+    printf("  wrote %d sectors to the journal in %d msec\r\n", saved, (int)((time_us_64() - start_time) / 1000));
+    return(FILE_OPS_OKAY);
+}
+
+// unmount the filesystem before the image file is opened for the unload
+void journal_stop()
+{
+    if (journal_active){
+        f_unmount("0:");
+        sd_card_t *pSD = sd_get_by_num(0);
+        pSD->m_Status |= STA_NOINIT;
+    }
+    journal_active = false;
+}
+
+// remove the journal after its sectors have been saved in the image file
+int file_remove_journal()
+{
+    FRESULT fr;
+    if (journalfilename[0] == '\0')
+        return(FILE_OPS_OKAY);
+    if ((fr = mount_card()) != FR_OK){
+        printf("###ERROR, could not mount filesystem to remove the journal (%d)\r\n", fr);
+        return(fr);
+    }
+    fr = f_unlink(journalfilename);
+    if ((fr != FR_OK) && (fr != FR_NO_FILE))
+        printf("###ERROR, could not remove journal file '%s' (%d)\r\n", journalfilename, fr);
+    f_unlink(journalnewfilename);
+    catalog_update(NULL);
+    force_unmount();
+    return(((fr == FR_OK) || (fr == FR_NO_FILE)) ? FILE_OPS_OKAY : fr);
+}
+
+// *************** command trace ***************
+// If the directory RK05TRC exists on the card, every seek, read and write command from the controller is recorded
+// in binary trace files in that directory while the pack is running. The command event interrupt puts the events
+// in the event ring (see emulator_events.cpp), the main loop drains the ring into tracebuf and trace_service()
+// writes the buffer to the file in 2 KB pieces that end on a 2 KB file offset, and at least every 5 seconds.
+// A file is closed at TRACE_FILE_MAX_SIZE and the next one is started, and only the newest TRACE_KEEP_FILES files
+// are kept. The files are named Tnnnnnnn.RKT with a sequence number that keeps counting up across loads, and
+// they can be read with the RK05_Trace_Analyzer host tool.
+//
+// Each file starts with a 64-byte header:
+//   bytes 0-7    "RK05TRC" and 0x1A
+//   bytes 8-9    format version, 1 (little endian)
+//   bytes 10-11  record size, 8 (little endian)
+//   bytes 12-13  number of cylinders (little endian)
+//   byte  14     number of heads
+//   byte  15     number of sectors per track
+//   bytes 16-19  file sequence number (little endian)
+//   bytes 20-23  time_us_32() when the file was started (little endian)
+//   bytes 24-63  image file name, padded with zeros
+// followed by 8-byte records:
+//   bytes 0-3    time_us_32() when the command interrupt was taken, it wraps every 71.6 minutes (little endian)
+//   byte  4      EVENT_SEEK, EVENT_READ, EVENT_WRITE, EVENT_ERROR, EVENT_RESTORE or EVENT_LOST
+//   byte  5      cylinder
+//   byte  6      head
+//   byte  7      sector
+// An EVENT_LOST record holds the number of events that could not be recorded in bytes 5-7 (little endian).
+//
+#define TRACE_DIRNAME "RK05TRC"
+#define TRACE_HEADER_SIZE 64
+#define TRACE_RECORD_SIZE 8
+#define TRACE_VERSION 1
+#define TRACE_BUFFER_SIZE (8 * 1024)
+#define TRACE_WRITE_SIZE 2048
+#define TRACE_SYNC_US 5000000
+#define TRACE_FILE_MAX_SIZE (4 * 1024 * 1024)
+#define TRACE_KEEP_FILES 32
+
+static FIL tfil;
+static char tracefilename[FF_LFN_BUF + 1] = "";
+static bool trace_active = false;      // the pack is running and a trace file is open
+static uint32_t tracesequence;         // sequence number of the open trace file
+static uint8_t tracebuf[TRACE_BUFFER_SIZE];
+static int tracelen;                   // number of bytes waiting in tracebuf
+static uint64_t tracesynctime;         // time of the last write to the card
+static uint32_t tracerecords;          // events recorded since trace_start()
+static uint32_t tracelost;             // events lost since the last EVENT_LOST record
+static uint32_t tracelosttotal;        // events lost since trace_start()
+static uint32_t traceringdropped;      // event_ring_dropped() when it was last checked
+static int tracefiles;                 // files started since trace_start()
+
+static void make_trace_filename(uint32_t sequence)
+{
+    snprintf(tracefilename, sizeof(tracefilename), "%s/T%07lu.RKT", TRACE_DIRNAME, (unsigned long)(sequence % 10000000));
+}
+
+// find the sequence number after the newest trace file in the directory, returns false if there is no directory
+static bool trace_next_sequence(uint32_t* sequence)
+{
+    DIR dir;
+    FILINFO fno;
+    *sequence = 0;
+    FRESULT fr = f_findfirst(&dir, &fno, TRACE_DIRNAME, "T*.RKT");
+    if (fr != FR_OK)
+        return(false);
+    while ((fr == FR_OK) && (fno.fname[0] != '\0')){
+        uint32_t n = strtoul(&fno.fname[1], NULL, 10);
+        if (n >= *sequence)
+            *sequence = n + 1;
+        fr = f_findnext(&dir, &fno);
+    }
+    f_closedir(&dir);
+    return(true);
+}
+
+static bool trace_file_open(struct Disk_State* dstate)
+{
+    uint8_t header[TRACE_HEADER_SIZE];
+    UINT nw;
+
+    // rotate, the oldest file kept is the one TRACE_KEEP_FILES before this one
+    if (tracesequence >= TRACE_KEEP_FILES){
+        make_trace_filename(tracesequence - TRACE_KEEP_FILES);
+        f_unlink(tracefilename);
+    }
+    make_trace_filename(tracesequence);
+    FRESULT fr = f_open(&tfil, tracefilename, FA_WRITE | FA_CREATE_ALWAYS);
+    if (fr != FR_OK){
+        printf("###ERROR, could not create trace file '%s' (%d)\r\n", tracefilename, fr);
+        return(false);
+    }
+    memset(header, 0, sizeof(header));
+    memcpy(header, "RK05TRC\x1A", 8);
+    header[8] = TRACE_VERSION;
+    header[10] = TRACE_RECORD_SIZE;
+    header[12] = dstate->numberOfCylinders & 0xff;
+    header[13] = (dstate->numberOfCylinders >> 8) & 0xff;
+    header[14] = dstate->numberOfHeads;
+    header[15] = dstate->numberOfSectorsPerTrack;
+    put_le32(&header[16], tracesequence);
+    put_le32(&header[20], time_us_32());
+    strncpy((char *)&header[24], diskimagefilename, TRACE_HEADER_SIZE - 24);
+    fr = f_write(&tfil, header, TRACE_HEADER_SIZE, &nw);
+    if ((fr != FR_OK) || (nw != TRACE_HEADER_SIZE)){
+        printf("###ERROR, could not write trace file '%s' (%d)\r\n", tracefilename, fr);
+        f_close(&tfil);
+        return(false);
+    }
+    tracefiles++;
+    return(true);
+}
+
+static void trace_fail(FRESULT fr)
+{
+    printf("###ERROR, trace write error (%d), trace stopped\r\n", fr);
+    f_close(&tfil);
+    set_event_trace(false);
+    trace_active = false;
+}
+
+// write count bytes from the front of tracebuf to the file
+static bool trace_write(int count)
+{
+    UINT nw;
+    FRESULT fr = f_write(&tfil, tracebuf, count, &nw);
+    if ((fr != FR_OK) || (nw != (UINT)count)){
+        trace_fail(fr);
+        return(false);
+    }
+    tracelen -= count;
+    memmove(tracebuf, &tracebuf[count], tracelen);
+    tracesynctime = time_us_64();
+    return(true);
+}
+
+// start a trace file if the trace directory exists, called after journal_start() has mounted the filesystem
+void trace_start(struct Disk_State* dstate)
+{
+    trace_active = false;
+    tracelen = 0;
+    tracerecords = 0;
+    tracelost = 0;
+    tracelosttotal = 0;
+    tracefiles = 0;
+    if (!journal_active || !trace_next_sequence(&tracesequence))
+        return;
+    if (!trace_file_open(dstate))
+        return;
+    printf("Tracing controller commands to '%s'\r\n", tracefilename);
+    traceringdropped = event_ring_dropped();
+    tracesynctime = time_us_64();
+    trace_active = true;
+    set_event_trace(true);
+}
+
+static bool trace_put(uint32_t time_us, int opcode, int b5, int b6, int b7)
+{
+    if ((tracelen + TRACE_RECORD_SIZE) > TRACE_BUFFER_SIZE)
+        return(false);
+    uint8_t* bp = &tracebuf[tracelen];
+    put_le32(bp, time_us);
+    bp[4] = opcode;
+    bp[5] = b5;
+    bp[6] = b6;
+    bp[7] = b7;
+    tracelen += TRACE_RECORD_SIZE;
+    return(true);
+}
+
+// add one event to the trace buffer, called by event_log_drain() for every event taken off the event ring
+void trace_record(const Event_Record* rec)
+{
+    if (!trace_active)
+        return;
+    // events the ring or the buffer had no room for are noted with one EVENT_LOST record before the next event
+    uint32_t ringdropped = event_ring_dropped();
+    tracelost += ringdropped - traceringdropped;
+    tracelosttotal += ringdropped - traceringdropped;
+    traceringdropped = ringdropped;
+    if (tracelost > 0){
+        if (!trace_put(rec->time_us, EVENT_LOST, tracelost & 0xff, (tracelost >> 8) & 0xff, (tracelost >> 16) & 0xff)){
+            tracelost++;
+            tracelosttotal++;
+            return;
+        }
+        tracelost = 0;
+    }
+    if (trace_put(rec->time_us, rec->opcode, rec->cylinder, rec->head, rec->sector))
+        tracerecords++;
+    else{
+        tracelost++;
+        tracelosttotal++;
+    }
+}
+
+// called every main loop tick while the pack is running, writes the trace buffer to the card in pieces that end
+// on a TRACE_WRITE_SIZE file offset, and whatever is left at least every TRACE_SYNC_US
+void trace_service(struct Disk_State* dstate)
+{
+    if (!trace_active)
+        return;
+    while (trace_active){
+        int count = TRACE_WRITE_SIZE - (int)(f_tell(&tfil) % TRACE_WRITE_SIZE);
+        if (tracelen < count)
+            break;
+        if (!trace_write(count))
+            return;
+    }
+    if ((tracelen > 0) && ((time_us_64() - tracesynctime) >= TRACE_SYNC_US)){
+        if (!trace_write(tracelen))
+            return;
+        FRESULT fr = f_sync(&tfil);
+        if (fr != FR_OK){
+            trace_fail(fr);
+            return;
+        }
+    }
+    if (f_size(&tfil) >= TRACE_FILE_MAX_SIZE){
+        f_close(&tfil);
+        tracesequence++;
+        if (!trace_file_open(dstate)){
+            set_event_trace(false);
+            trace_active = false;
+        }
+    }
+}
+
+// write the rest of the trace and close the file, called before journal_stop() unmounts the filesystem
+void trace_stop()
+{
+    if (!trace_active)
+        return;
+    event_log_drain(); // the events still in the ring
+    set_event_trace(false);
+    if ((tracelen > 0) && !trace_write(tracelen))
+        return;
+    f_close(&tfil);
+    trace_active = false;
+    printf("Trace stopped, %lu events in %d files up to '%s', %lu lost\r\n", (unsigned long)tracerecords, tracefiles,
+        tracefilename, (unsigned long)tracelosttotal);
+}
+
+// print the state of the command trace
+void trace_status()
+{
+    if (!trace_active){
+        printf("  command trace is off, create the directory %s on the card to turn it on\r\n", TRACE_DIRNAME);
+        return;
+    }
+    printf("  command trace file '%s', %lu events, %lu lost, %d bytes buffered\r\n", tracefilename,
+        (unsigned long)tracerecords, (unsigned long)tracelosttotal, tracelen);
+}
+
+// *************** image catalog ***************
+// A card can hold a library of image files. Instead of searching the directory at every load, the file name, the
+// header values and the size of every .rke file are kept in a catalog file in the root directory (RK05CAT.RKC).
+// The image for the drive address is found with one lookup in the slot table at the front of the catalog, and
+// any image can be found by name through the hash table at the end, so neither needs a directory scan.
+//
+// An image file whose name starts with a drive address digit and an underscore (e.g. "3_rt11.rke") is the image
+// for that drive address. A drive address with no image of its own gets the image whose name sorts first.
+//
+// The catalog records the number of free clusters on the card when it was written. If that has changed at the
+// next load, or the size or timestamp of the selected image file doesn't match its entry, the files were changed
+// on another computer and the catalog is rebuilt. Entries of image files that didn't change are copied from the
+// old catalog, so only new or changed image files are opened to read their headers. The firmware updates the
+// catalog after its own writes to the card. A rename on another computer doesn't change the free cluster count,
+// the DIRECTORY command in Interface Test Mode always rebuilds the catalog.
+//
+// Catalog file layout, all values little endian:
+//   bytes 0-3    'R' 'K' 'C' '1'
+//   bytes 4-7    number of entries
+//   bytes 8-11   free clusters on the card
+//   bytes 12-15  number of hash table buckets, a power of 2
+//   bytes 16-31  entry number + 1 of the image for drive addresses 0 to 7, 0 if the catalog is empty
+//   then one 96-byte entry per image file:
+//     bytes 0-63   file name, zero padded, files with longer names are not in the catalog
+//     bytes 64-74  image name from the header
+//     byte  75     image file header version, 11, 20 or 21
+//     bytes 76-79  file size
+//     bytes 80-81  file date, FAT format
+//     bytes 82-83  file time, FAT format
+//     bytes 84-85  cylinders
+//     byte  86     heads
+//     byte  87     sectors per track
+//     bytes 88-95  0
+//   then the hash table, one 16-bit entry number + 1 per bucket, 0 for an empty bucket. A name goes in the bucket
+//   given by the FNV-1a hash of the upper case name, or the next free one after it.
+//
+#define CATALOG_FILENAME "RK05CAT.RKC"
+#define CATALOG_TEMPNAME "RK05CAT.TMP"
+#define CATALOG_HEADER_SIZE 32
+#define CATALOG_ENTRY_SIZE 96
+#define CATALOG_NAME_LEN 64
+#define CATALOG_SLOTS 8
+#define CATALOG_MAX_ENTRIES 512
+#define CATALOG_MAX_BUCKETS (CATALOG_MAX_ENTRIES * 2)
+#define IMAGE_FIXED_HEADER_SIZE 365  // the format 1.1 header, version 2.1 adds the trailer after it
+
+static FIL catfil;      // the catalog being read
+static FIL catnewfil;   // the catalog being built
+static uint32_t catalog_hashes[CATALOG_MAX_ENTRIES];
+static uint16_t catalog_buckets[CATALOG_MAX_BUCKETS];
+
+static uint32_t get_le32(const uint8_t* bp)
+{
+    return(bp[0] | (bp[1] << 8) | (bp[2] << 16) | ((uint32_t)bp[3] << 24));
+}
+
+static uint32_t get_be32(const uint8_t* bp)
+{
+    return(((uint32_t)bp[0] << 24) | (bp[1] << 16) | (bp[2] << 8) | bp[3]);
+}
+
+static uint32_t catalog_name_hash(const char* name)
+{
+    uint32_t hash = 2166136261u;
+    for (; *name != '\0'; name++){
+        char c = *name;
+        if ((c >= 'a') && (c <= 'z'))
+            c -= 'a' - 'A';
+        hash = (hash ^ (uint8_t)c) * 16777619u;
+    }
+    return(hash);
+}
+
+// free clusters on the card, FatFs keeps the count in the FSInfo sector of a FAT32 card so this doesn't scan the FAT
+static uint32_t card_free_clusters()
+{
+    DWORD freeclusters;
+    FATFS* fsp;
+    if (f_getfree("0:", &freeclusters, &fsp) != FR_OK)
+        return(0xFFFFFFFF);
+    return((uint32_t)freeclusters);
+}
+
+static bool catalog_read_at(FIL* fp, FSIZE_t offset, uint8_t* bp, int count)
+{
+    UINT nr;
+    return((f_lseek(fp, offset) == FR_OK) && (f_read(fp, bp, count, &nr) == FR_OK) && (nr == (UINT)count));
+}
+
+static bool catalog_write_at(FIL* fp, FSIZE_t offset, const uint8_t* bp, int count)
+{
+    UINT nw;
+    return((f_lseek(fp, offset) == FR_OK) && (f_write(fp, bp, count, &nw) == FR_OK) && (nw == (UINT)count));
+}
+
+// read the catalog header from the open catalog file, false if it isn't a catalog
+static bool catalog_read_header(FIL* fp, uint8_t* header)
+{
+    if (!catalog_read_at(fp, 0, header, CATALOG_HEADER_SIZE) || (memcmp(header, "RKC1", 4) != 0))
+        return(false);
+    uint32_t entries = get_le32(&header[4]);
+    uint32_t buckets = get_le32(&header[12]);
+    return((entries <= CATALOG_MAX_ENTRIES) && (buckets <= CATALOG_MAX_BUCKETS) && (buckets > entries) && ((buckets & (buckets - 1)) == 0));
+}
+
+static FSIZE_t catalog_entry_offset(int index)
+{
+    return(CATALOG_HEADER_SIZE + ((FSIZE_t)index * CATALOG_ENTRY_SIZE));
+}
+
+// look up an image file name in the open catalog, returns the entry number and the entry, or -1 if it isn't there
+static int catalog_find_name(FIL* fp, const uint8_t* header, const char* name, uint8_t* entry)
+{
+    uint32_t entries = get_le32(&header[4]);
+    uint32_t buckets = get_le32(&header[12]);
+    FSIZE_t tableoffset = catalog_entry_offset(entries);
+    uint32_t bucket = catalog_name_hash(name) & (buckets - 1);
+
+    for (uint32_t probe = 0; probe < buckets; probe++){
+        uint8_t slot[2];
+        if (!catalog_read_at(fp, tableoffset + (bucket * 2), slot, 2))
+            return(-1);
+        int index = (slot[0] | (slot[1] << 8)) - 1;
+        if ((index < 0) || (index >= (int)entries))
+            return(-1);
+        if (!catalog_read_at(fp, catalog_entry_offset(index), entry, CATALOG_ENTRY_SIZE))
+            return(-1);
+        if (strncasecmp((char*)entry, name, CATALOG_NAME_LEN) == 0)
+            return(index);
+        bucket = (bucket + 1) & (buckets - 1);
+    }
+    return(-1);
+}
+
+// true if the catalog entry still describes the file
+static bool catalog_entry_current(const uint8_t* entry, const FILINFO* fno)
+{
+    return((get_le32(&entry[76]) == (uint32_t)fno->fsize) && ((entry[80] | (entry[81] << 8)) == fno->fdate) &&
+        ((entry[82] | (entry[83] << 8)) == fno->ftime));
+}
+
+// fill in the size and timestamp of a catalog entry from the file
+static void catalog_entry_stat(uint8_t* entry, const FILINFO* fno)
+{
+    put_le32(&entry[76], (uint32_t)fno->fsize);
+    entry[80] = fno->fdate & 0xff;
+    entry[81] = (fno->fdate >> 8) & 0xff;
+    entry[82] = fno->ftime & 0xff;
+    entry[83] = (fno->ftime >> 8) & 0xff;
+}
+
+// build a catalog entry for an image file by reading its header, uses the image file object because no image is open
+static bool catalog_entry_from_image(const FILINFO* fno, uint8_t* entry)
+{
+    static uint8_t header[IMAGE_FIXED_HEADER_SIZE];
+    UINT nr;
+
+    if (f_open(&fil, fno->fname, FA_READ) != FR_OK)
+        return(false);
+    bool ok = (f_read(&fil, header, sizeof(header), &nr) == FR_OK) && (nr == sizeof(header));
+    f_close(&fil);
+    if (!ok || (memcmp(header, magicNumber, sizeof(magicNumber)) != 0))
+        return(false);
+
+    memset(entry, 0, CATALOG_ENTRY_SIZE);
+    strncpy((char*)entry, fno->fname, CATALOG_NAME_LEN);
+    memcpy(&entry[64], &header[14], 11);
+    entry[74] = '\0';
+    entry[75] = ((header[10] - '0') * 10) + (header[12] - '0');  // "1.1", "2.0" or "2.1"
+    uint32_t cylinders = get_be32(&header[349]);
+    entry[84] = cylinders & 0xff;
+    entry[85] = (cylinders >> 8) & 0xff;
+    entry[86] = get_be32(&header[357]) & 0xff;
+    entry[87] = get_be32(&header[353]) & 0xff;
+    catalog_entry_stat(entry, fno);
+    return(true);
+}
+
+// rebuild the catalog from the directory, reusing the entries of the old catalog for files that haven't changed
+static FRESULT catalog_rebuild()
+{
+    DIR dir;
+    FILINFO fno;
+    FRESULT fr;
+    uint8_t oldheader[CATALOG_HEADER_SIZE];
+    uint8_t header[CATALOG_HEADER_SIZE];
+    uint8_t entry[CATALOG_ENTRY_SIZE];
+    uint16_t slots[CATALOG_SLOTS];
+    char slotnames[CATALOG_SLOTS][CATALOG_NAME_LEN];
+    char firstname[CATALOG_NAME_LEN];
+    uint16_t firstentry = 0;
+    int entries = 0;
+    int reused = 0;
+
+    printf("Rebuilding the image catalog\r\n");
+    uint64_t start_time = time_us_64();
+    bool haveold = (f_open(&catfil, CATALOG_FILENAME, FA_READ) == FR_OK);
+    if (haveold && !catalog_read_header(&catfil, oldheader)){
+        f_close(&catfil);
+        haveold = false;
+    }
+    if ((fr = f_open(&catnewfil, CATALOG_TEMPNAME, FA_WRITE | FA_READ | FA_CREATE_ALWAYS)) != FR_OK){
+        printf("###ERROR, could not create the image catalog (%d)\r\n", fr);
+        if (haveold)
+            f_close(&catfil);
+        return(fr);
+    }
+    memset(slots, 0, sizeof(slots));
+    memset(header, 0, sizeof(header));
+    firstname[0] = '\0';
+
+    fr = f_findfirst(&dir, &fno, "", "?*.rke");
+    while ((fr == FR_OK) && (fno.fname[0] != '\0')){
+        if (strlen(fno.fname) >= CATALOG_NAME_LEN)
+            printf("  '%s' is not in the catalog, the name is longer than %d characters\r\n", fno.fname, CATALOG_NAME_LEN - 1);
+        else if (entries >= CATALOG_MAX_ENTRIES)
+            printf("  '%s' is not in the catalog, the catalog is full\r\n", fno.fname);
+        else{
+            bool ok = false;
+            if (haveold && (catalog_find_name(&catfil, oldheader, fno.fname, entry) >= 0) && catalog_entry_current(entry, &fno)){
+                ok = true;
+                reused++;
+            }
+            else
+                ok = catalog_entry_from_image(&fno, entry);
+            if (!ok)
+                printf("  '%s' is not in the catalog, the header can't be read\r\n", fno.fname);
+            else if (!catalog_write_at(&catnewfil, catalog_entry_offset(entries), entry, CATALOG_ENTRY_SIZE)){
+                fr = FR_DISK_ERR;
+                break;
+            }
+            else{
+                // an image named "<drive address>_..." belongs to that drive address, otherwise the first name is the default
+                catalog_hashes[entries] = catalog_name_hash(fno.fname);
+                int slot = fno.fname[0] - '0';
+                if ((slot >= 0) && (slot < CATALOG_SLOTS) && (fno.fname[1] == '_') &&
+                    ((slots[slot] == 0) || (strcasecmp(fno.fname, slotnames[slot]) < 0))){
+                    slots[slot] = entries + 1;
+                    strcpy(slotnames[slot], fno.fname);
+                }
+                if ((firstname[0] == '\0') || (strcasecmp(fno.fname, firstname) < 0)){
+                    firstentry = entries + 1;
+                    strcpy(firstname, fno.fname);
+                }
+                entries++;
+            }
+        }
+        fr = f_findnext(&dir, &fno);
+    }
+    f_closedir(&dir);
+    if (haveold)
+        f_close(&catfil);
+
+    // the hash table, at least twice as many buckets as entries so the probe sequences stay short
+    uint32_t buckets = 16;
+    while (buckets < (uint32_t)(entries * 2))
+        buckets <<= 1;
+    memset(catalog_buckets, 0, buckets * sizeof(catalog_buckets[0]));
+    for (int i = 0; i < entries; i++){
+        uint32_t bucket = catalog_hashes[i] & (buckets - 1);
+        while (catalog_buckets[bucket] != 0)
+            bucket = (bucket + 1) & (buckets - 1);
+        catalog_buckets[bucket] = i + 1;
+    }
+    uint8_t bucketbytes[2];
+    for (uint32_t i = 0; (fr == FR_OK) && (i < buckets); i++){
+        bucketbytes[0] = catalog_buckets[i] & 0xff;
+        bucketbytes[1] = (catalog_buckets[i] >> 8) & 0xff;
+        if (!catalog_write_at(&catnewfil, catalog_entry_offset(entries) + (i * 2), bucketbytes, 2))
+            fr = FR_DISK_ERR;
+    }
+
+    memcpy(header, "RKC1", 4);
+    put_le32(&header[4], entries);
+    put_le32(&header[12], buckets);
+    for (int slot = 0; slot < CATALOG_SLOTS; slot++){
+        uint16_t index = (slots[slot] != 0) ? slots[slot] : firstentry;
+        header[16 + (slot * 2)] = index & 0xff;
+        header[17 + (slot * 2)] = (index >> 8) & 0xff;
+    }
+    // the free cluster count is taken after the catalog has its final size
+    if ((fr == FR_OK) && !catalog_write_at(&catnewfil, 0, header, CATALOG_HEADER_SIZE))
+        fr = FR_DISK_ERR;
+    FRESULT frclose = f_close(&catnewfil);
+    if (fr == FR_OK)
+        fr = frclose;
+    if (fr == FR_OK){
+        fr = f_unlink(CATALOG_FILENAME);
+        if (fr == FR_NO_FILE)
+            fr = FR_OK;
+    }
+    if (fr == FR_OK)
+        fr = f_rename(CATALOG_TEMPNAME, CATALOG_FILENAME);
+    if (fr == FR_OK)
+        fr = f_open(&catnewfil, CATALOG_FILENAME, FA_WRITE | FA_READ);
+    if (fr == FR_OK){
+        put_le32(&header[8], card_free_clusters());
+        if (!catalog_write_at(&catnewfil, 0, header, CATALOG_HEADER_SIZE))
+            fr = FR_DISK_ERR;
+        frclose = f_close(&catnewfil);
+        if (fr == FR_OK)
+            fr = frclose;
+    }
+    if (fr != FR_OK){
+        printf("###ERROR, could not write the image catalog (%d)\r\n", fr);
+        f_unlink(CATALOG_TEMPNAME);
+        return(fr);
+    }
+    printf("  %d images, %d unchanged, in %d msec\r\n", entries, reused, (int)((time_us_64() - start_time) / 1000));
+    return(FR_OK);
+}
+
+// find the image file for the drive address through the catalog and put its name in diskimagefilename
+// The catalog is rebuilt if it is missing or out of date. Returns false if there is no image or no usable catalog.
+static bool catalog_select_image(int driveaddress)
+{
+    uint8_t header[CATALOG_HEADER_SIZE];
+    uint8_t entry[CATALOG_ENTRY_SIZE];
+    FILINFO fno;
+
+    if ((driveaddress < 0) || (driveaddress >= CATALOG_SLOTS))
+        driveaddress = 0;
+    for (int attempt = 0; attempt < 2; attempt++){
+        if ((attempt > 0) && (catalog_rebuild() != FR_OK))
+            return(false);
+        if (f_open(&catfil, CATALOG_FILENAME, FA_READ) != FR_OK)
+            continue;
+        bool ok = catalog_read_header(&catfil, header) && (get_le32(&header[8]) == card_free_clusters());
+        int index = ok ? ((header[16 + (driveaddress * 2)] | (header[17 + (driveaddress * 2)] << 8)) - 1) : -1;
+        if (ok && (index < 0)){
+            // an up to date catalog with no images
+            f_close(&catfil);
+            return(false);
+        }
+        ok = ok && catalog_read_at(&catfil, catalog_entry_offset(index), entry, CATALOG_ENTRY_SIZE);
+        f_close(&catfil);
+        entry[CATALOG_NAME_LEN - 1] = '\0';
+        if (ok && (f_stat((char*)entry, &fno) == FR_OK) && catalog_entry_current(entry, &fno)){
+            strcpy(diskimagefilename, (char*)entry);
+            printf("  catalog entry %d for drive address %d, '%s'\r\n", index, driveaddress, diskimagefilename);
+            return(true);
+        }
+    }
+    return(false);
+}
+
+// bring the catalog entry of an image file the firmware has written up to date, and record the free cluster count
+// so the firmware's own writes don't make the catalog look out of date. imagename is NULL if no image was written.
+// Nothing is written to the card unless the entry or the free cluster count changed, so a read-only load costs
+// no card write.
+static void catalog_update(const char* imagename)
+{
+    uint8_t header[CATALOG_HEADER_SIZE];
+    uint8_t entry[CATALOG_ENTRY_SIZE];
+    FILINFO fno;
+
+    if (f_open(&catfil, CATALOG_FILENAME, FA_WRITE | FA_READ) != FR_OK)
+        return;
+    if (catalog_read_header(&catfil, header)){
+        bool ok = true;
+        if (imagename != NULL){
+            int index = catalog_find_name(&catfil, header, imagename, entry);
+            if ((index >= 0) && (f_stat(imagename, &fno) == FR_OK) && !catalog_entry_current(entry, &fno)){
+                catalog_entry_stat(entry, &fno);
+                ok = catalog_write_at(&catfil, catalog_entry_offset(index), entry, CATALOG_ENTRY_SIZE);
+            }
+        }
+        uint32_t freeclusters = card_free_clusters();
+        if (ok && (get_le32(&header[8]) != freeclusters)){
+            put_le32(&header[8], freeclusters);
+            catalog_write_at(&catfil, 0, header, CATALOG_HEADER_SIZE);
+        }
+    }
+    f_close(&catfil);
+}
+
+// print the block cache counters, then clear them if reset is set
+void card_cache_stats(bool reset)
+{
+    block_cache_stats_t stats;
+    block_cache_get_stats(&stats);
+    uint32_t reads = stats.hits + stats.prefetch_hits + stats.misses;
+    printf("  microSD block cache\r\n");
+    printf("    single block reads %lu, hits %lu, read-ahead hits %lu, misses %lu", (unsigned long)reads,
+        (unsigned long)stats.hits, (unsigned long)stats.prefetch_hits, (unsigned long)stats.misses);
+    if (reads > 0)
+        printf(", %.1f%% from the cache", 100.0f * (float)(stats.hits + stats.prefetch_hits) / (float)reads);
+    printf("\r\n");
+    printf("    read-ahead transfers %lu, %lu blocks\r\n", (unsigned long)stats.prefetches, (unsigned long)stats.prefetch_blocks);
+    printf("    multi-block reads %lu, writes %lu\r\n", (unsigned long)stats.direct, (unsigned long)stats.writes);
+    if (reset){
+        block_cache_reset_stats();
+        printf("  counters cleared\r\n");
+    }
+}
+
+// list the image files on the card, the catalog is always rebuilt first so it picks up renamed files
+void catalog_list()
+{
+    FRESULT fr;
+    uint8_t header[CATALOG_HEADER_SIZE];
+    uint8_t entry[CATALOG_ENTRY_SIZE];
+
+    if ((fr = mount_card()) != FR_OK){
+        printf("###ERROR, could not mount filesystem to list the images (%d)\r\n", fr);
+        return;
+    }
+    if ((catalog_rebuild() == FR_OK) && (f_open(&catfil, CATALOG_FILENAME, FA_READ) == FR_OK)){
+        if (catalog_read_header(&catfil, header)){
+            int entries = get_le32(&header[4]);
+            for (int i = 0; i < entries; i++){
+                if (!catalog_read_at(&catfil, catalog_entry_offset(i), entry, CATALOG_ENTRY_SIZE))
+                    break;
+                entry[CATALOG_NAME_LEN - 1] = '\0';
+                printf("  %-32s %-10s v%d.%d %4d/%d/%-2d %9d bytes\r\n", (char*)entry, (char*)&entry[64], entry[75] / 10, entry[75] % 10,
+                    entry[84] | (entry[85] << 8), entry[86], entry[87], (int)get_le32(&entry[76]));
+            }
+            for (int slot = 0; slot < CATALOG_SLOTS; slot++)
+                printf("  drive address %d loads entry %d\r\n", slot, (header[16 + (slot * 2)] | (header[17 + (slot * 2)] << 8)) - 1);
+        }
+        f_close(&catfil);
+    }
+    force_unmount();
+}
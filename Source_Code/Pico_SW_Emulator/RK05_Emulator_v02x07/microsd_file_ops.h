@@ -5,13 +5,32 @@
 // 
 //#include "disk_state_definitions.h"
 
-int file_open_read_disk_image();
-int file_open_write_disk_image();
+int file_open_read_disk_image(Disk_State* dstate);
+int file_open_write_disk_image(Disk_State* dstate);
+int file_open_update_disk_image();
 int file_close_disk_image();
 int read_image_file_header(Disk_State* dstate);
 int write_image_file_header(Disk_State* dstate);
 int read_disk_image_data(Disk_State* dstate);
 int write_disk_image_data(Disk_State* datate);
+int write_dirty_sectors(Disk_State* dstate);
+int journal_replay(Disk_State* dstate);
+int journal_start();
+int journal_save(Disk_State* dstate);
+void journal_stop();
+int file_remove_journal();
 int file_init_and_mount();
+void catalog_list();
+void card_cache_stats(bool reset);
+void card_telemetry(bool reset);
+void card_telemetry_log_start();
+struct Event_Record;
+void trace_start(Disk_State* dstate);
+void trace_record(const Event_Record* rec);
+void trace_service(Disk_State* dstate);
+void trace_stop();
+void trace_status();
 
 #define FILE_OPS_OKAY 0
+#define FILE_OPS_FULL_REWRITE 2
+#define FILE_OPS_CRC_ERROR 3
@@ -0,0 +1,220 @@
+// *********************************************************************************
+// sd_clock.cpp
+//   microSD SPI clock calibration
+//
+//   hw_config.c starts every card at SD_CLOCK_DEFAULT. The first time a card is
+//   mounted the candidate clocks are tried from the fastest down. At each clock a
+//   scratch file is written and read back by multi-block transfers, with the
+//   driver checking the CRC of every block and the data compared as well, and the
+//   fastest clock that passes every round is kept. It is saved in a small config
+//   file on the card so later loads only read the file. If a CRC error is seen
+//   while the card is in use the clock is lowered to the next candidate, and the
+//   config file is updated when the image file is closed.
+//
+//   The config file is plain text and can be edited or deleted to calibrate again:
+//     sd_clock_hz=<clock>
+// *********************************************************************************
+// 
+#include <stdio.h>
+#include <stdlib.h>
+#include "pico/stdlib.h"
+#include <string.h>
+
+#include "ff.h"
+#include "diskio.h"
+#include "sd_card.h"
+#include "hw_config.h"
+#include "block_cache.h"
+
+#include "sd_clock.h"
+
+#define SD_CONFIG_FILENAME "RK05SD.CFG"
+#define SD_SCRATCH_FILENAME "RK05SD.TMP"
+#define SD_CLOCK_DEFAULT (12500 * 1000)    // the clock in hw_config.c, always the last candidate
+#define SD_SCRATCH_BLOCKS 256             // 128 KB scratch file
+#define SD_BURST_BLOCKS 8                 // blocks per multi-block transfer
+#define SD_CALIBRATE_ROUNDS 4             // every round uses a different pattern
+#define SD_BLOCK_SIZE 512
+
+// the SPI clock is clk_peri divided by an even number, so 25 MHz gives 20.8 MHz and 15.625 MHz is exact
+static const uint sd_clock_candidates[] = { 25 * 1000 * 1000, 15625 * 1000, SD_CLOCK_DEFAULT };
+#define SD_CLOCK_CANDIDATES ((int)(sizeof(sd_clock_candidates) / sizeof(sd_clock_candidates[0])))
+
+static int sd_clock_index = SD_CLOCK_CANDIDATES - 1;   // candidate in use
+static volatile bool sd_clock_lowered = false;          // lowered after a CRC error, save it when the image file is closed
+static uint8_t sd_writebuf[SD_BURST_BLOCKS * SD_BLOCK_SIZE];
+static uint8_t sd_readbuf[SD_BURST_BLOCKS * SD_BLOCK_SIZE];
+
+static void sd_config_write();
+
+static void sd_clock_apply(int index)
+{
+    sd_card_t *pSD = sd_get_by_num(0);
+    sd_clock_index = index;
+    pSD->spi->baud_rate = sd_clock_candidates[index];
+    spi_set_baudrate(pSD->spi->hw_inst, pSD->spi->baud_rate);
+}
+
+// save the clock in the config file if a CRC error lowered it, the filesystem must still be mounted
+void sd_clock_save()
+{
+    if (!sd_clock_lowered)
+        return;
+    sd_clock_lowered = false;
+    sd_config_write();
+}
+
+// go back to the default clock, the card is initialized at the default when it is mounted again
+void sd_clock_reset()
+{
+    sd_card_t *pSD = sd_get_by_num(0);
+    sd_clock_index = SD_CLOCK_CANDIDATES - 1;
+    pSD->spi->baud_rate = SD_CLOCK_DEFAULT;
+}
+
+// called by the FatFs glue when a transfer fails its CRC check, and by the image block transfers after a CRC error or
+// a timeout, lower the clock and return true to retry the transfer
+extern "C" bool sd_clock_fallback(sd_card_t *pSD)
+{
+    if (sd_clock_index >= (SD_CLOCK_CANDIDATES - 1))
+        return(false);
+    sd_clock_apply(sd_clock_index + 1);
+    sd_clock_lowered = true;
+    printf("###ERROR, microSD transfer error, SPI clock lowered to %u Hz\r\n", sd_clock_candidates[sd_clock_index]);
+    return(true);
+}
+
+static void sd_fill_pattern(uint32_t seed)
+{
+    uint32_t x = seed | 1;
+    for (int i = 0; i < (int)sizeof(sd_writebuf); i++){
+        // xorshift, different in every block and every round
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        sd_writebuf[i] = x & 0xff;
+    }
+}
+
+// write and read back the scratch area at the current clock, returns false on any error, MB/s in *writembs and *readmbs
+static bool sd_clock_test(LBA_t lba, float* writembs, float* readmbs)
+{
+    sd_card_t *pSD = sd_get_by_num(0);
+    uint64_t write_us = 0;
+    uint64_t read_us = 0;
+
+    for (int round = 0; round < SD_CALIBRATE_ROUNDS; round++){
+        for (int block = 0; block < SD_SCRATCH_BLOCKS; block += SD_BURST_BLOCKS){
+            sd_fill_pattern((round << 16) ^ block ^ 0x5A5A1234);
+            uint64_t t0 = time_us_64();
+            if (pSD->write_blocks(pSD, sd_writebuf, lba + block, SD_BURST_BLOCKS) != SD_BLOCK_DEVICE_ERROR_NONE)
+                return(false);
+            uint64_t t1 = time_us_64();
+            if (pSD->read_blocks(pSD, sd_readbuf, lba + block, SD_BURST_BLOCKS) != SD_BLOCK_DEVICE_ERROR_NONE)
+                return(false);
+            read_us += time_us_64() - t1;
+            write_us += t1 - t0;
+            if (memcmp(sd_writebuf, sd_readbuf, sizeof(sd_writebuf)) != 0)
+                return(false);
+        }
+    }
+    float bytes = (float)SD_CALIBRATE_ROUNDS * SD_SCRATCH_BLOCKS * SD_BLOCK_SIZE;
+    *writembs = (write_us > 0) ? bytes / (float)write_us : 0.0f;
+    *readmbs = (read_us > 0) ? bytes / (float)read_us : 0.0f;
+    return(true);
+}
+
+// find the fastest reliable clock using a contiguous scratch file, leaves the card at that clock
+static void sd_clock_calibrate()
+{
+    static FIL scratch;
+    FRESULT fr;
+
+    printf("Calibrating the microSD SPI clock\r\n");
+    if ((fr = f_open(&scratch, SD_SCRATCH_FILENAME, FA_WRITE | FA_READ | FA_CREATE_ALWAYS)) != FR_OK){
+        printf("###ERROR, could not create the microSD scratch file (%d)\r\n", fr);
+        sd_clock_apply(SD_CLOCK_CANDIDATES - 1);
+        return;
+    }
+    if ((fr = f_expand(&scratch, (FSIZE_t)SD_SCRATCH_BLOCKS * SD_BLOCK_SIZE, 1)) != FR_OK){
+        printf("###ERROR, no contiguous space for the microSD scratch file (%d)\r\n", fr);
+        f_close(&scratch);
+        f_unlink(SD_SCRATCH_FILENAME);
+        sd_clock_apply(SD_CLOCK_CANDIDATES - 1);
+        return;
+    }
+    FATFS* fsp = scratch.obj.fs;
+    LBA_t lba = fsp->database + ((LBA_t)(scratch.obj.sclust - 2) * fsp->csize);
+
+    int index;
+    for (index = 0; index < (SD_CLOCK_CANDIDATES - 1); index++){
+        float writembs, readmbs;
+        sd_clock_apply(index);
+        if (sd_clock_test(lba, &writembs, &readmbs)){
+            printf("  %u Hz passed, write %.2f MB/s, read %.2f MB/s\r\n", sd_clock_candidates[index], writembs, readmbs);
+            break;
+        }
+        printf("  %u Hz failed\r\n", sd_clock_candidates[index]);
+    }
+    if (index == (SD_CLOCK_CANDIDATES - 1)){
+        // the default clock is used without a test, it is what every card was run at before calibration
+        sd_clock_apply(index);
+        printf("  using the default %u Hz\r\n", sd_clock_candidates[index]);
+    }
+    block_cache_invalidate_range(lba, SD_SCRATCH_BLOCKS); // written around FatFs
+    f_close(&scratch);
+    f_unlink(SD_SCRATCH_FILENAME);
+}
+
+static void sd_config_write()
+{
+    static FIL config;
+    char line[40];
+    UINT nw;
+
+    if (f_open(&config, SD_CONFIG_FILENAME, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK){
+        printf("###ERROR, could not write the microSD config file\r\n");
+        return;
+    }
+    int len = sprintf(line, "sd_clock_hz=%u\r\n", sd_clock_candidates[sd_clock_index]);
+    f_write(&config, line, len, &nw);
+    f_close(&config);
+}
+
+// returns the candidate index saved in the config file, or -1 if there is no valid config file
+static int sd_config_read()
+{
+    static FIL config;
+    char line[40];
+    UINT nr;
+
+    if (f_open(&config, SD_CONFIG_FILENAME, FA_READ) != FR_OK)
+        return(-1);
+    FRESULT fr = f_read(&config, line, sizeof(line) - 1, &nr);
+    f_close(&config);
+    if (fr != FR_OK)
+        return(-1);
+    line[nr] = '\0';
+    if (strncmp(line, "sd_clock_hz=", 12) != 0)
+        return(-1);
+    uint clock = (uint)strtoul(&line[12], NULL, 10);
+    for (int index = 0; index < SD_CLOCK_CANDIDATES; index++){
+        if (sd_clock_candidates[index] == clock)
+            return(index);
+    }
+    return(-1);
+}
+
+// set the SPI clock for the card that was just mounted, calibrating it if it has no config file
+void sd_clock_setup()
+{
+    sd_clock_lowered = false;
+    int index = sd_config_read();
+    if (index < 0){
+        sd_clock_calibrate();
+        sd_config_write();
+    }
+    else
+        sd_clock_apply(index);
+    printf("  microSD SPI clock %u Hz\r\n", sd_clock_candidates[sd_clock_index]);
+}
@@ -0,0 +1,10 @@
+// *********************************************************************************
+// sd_clock.h
+//   header for the microSD SPI clock calibration
+// *********************************************************************************
+// 
+
+void sd_clock_setup();
+void sd_clock_save();
+void sd_clock_reset();
+extern "C" bool sd_clock_fallback(sd_card_t *pSD);
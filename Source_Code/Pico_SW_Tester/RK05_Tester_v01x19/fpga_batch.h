@@ -0,0 +1,28 @@
+// *********************************************************************************
+// fpga_batch.h
+//   header for batched FPGA register transactions
+// *********************************************************************************
+// 
+
+#define FPGA_BATCH_MAX_FRAMES 32 // register accesses in one batch
+
+typedef void (*fpga_batch_callback_t)(void* context);
+
+// a list of register accesses sent to the FPGA as one burst, set up with fpga_batch_init()
+struct Fpga_Batch {
+    uint16_t txframes[FPGA_BATCH_MAX_FRAMES];   // [register][data] for each access
+    uint16_t rxframes[FPGA_BATCH_MAX_FRAMES];   // the read data is in the low byte
+    uint8_t* readdest[FPGA_BATCH_MAX_FRAMES];   // where each read byte goes, NULL for a write
+    int count;
+    volatile bool busy;
+    fpga_batch_callback_t callback;
+    void* context;
+};
+
+void fpga_batch_init(Fpga_Batch* batch);
+bool fpga_batch_write(Fpga_Batch* batch, uint8_t reg, uint8_t data);
+bool fpga_batch_read(Fpga_Batch* batch, uint8_t reg, uint8_t* dest);
+void fpga_batch_start(Fpga_Batch* batch, fpga_batch_callback_t callback, void* context);
+bool fpga_batch_poll(Fpga_Batch* batch);
+void fpga_batch_wait(Fpga_Batch* batch);
+void fpga_batch_run(Fpga_Batch* batch);
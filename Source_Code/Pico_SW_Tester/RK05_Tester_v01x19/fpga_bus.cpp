@@ -0,0 +1,347 @@
+// *********************************************************************************
+// fpga_bus.cpp
+//   the CPU to FPGA register link, shared by the emulator and the tester
+//
+//   Every FPGA register access is a 16-bit [register][data] frame, SPI mode 0, and
+//   the FPGA latches the access on the rising edge of CS. The byte read back comes in
+//   the second half of the frame.
+//
+//   With FPGA_BUS_PIO set to 1 the link is run by a PIO state machine using the
+//   programs in fpga_bus.pio. The state machine does the CS framing itself, so a
+//   register access is one word into the TX FIFO and one word out of the RX FIFO, and
+//   the DMA frame transfers need no change of SPI format. For the DRAM there are two
+//   stream programs. The write stream sends each byte from the TX FIFO as a write to
+//   the DRAM data register, so a sector is stored with an 8-bit DMA straight from the
+//   sector buffer. The read stream sends the read and function ID register frames from
+//   a fixed pattern and pushes only the DRAM bytes, so a sector is read with an 8-bit
+//   DMA straight into the sector buffer. The FPGA advances the DRAM address after each
+//   access as before, so the FPGA needs no change.
+//   The state machine is switched between the programs only when it is waiting for
+//   the next frame. The caller must keep everything else off the link while a stream
+//   is running, as with the DMA frame transfers.
+//
+//   With FPGA_BUS_PIO set to 0 the link is run by the SPI port with software CS.
+// *********************************************************************************
+//
+#include <stdio.h>
+#include "pico/stdlib.h"
+#include "pico/binary_info.h"
+#include "hardware/spi.h"
+#include "hardware/dma.h"
+#include "hardware/sync.h"
+
+#include "fpga_bus.h"
+
+// spi_init() is asked for 25 MHz, but the SPI port divides the 125 MHz peripheral clock by an even prescale times an
+// integer, so the link has always really run at 125 MHz / 6 = 20.8 MHz. The PIO link keeps that rate.
+#define FPGA_BUS_BAUD (25 * 1000 * 1000)
+#define FPGA_BUS_PIO_BAUD (125 * 1000 * 1000 / 6)
+
+#if FPGA_BUS_PIO
+#include "hardware/pio.h"
+#include "hardware/clocks.h"
+#include "fpga_bus.pio.h"
+
+// FPGA registers used by the DRAM streams, the same as SPI_DRAM_DATA_6, SPI_DRAMREAD_88 and SPI_FUNCT_ID_89
+#define FPGA_DRAM_DATA_REG 0x06
+#define FPGA_DRAMREAD_REG 0x88
+#define FPGA_FUNCT_ID_REG 0x89
+
+#define BUS_CYCLES_PER_BIT 6
+#define BUS_SIDESET_CS_HIGH 0b01
+
+#define BUS_MODE_FRAME 0
+#define BUS_MODE_DRAM_WRITE 1
+#define BUS_MODE_DRAM_READ 2
+
+#define READ_STREAM_BLOCK_LEN 512 // bytes per DMA block, must be even
+#define READ_STREAM_PATTERN_LEN ((READ_STREAM_BLOCK_LEN * 3) / 2) // 3 frames for every 2 bytes
+
+static_assert(PICO_DEFAULT_SPI_SCK_PIN == PICO_DEFAULT_SPI_CSN_PIN + 1, "the side-set pins must be CS_n then SCK");
+
+static PIO bus_pio = pio0;
+static uint bus_sm;
+static uint bus_offset[3];
+static pio_sm_config bus_config[3];
+static int bus_mode;
+static int stream_tx_dma = -1;
+static int stream_rx_dma = -1;
+static uint8_t readpattern[READ_STREAM_PATTERN_LEN];
+
+// run one instruction on the state machine with CS high and SCK low
+static void bus_exec(uint instr)
+{
+    pio_sm_exec(bus_pio, bus_sm, instr | pio_encode_sideset(2, BUS_SIDESET_CS_HIGH));
+}
+
+// wait for the state machine to finish the last frame, every program starts with a pull and stalls there with CS high
+static void bus_wait_idle()
+{
+    uint32_t stallmask = 1u << (PIO_FDEBUG_TXSTALL_LSB + bus_sm);
+    bus_pio->fdebug = stallmask;
+    while ((bus_pio->fdebug & stallmask) == 0)
+        tight_loop_contents();
+}
+
+static void bus_set_mode(int mode)
+{
+    if (mode == bus_mode)
+        return;
+    bus_wait_idle();
+    pio_sm_set_enabled(bus_pio, bus_sm, false);
+    pio_sm_clear_fifos(bus_pio, bus_sm);
+    pio_sm_set_config(bus_pio, bus_sm, &bus_config[mode]);
+    bus_exec(pio_encode_mov(pio_isr, pio_null));
+    if (mode == BUS_MODE_DRAM_WRITE){
+        // the write stream keeps the register number in Y
+        pio_sm_put(bus_pio, bus_sm, (uint32_t)FPGA_DRAM_DATA_REG << 24);
+        bus_exec(pio_encode_pull(false, true));
+        bus_exec(pio_encode_mov(pio_y, pio_osr));
+    }
+    bus_exec(pio_encode_jmp(bus_offset[mode]));
+    pio_sm_set_enabled(bus_pio, bus_sm, true);
+    bus_mode = mode;
+}
+
+static pio_sm_config bus_program_config(int mode, pio_sm_config c)
+{
+    sm_config_set_sideset_pins(&c, PICO_DEFAULT_SPI_CSN_PIN);
+    sm_config_set_out_pins(&c, PICO_DEFAULT_SPI_TX_PIN, 1);
+    sm_config_set_set_pins(&c, PICO_DEFAULT_SPI_TX_PIN, 1);
+    sm_config_set_in_pins(&c, PICO_DEFAULT_SPI_RX_PIN);
+    sm_config_set_out_shift(&c, false, false, 32);
+    // only the frame program uses autopush, the read stream pushes the bytes it keeps
+    sm_config_set_in_shift(&c, false, (mode == BUS_MODE_FRAME), 16);
+    sm_config_set_clkdiv(&c, (float)clock_get_hz(clk_sys) / (float)(BUS_CYCLES_PER_BIT * FPGA_BUS_PIO_BAUD));
+    return(c);
+}
+
+void fpga_bus_init()
+{
+    uint32_t outpins = (1u << PICO_DEFAULT_SPI_CSN_PIN) | (1u << PICO_DEFAULT_SPI_SCK_PIN) | (1u << PICO_DEFAULT_SPI_TX_PIN);
+
+    bus_sm = pio_claim_unused_sm(bus_pio, true);
+    bus_offset[BUS_MODE_FRAME] = pio_add_program(bus_pio, &fpga_frame_program);
+    bus_offset[BUS_MODE_DRAM_WRITE] = pio_add_program(bus_pio, &fpga_dram_write_program);
+    bus_offset[BUS_MODE_DRAM_READ] = pio_add_program(bus_pio, &fpga_dram_read_program);
+    bus_config[BUS_MODE_FRAME] = bus_program_config(BUS_MODE_FRAME, fpga_frame_program_get_default_config(bus_offset[BUS_MODE_FRAME]));
+    bus_config[BUS_MODE_DRAM_WRITE] = bus_program_config(BUS_MODE_DRAM_WRITE, fpga_dram_write_program_get_default_config(bus_offset[BUS_MODE_DRAM_WRITE]));
+    bus_config[BUS_MODE_DRAM_READ] = bus_program_config(BUS_MODE_DRAM_READ, fpga_dram_read_program_get_default_config(bus_offset[BUS_MODE_DRAM_READ]));
+    pio_sm_init(bus_pio, bus_sm, bus_offset[BUS_MODE_FRAME], &bus_config[BUS_MODE_FRAME]);
+    bus_mode = BUS_MODE_FRAME;
+
+    // CS is active-low, drive it high before the pins are handed to the PIO
+    pio_sm_set_pins_with_mask(bus_pio, bus_sm, 1u << PICO_DEFAULT_SPI_CSN_PIN, outpins);
+    pio_sm_set_pindirs_with_mask(bus_pio, bus_sm, outpins, outpins | (1u << PICO_DEFAULT_SPI_RX_PIN));
+    pio_gpio_init(bus_pio, PICO_DEFAULT_SPI_CSN_PIN);
+    pio_gpio_init(bus_pio, PICO_DEFAULT_SPI_SCK_PIN);
+    pio_gpio_init(bus_pio, PICO_DEFAULT_SPI_TX_PIN);
+    pio_gpio_init(bus_pio, PICO_DEFAULT_SPI_RX_PIN);
+    // The FPGA changes MISO on the falling edge of SCK. Without the 2-cycle input synchronizer the IN instruction
+    // samples it as SCK rises, 3 cycles (24 ns at 125 MHz) after the falling edge, like the SPI peripheral did.
+    // With the synchronizer the sample would be taken 8-16 ns after the falling edge, which leaves almost no margin
+    // for the FPGA clock-to-out and pad delays. SCK is driven by the same state machine, so the bypass is safe.
+    hw_set_bits(&bus_pio->input_sync_bypass, 1u << PICO_DEFAULT_SPI_RX_PIN);
+    pio_sm_set_enabled(bus_pio, bus_sm, true);
+
+    // Make the FPGA link pins available to picotool
+    bi_decl(bi_4pins_with_names(PICO_DEFAULT_SPI_RX_PIN, "FPGA MISO", PICO_DEFAULT_SPI_CSN_PIN, "FPGA CS",
+        PICO_DEFAULT_SPI_SCK_PIN, "FPGA SCK", PICO_DEFAULT_SPI_TX_PIN, "FPGA MOSI"));
+
+    for (int i = 0; i < READ_STREAM_PATTERN_LEN; i++)
+        readpattern[i] = ((i % 3) == 2) ? FPGA_FUNCT_ID_REG : FPGA_DRAMREAD_REG;
+    stream_tx_dma = dma_claim_unused_channel(true);
+    stream_rx_dma = dma_claim_unused_channel(true);
+}
+
+// one register access, returns the byte read back
+uint8_t fpga_bus_transfer(uint8_t reg, uint8_t data)
+{
+    bus_set_mode(BUS_MODE_FRAME);
+    pio_sm_put_blocking(bus_pio, bus_sm, ((uint32_t)reg << 24) | ((uint32_t)data << 16));
+    return(pio_sm_get_blocking(bus_pio, bus_sm) & 0xff);
+}
+
+void fpga_bus_frames_begin()
+{
+    bus_set_mode(BUS_MODE_FRAME);
+}
+
+void fpga_bus_frames_end()
+{
+}
+
+// a 16-bit DMA write is copied to both halves of the FIFO word, so the frame lands in bits 31:16
+volatile void* fpga_bus_tx_fifo()
+{
+    return(&bus_pio->txf[bus_sm]);
+}
+
+volatile void* fpga_bus_rx_fifo()
+{
+    return(&bus_pio->rxf[bus_sm]);
+}
+
+uint fpga_bus_tx_dreq()
+{
+    return(pio_get_dreq(bus_pio, bus_sm, true));
+}
+
+uint fpga_bus_rx_dreq()
+{
+    return(pio_get_dreq(bus_pio, bus_sm, false));
+}
+
+static void stream_write_start(const uint8_t* bp, int count, bool fill)
+{
+    bus_set_mode(BUS_MODE_DRAM_WRITE);
+    dma_channel_wait_for_finish_blocking(stream_tx_dma);
+    dma_channel_config c = dma_channel_get_default_config(stream_tx_dma);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+    channel_config_set_read_increment(&c, true);
+    channel_config_set_write_increment(&c, false);
+    if (fill)
+        channel_config_set_ring(&c, false, 1); // read the two fill bytes over and over
+    channel_config_set_dreq(&c, fpga_bus_tx_dreq());
+    dma_channel_configure(stream_tx_dma, &c, fpga_bus_tx_fifo(), bp, count, true);
+}
+
+// start storing count bytes into the DRAM at the current address and return immediately
+// the buffer must not be touched until fpga_bus_dram_wait() returns
+void fpga_bus_dram_write_start(const uint8_t* bp, int count)
+{
+    stream_write_start(bp, count, false);
+}
+
+// start storing count bytes of a 16-bit fill word into the DRAM and return immediately
+// fillbytes holds the low byte and then the high byte and must be 2-byte aligned
+void fpga_bus_dram_fill_start(const uint8_t* fillbytes, int count)
+{
+    stream_write_start(fillbytes, count, true);
+}
+
+// wait for the last write stream to be off the wire
+void fpga_bus_dram_wait()
+{
+    if (stream_tx_dma < 0)
+        return;
+    dma_channel_wait_for_finish_blocking(stream_tx_dma);
+    bus_wait_idle();
+}
+
+// read count bytes from the DRAM starting at the current address, which must be on a low byte
+void fpga_bus_dram_read(uint8_t* bp, int count)
+{
+    bus_set_mode(BUS_MODE_DRAM_READ);
+    dma_channel_config txcfg = dma_channel_get_default_config(stream_tx_dma);
+    channel_config_set_transfer_data_size(&txcfg, DMA_SIZE_8);
+    channel_config_set_read_increment(&txcfg, true);
+    channel_config_set_write_increment(&txcfg, false);
+    channel_config_set_dreq(&txcfg, fpga_bus_tx_dreq());
+    dma_channel_config rxcfg = dma_channel_get_default_config(stream_rx_dma);
+    channel_config_set_transfer_data_size(&rxcfg, DMA_SIZE_8);
+    channel_config_set_read_increment(&rxcfg, false);
+    channel_config_set_write_increment(&rxcfg, true);
+    channel_config_set_dreq(&rxcfg, fpga_bus_rx_dreq());
+    while (count > 0){
+        // the block size is always even except possibly the last one, so every block starts on a low byte
+        int n = (count > READ_STREAM_BLOCK_LEN) ? READ_STREAM_BLOCK_LEN : count;
+        dma_channel_configure(stream_rx_dma, &rxcfg, bp, fpga_bus_rx_fifo(), n, false);
+        dma_channel_configure(stream_tx_dma, &txcfg, fpga_bus_tx_fifo(), readpattern, n + (n / 2), false);
+        dma_start_channel_mask((1u << stream_tx_dma) | (1u << stream_rx_dma));
+        // the TX channel may still be sending the last function ID frame
+        dma_channel_wait_for_finish_blocking(stream_rx_dma);
+        dma_channel_wait_for_finish_blocking(stream_tx_dma);
+        bp += n;
+        count -= n;
+    }
+}
+
+#else
+
+static inline void cs_select()
+{
+    asm volatile("nop \n nop \n nop");
+    gpio_put(PICO_DEFAULT_SPI_CSN_PIN, 0);  // Active low
+    asm volatile("nop \n nop \n nop");
+}
+
+static inline void cs_deselect()
+{
+    asm volatile("nop \n nop \n nop");
+    gpio_put(PICO_DEFAULT_SPI_CSN_PIN, 1);
+    asm volatile("nop \n nop \n nop");
+}
+
+void fpga_bus_init()
+{
+    // initialize SPI, asking for 25 MHz gives 20.8 MHz
+    spi_init(spi_default, FPGA_BUS_BAUD);
+    gpio_set_function(PICO_DEFAULT_SPI_SCK_PIN, GPIO_FUNC_SPI);
+    gpio_set_function(PICO_DEFAULT_SPI_TX_PIN, GPIO_FUNC_SPI);
+    gpio_set_function(PICO_DEFAULT_SPI_RX_PIN, GPIO_FUNC_SPI);
+    // SPI configuration needs to be CPHA = 0, CPOL = 0
+    // resting state of the CPI clock is low, data is captured in the RPi Pico and in the FPGA on rising edge
+    // so data needs to change on the falling edge and be set up half a clock prior to the first clock rising edge
+
+    // Make the SPI pins available to picotool
+    bi_decl(bi_2pins_with_func(PICO_DEFAULT_SPI_TX_PIN, PICO_DEFAULT_SPI_SCK_PIN, GPIO_FUNC_SPI));
+
+    // Chip select is active-low, so we'll initialise it to a driven-high state
+    gpio_init(PICO_DEFAULT_SPI_CSN_PIN);
+    gpio_set_dir(PICO_DEFAULT_SPI_CSN_PIN, GPIO_OUT);
+    gpio_put(PICO_DEFAULT_SPI_CSN_PIN, 1);
+
+    // Make the CS pin available to picotool
+    bi_decl(bi_1pin_with_name(PICO_DEFAULT_SPI_CSN_PIN, "SPI CS"));
+}
+
+// one register access, returns the byte read back
+uint8_t fpga_bus_transfer(uint8_t reg, uint8_t data)
+{
+    uint8_t out_buf[2], in_buf[2];
+    out_buf[0] = reg;
+    out_buf[1] = data;
+    cs_select();
+    spi_write_read_blocking(spi_default, out_buf, in_buf, 2);
+    cs_deselect();
+    return(in_buf[1]);
+}
+
+// The FPGA latches every access on the rising edge of CS, so CS cannot simply be held low across a block
+// transfer. Instead the SPI port is switched to 16-bit frames and CS is handed to the SPI hardware. In
+// Motorola mode 0 the SPI hardware pulses CS high between frames, so each frame is one complete access.
+void fpga_bus_frames_begin()
+{
+    spi_set_format(spi_default, 16, SPI_CPOL_0, SPI_CPHA_0, SPI_MSB_FIRST);
+    gpio_set_function(PICO_DEFAULT_SPI_CSN_PIN, GPIO_FUNC_SPI);
+}
+
+void fpga_bus_frames_end()
+{
+    // give CS back to software control, it is still driven high from fpga_bus_init()
+    gpio_set_function(PICO_DEFAULT_SPI_CSN_PIN, GPIO_FUNC_SIO);
+    spi_set_format(spi_default, 8, SPI_CPOL_0, SPI_CPHA_0, SPI_MSB_FIRST);
+}
+
+volatile void* fpga_bus_tx_fifo()
+{
+    return(&spi_get_hw(spi_default)->dr);
+}
+
+volatile void* fpga_bus_rx_fifo()
+{
+    return(&spi_get_hw(spi_default)->dr);
+}
+
+uint fpga_bus_tx_dreq()
+{
+    return(spi_get_dreq(spi_default, true));
+}
+
+uint fpga_bus_rx_dreq()
+{
+    return(spi_get_dreq(spi_default, false));
+}
+
+#endif
@@ -105,10 +105,11 @@ specific language governing permissions and limitations under the License.
  * just always use the Standard Capacity cards with a block size of 512 bytes.
  * This is set with CMD16.
  *
- * You can read and write single blocks (CMD17, CMD25) or multiple blocks
- * (CMD18, CMD25). For simplicity, I'll just use single block accesses. When
- * the card gets a read command, it responds with a response token, and then
- * a data token or an error.
+ * You can read and write single blocks (CMD17, CMD24) or multiple blocks
+ * (CMD18, CMD25). A request for more than one block always uses the multiple
+ * block commands, see "Block transfers" below. When the card gets a read
+ * command, it responds with a response token, and then a data token or an
+ * error.
  *
  * SPI Command Format
  * ------------------
@@ -164,6 +165,7 @@ specific language governing permissions and limitations under the License.
 #include <string.h>
 //
 #include "pico/mutex.h"
+#include "hardware/sync.h"
 //
 #include "hw_config.h"  // Hardware Configuration of the SPI and SD Card "objects"
 #include "my_debug.h"
@@ -808,50 +810,155 @@ static int sd_read_bytes(sd_card_t *pSD, uint8_t *buffer, uint32_t length) {
 
     return 0;
 }
-static int sd_read_block(sd_card_t *pSD, uint8_t *buffer, uint32_t length) {
-    uint16_t crc;
+/* Block transfers
+ *
+ * Reads and writes of any number of blocks run as one CMD17/CMD18 or
+ * CMD24/CMD25 command and every 512-byte data block is moved by DMA. The
+ * transfer is driven by a small state machine that is advanced from the DMA
+ * interrupt at the end of each block and by sd_async_poll(), so it can run in
+ * the background while the caller does other work. The CRC16 of a block is
+ * computed while the DMA for the next block is running.
+ *
+ * Only the short gaps between blocks are done by the interrupt: the two CRC
+ * bytes and, for a write, the data response token. When the card isn't ready
+ * for the next block within a few bytes (the read start token hasn't arrived
+ * or the card is still busy programming the last block) the interrupt leaves
+ * it to the next sd_async_poll() call. The command at the start and the stop
+ * at the end are sent from sd_*_blocks_async() and sd_async_poll().
+ *
+ * Only one background transfer can run at a time and the card stays locked
+ * until it has finished, so sd_async_wait() (or sd_async_poll() returning
+ * true) must come before any other access to the card.
+ */
+#define SD_ASYNC_READY_POLL 16     /*!< bytes read looking for the start token or the end of busy before giving up until the next poll */
+#define SD_ASYNC_DMA_TIMEOUT 1000  /*!< Timeout in ms for one data block */
 
-    // read until start byte (0xFE)
-    if (false == sd_wait_token(pSD, SPI_START_BLOCK)) {
-        DBG_PRINTF("%s:%d Read timeout\r\n", __FILE__, __LINE__);
-        return SD_BLOCK_DEVICE_ERROR_NO_RESPONSE;
+typedef enum {
+    SD_ASYNC_IDLE,  /*!< no transfer */
+    SD_ASYNC_READY, /*!< waiting for the card to be ready for the next block */
+    SD_ASYNC_DATA,  /*!< DMA of a data block running */
+    SD_ASYNC_END    /*!< all blocks done or an error, waiting for sd_async_poll() to finish */
+} sd_async_state_t;
+
+static struct {
+    sd_card_t *pSD;
+    volatile sd_async_state_t state;
+    bool write;
+    uint8_t *buffer;
+    uint32_t count;           // number of blocks
+    uint32_t block;           // block being transferred
+    uint16_t crc;             // CRC16 of the block being written
+    int status;
+    absolute_time_t timeout;
+    sd_async_callback_t callback;
+    void *context;
+} sd_async;
+
+static void sd_async_set_error(int status) {
+    if (SD_BLOCK_DEVICE_ERROR_NONE == sd_async.status) sd_async.status = status;
+}
+
+// Start the data phase of the next block if the card is ready for it.
+// Called with the DMA interrupt unable to run, from the interrupt itself or with interrupts disabled.
+static void sd_async_step() {
+    sd_card_t *pSD = sd_async.pSD;
+    for (int i = 0; i < SD_ASYNC_READY_POLL; i++) {
+        uint8_t response = sd_spi_write(pSD, SPI_FILL_CHAR);
+        if (!sd_async.write) {
+            if (SPI_START_BLOCK == response) {
+                sd_async.state = SD_ASYNC_DATA;
+                sd_async.timeout = make_timeout_time_ms(SD_ASYNC_DMA_TIMEOUT);
+                spi_transfer_start(pSD->spi, NULL, sd_async.buffer + sd_async.block * _block_size, _block_size);
+                return;
+            }
+            if (SPI_FILL_CHAR != response) {
+                // data error token
+                sd_async_set_error(SD_BLOCK_DEVICE_ERROR_NO_RESPONSE);
+                sd_async.state = SD_ASYNC_END;
+                return;
+            }
+        } else if (0x00 != response) {
+            // not busy
+            if (sd_async.block == sd_async.count) {
+                sd_async.state = SD_ASYNC_END;
+                return;
+            }
+            const uint8_t *data = sd_async.buffer + sd_async.block * _block_size;
+            sd_spi_write(pSD, (sd_async.count > 1) ? SPI_START_BLK_MUL_WRITE : SPI_START_BLOCK);
+            sd_async.state = SD_ASYNC_DATA;
+            sd_async.timeout = make_timeout_time_ms(SD_ASYNC_DMA_TIMEOUT);
+            spi_transfer_start(pSD->spi, data, NULL, _block_size);
+            // the interrupt can't run until this returns, so the CRC is ready before it is needed
+            sd_async.crc = (uint16_t)~0;
+#if SD_CRC_ENABLED
+            if (crc_on) sd_async.crc = crc16((void *)data, _block_size);
+#endif
+            return;
+        }
     }
-    // read data
-    // bool spi_transfer(const uint8_t *tx, uint8_t *rx, size_t length)
-    if (!sd_spi_transfer(pSD, NULL, buffer, length)) {
-        return SD_BLOCK_DEVICE_ERROR_NO_RESPONSE;
+    if (time_reached(sd_async.timeout)) {
+        sd_async_set_error(SD_BLOCK_DEVICE_ERROR_NO_RESPONSE);
+        sd_async.state = SD_ASYNC_END;
     }
-    // Read the CRC16 checksum for the data block
-    crc = (sd_spi_write(pSD, SPI_FILL_CHAR) << 8);
-    crc |= sd_spi_write(pSD, SPI_FILL_CHAR);
+}
 
+// DMA interrupt at the end of a data block, errors are only recorded here and printed by sd_async_finish()
+static void sd_async_dma_done(void *context) {
+    sd_card_t *pSD = (sd_card_t *)context;
+    if (SD_ASYNC_DATA != sd_async.state) return;
+    uint32_t block = sd_async.block;
+    if (!sd_async.write) {
+        sd_async.block = block + 1;
+        // Read the CRC16 checksum for the data block
+        uint16_t crc = (sd_spi_write(pSD, SPI_FILL_CHAR) << 8);
+        crc |= sd_spi_write(pSD, SPI_FILL_CHAR);
+        if (sd_async.block < sd_async.count) {
+            sd_async.state = SD_ASYNC_READY;
+            sd_async.timeout = make_timeout_time_ms(SD_COMMAND_TIMEOUT);
+            sd_async_step();
+        } else {
+            sd_async.state = SD_ASYNC_END;
+        }
 #if SD_CRC_ENABLED
-    if (crc_on) {
-        uint32_t crc_result;
-        // Compute and verify checksum
-        crc_result = crc16((void *)buffer, length);
-        if ((uint16_t)crc_result != crc) {
-            DBG_PRINTF("%s: Invalid CRC received 0x%" PRIx16
-                       " result of computation 0x%" PRIx16 "\r\n",
-                       __FUNCTION__, crc, (uint16_t)crc_result);
-            return SD_BLOCK_DEVICE_ERROR_CRC;
+        // checked while the next block is on its way
+        if (crc_on) {
+            uint16_t crc_result = crc16((void *)(sd_async.buffer + block * _block_size), _block_size);
+            if (crc_result != crc) {
+                sd_async_set_error(SD_BLOCK_DEVICE_ERROR_CRC);
+            }
         }
-    }
+#else
+        (void)block;
 #endif
-
-    return SD_BLOCK_DEVICE_ERROR_NONE;
+    } else {
+        // write the checksum CRC16 and check the response token
+        sd_spi_write(pSD, sd_async.crc >> 8);
+        sd_spi_write(pSD, sd_async.crc);
+        uint8_t response = sd_spi_write(pSD, SPI_FILL_CHAR) & SPI_DATA_RESPONSE_MASK;
+        // Only CRC and general write error are communicated via response token
+        if (response != SPI_DATA_ACCEPTED) {
+            sd_async_set_error((response == SPI_DATA_CRC_ERROR) ? SD_BLOCK_DEVICE_ERROR_CRC : SD_BLOCK_DEVICE_ERROR_WRITE);
+            sd_async.state = SD_ASYNC_END;
+            return;
+        }
+        // wait for the card to program the block, the last one too
+        sd_async.block = block + 1;
+        sd_async.state = SD_ASYNC_READY;
+        sd_async.timeout = make_timeout_time_ms(SD_COMMAND_TIMEOUT);
+        sd_async_step();
+    }
 }
 
-static int in_sd_read_blocks(sd_card_t *pSD, uint8_t *buffer,
-                             uint64_t ulSectorNumber, uint32_t ulSectorCount) {
-    uint32_t blockCnt = ulSectorCount;
-
-    if (ulSectorNumber + blockCnt > pSD->sectors)
+// Lock the card and send the command, the data phase is left to sd_async_step()
+static int sd_async_start(sd_card_t *pSD, bool write, uint8_t *buffer, uint64_t ulSectorNumber,
+                          uint32_t blockCnt, sd_async_callback_t callback, void *context) {
+    if (0 == blockCnt || ulSectorNumber + blockCnt > pSD->sectors)
         return SD_BLOCK_DEVICE_ERROR_PARAMETER;
     if (pSD->m_Status & (STA_NOINIT | STA_NODISK))
         return SD_BLOCK_DEVICE_ERROR_PARAMETER;
+    myASSERT(SD_ASYNC_IDLE == sd_async.state);
 
-    int status = SD_BLOCK_DEVICE_ERROR_NONE;
+    sd_acquire(pSD);
 
     uint64_t addr;
     // SDSC Card (CCS=0) uses byte unit address
@@ -861,73 +968,140 @@ static int in_sd_read_blocks(sd_card_t *pSD, uint8_t *buffer,
     } else {
         addr = ulSectorNumber * _block_size;
     }
-    // Write command ro receive data
-    if (blockCnt > 1) {
-        status = sd_cmd(pSD, CMD18_READ_MULTIPLE_BLOCK, addr, false, 0);
+    int status;
+    if (!write) {
+        status = sd_cmd(pSD, (blockCnt > 1) ? CMD18_READ_MULTIPLE_BLOCK : CMD17_READ_SINGLE_BLOCK, addr, false, 0);
+    } else if (blockCnt == 1) {
+        status = sd_cmd(pSD, CMD24_WRITE_BLOCK, addr, false, 0);
     } else {
-        status = sd_cmd(pSD, CMD17_READ_SINGLE_BLOCK, addr, false, 0);
+        // Pre-erase setting prior to multiple block write operation
+        sd_cmd(pSD, ACMD23_SET_WR_BLK_ERASE_COUNT, blockCnt, 1, 0);
+
+        // Some SD cards want to be deselected between every bus transaction:
+        sd_spi_deselect_pulse(pSD);
+
+        status = sd_cmd(pSD, CMD25_WRITE_MULTIPLE_BLOCK, addr, false, 0);
     }
     if (SD_BLOCK_DEVICE_ERROR_NONE != status) {
+        sd_release(pSD);
         return status;
     }
-    // receive the data : one block at a time
-    int rd_status = 0;
-    while (blockCnt) {
-        if (0 != sd_read_block(pSD, buffer, _block_size)) {
-            rd_status = SD_BLOCK_DEVICE_ERROR_NO_RESPONSE;
-            break;
+    sd_async.pSD = pSD;
+    sd_async.write = write;
+    sd_async.buffer = buffer;
+    sd_async.count = blockCnt;
+    sd_async.block = 0;
+    sd_async.status = SD_BLOCK_DEVICE_ERROR_NONE;
+    sd_async.callback = callback;
+    sd_async.context = context;
+    sd_async.timeout = make_timeout_time_ms(SD_COMMAND_TIMEOUT);
+    pSD->spi->dma_done_context = pSD;
+    pSD->spi->dma_done = sd_async_dma_done;
+
+    uint32_t save = save_and_disable_interrupts();
+    sd_async.state = SD_ASYNC_READY;
+    sd_async_step();
+    restore_interrupts(save);
+    return SD_BLOCK_DEVICE_ERROR_NONE;
+}
+
+// Send the stop, unlock the card and call the completion callback
+static void sd_async_finish() {
+    sd_card_t *pSD = sd_async.pSD;
+    pSD->spi->dma_done = NULL;
+    if (!sd_async.write) {
+        // Send CMD12(0x00000000) to stop the transmission for multi-block transfer
+        if (sd_async.count > 1) {
+            sd_async_set_error(sd_cmd(pSD, CMD12_STOP_TRANSMISSION, 0x0, false, 0));
+        }
+    } else {
+        /* In a Multiple Block write operation, the stop transmission will be
+         * done by sending 'Stop Tran' token instead of 'Start Block' token at
+         * the beginning of the next block
+         */
+        if (sd_async.count > 1) {
+            sd_spi_write(pSD, SPI_STOP_TRAN);
         }
-        buffer += _block_size;
-        --blockCnt;
+        uint32_t stat = 0;
+        // Some SD cards want to be deselected between every bus transaction:
+        sd_spi_deselect_pulse(pSD);
+        // keep a data response error, the card status doesn't show a CRC error in the data
+        sd_async_set_error(sd_cmd(pSD, CMD13_SEND_STATUS, 0, false, &stat));
     }
-    // Send CMD12(0x00000000) to stop the transmission for multi-block transfer
-    if (ulSectorCount > 1) {
-        status = sd_cmd(pSD, CMD12_STOP_TRANSMISSION, 0x0, false, 0);
+    sd_release(pSD);
+    if (SD_BLOCK_DEVICE_ERROR_NONE != sd_async.status) {
+        // nothing is printed from the interrupt, the failing block is reported here
+        DBG_PRINTF("%s: %s failed at block %lu of %lu: %d\r\n", __FUNCTION__, sd_async.write ? "write" : "read",
+                   (unsigned long)sd_async.block, (unsigned long)sd_async.count, sd_async.status);
+    }
+    sd_async.state = SD_ASYNC_IDLE;
+    if (sd_async.callback) {
+        sd_async.callback(pSD, sd_async.status, sd_async.context);
     }
-    return rd_status ? rd_status : status;
 }
 
-int sd_read_blocks(sd_card_t *pSD, uint8_t *buffer, uint64_t ulSectorNumber,
-                   uint32_t ulSectorCount) {
-    sd_acquire(pSD);
-    TRACE_PRINTF("sd_read_blocks(0x%p, 0x%llx, 0x%lx)\r\n", buffer,
+/** Start reading blocks in the background
+ *
+ *  @param callback     Called from sd_async_poll() or sd_async_wait() when the transfer
+ *                      has finished, with the final status. May be NULL.
+ *  @return             SD_BLOCK_DEVICE_ERROR_NONE if the transfer was started, otherwise
+ *                      the error and the callback is not called
+ */
+int sd_read_blocks_async(sd_card_t *pSD, uint8_t *buffer, uint64_t ulSectorNumber,
+                         uint32_t ulSectorCount, sd_async_callback_t callback, void *context) {
+    TRACE_PRINTF("sd_read_blocks_async(0x%p, 0x%llx, 0x%lx)\r\n", buffer,
                  ulSectorNumber, ulSectorCount);
-    int status = in_sd_read_blocks(pSD, buffer, ulSectorNumber, ulSectorCount);
-    sd_release(pSD);
-    return status;
+    return sd_async_start(pSD, false, buffer, ulSectorNumber, ulSectorCount, callback, context);
 }
 
-static uint8_t sd_write_block(sd_card_t *pSD, const uint8_t *buffer,
-                              uint8_t token, uint32_t length) {
-    uint16_t crc = (~0);
-    uint8_t response = 0xFF;
-
-    // indicate start of block
-    sd_spi_write(pSD, token);
-
-    // write the data
-    bool ret = sd_spi_transfer(pSD, buffer, NULL, length);
-    myASSERT(ret);
+/** Start writing blocks in the background, the buffer must not change until the transfer is finished
+ *
+ *  @return             SD_BLOCK_DEVICE_ERROR_NONE if the transfer was started, otherwise
+ *                      the error and the callback is not called
+ */
+int sd_write_blocks_async(sd_card_t *pSD, const uint8_t *buffer, uint64_t ulSectorNumber,
+                          uint32_t blockCnt, sd_async_callback_t callback, void *context) {
+    TRACE_PRINTF("sd_write_blocks_async(0x%p, 0x%llx, 0x%lx)\r\n", buffer,
+                 ulSectorNumber, blockCnt);
+    return sd_async_start(pSD, true, (uint8_t *)buffer, ulSectorNumber, blockCnt, callback, context);
+}
 
-#if SD_CRC_ENABLED
-    if (crc_on) {
-        // Compute CRC
-        crc = crc16((void *)buffer, length);
+/** Move a background transfer along, never waits for the card
+ *
+ *  @return             true when no transfer is running
+ */
+bool sd_async_poll(sd_card_t *pSD) {
+    if (SD_ASYNC_IDLE == sd_async.state) return true;
+    myASSERT(pSD == sd_async.pSD);
+    uint32_t save = save_and_disable_interrupts();
+    if (SD_ASYNC_READY == sd_async.state) {
+        sd_async_step();
+    } else if ((SD_ASYNC_DATA == sd_async.state) && time_reached(sd_async.timeout)) {
+        dma_channel_abort(pSD->spi->rx_dma);
+        dma_channel_abort(pSD->spi->tx_dma);
+        sd_async_set_error(SD_BLOCK_DEVICE_ERROR_NO_RESPONSE);
+        sd_async.state = SD_ASYNC_END;
     }
-#endif
-
-    // write the checksum CRC16
-    sd_spi_write(pSD, crc >> 8);
-    sd_spi_write(pSD, crc);
+    restore_interrupts(save);
+    if (SD_ASYNC_END != sd_async.state) return false;
+    sd_async_finish();
+    return true;
+}
 
-    // check the response token
-    response = sd_spi_write(pSD, SPI_FILL_CHAR);
+/** Wait for a background transfer to finish
+ *
+ *  @return             the status of the last transfer
+ */
+int sd_async_wait(sd_card_t *pSD) {
+    while (!sd_async_poll(pSD)) tight_loop_contents();
+    return sd_async.status;
+}
 
-    // Wait for last block to be written
-    if (false == sd_wait_ready(pSD, SD_COMMAND_TIMEOUT)) {
-        DBG_PRINTF("%s:%d: Card not ready yet\r\n", __FILE__, __LINE__);
-    }
-    return (response & SPI_DATA_RESPONSE_MASK);
+int sd_read_blocks(sd_card_t *pSD, uint8_t *buffer, uint64_t ulSectorNumber,
+                   uint32_t ulSectorCount) {
+    int status = sd_read_blocks_async(pSD, buffer, ulSectorNumber, ulSectorCount, NULL, NULL);
+    if (SD_BLOCK_DEVICE_ERROR_NONE == status) status = sd_async_wait(pSD);
+    return status;
 }
 
 /** Program blocks to a block device
@@ -945,81 +1119,10 @@ static uint8_t sd_write_block(sd_card_t *pSD, const uint8_t *buffer,
  *                  SD_BLOCK_DEVICE_ERROR_WRITE - SPI write error
  *                  SD_BLOCK_DEVICE_ERROR_ERASE - erase error
  */
-static int in_sd_write_blocks(sd_card_t *pSD, const uint8_t *buffer,
-                              uint64_t ulSectorNumber, uint32_t blockCnt) {
-    if (ulSectorNumber + blockCnt > pSD->sectors)
-        return SD_BLOCK_DEVICE_ERROR_PARAMETER;
-    if (pSD->m_Status & (STA_NOINIT | STA_NODISK))
-        return SD_BLOCK_DEVICE_ERROR_PARAMETER;
-
-    int status = SD_BLOCK_DEVICE_ERROR_NONE;
-    uint8_t response;
-    uint64_t addr;
-
-    // SDSC Card (CCS=0) uses byte unit address
-    // SDHC and SDXC Cards (CCS=1) use block unit address (512 Bytes unit)
-    if (SDCARD_V2HC == pSD->card_type) {
-        addr = ulSectorNumber;
-    } else {
-        addr = ulSectorNumber * _block_size;
-    }
-    // Send command to perform write operation
-    if (blockCnt == 1) {
-        // Single block write command
-        if (SD_BLOCK_DEVICE_ERROR_NONE !=
-            (status = sd_cmd(pSD, CMD24_WRITE_BLOCK, addr, false, 0))) {
-            return status;
-        }
-        // Write data
-        response = sd_write_block(pSD, buffer, SPI_START_BLOCK, _block_size);
-
-        // Only CRC and general write error are communicated via response token
-        if (response != SPI_DATA_ACCEPTED) {
-            DBG_PRINTF("Single Block Write failed: 0x%x \r\n", response);
-            status = SD_BLOCK_DEVICE_ERROR_WRITE;
-        }
-    } else {
-        // Pre-erase setting prior to multiple block write operation
-        sd_cmd(pSD, ACMD23_SET_WR_BLK_ERASE_COUNT, blockCnt, 1, 0);
-
-        // Some SD cards want to be deselected between every bus transaction:
-        sd_spi_deselect_pulse(pSD);
-
-        // Multiple block write command
-        if (SD_BLOCK_DEVICE_ERROR_NONE !=
-            (status = sd_cmd(pSD, CMD25_WRITE_MULTIPLE_BLOCK, addr, false, 0))) {
-            return status;
-        }
-        // Write the data: one block at a time
-        do {
-            response = sd_write_block(pSD, buffer, SPI_START_BLK_MUL_WRITE, _block_size);
-            if (response != SPI_DATA_ACCEPTED) {
-                DBG_PRINTF("Multiple Block Write failed: 0x%x\r\n", response);
-                status = SD_BLOCK_DEVICE_ERROR_WRITE;
-                break;
-            }
-            buffer += _block_size;
-        } while (--blockCnt);  // Send all blocks of data
-        /* In a Multiple Block write operation, the stop transmission will be
-         * done by sending 'Stop Tran' token instead of 'Start Block' token at
-         * the beginning of the next block
-         */
-        sd_spi_write(pSD, SPI_STOP_TRAN);
-    }
-    uint32_t stat = 0;
-    // Some SD cards want to be deselected between every bus transaction:
-    sd_spi_deselect_pulse(pSD);
-    status = sd_cmd(pSD, CMD13_SEND_STATUS, 0, false, &stat);
-    return status;
-}
-
 int sd_write_blocks(sd_card_t *pSD, const uint8_t *buffer,
                     uint64_t ulSectorNumber, uint32_t blockCnt) {
-    sd_acquire(pSD);
-    TRACE_PRINTF("sd_write_blocks(0x%p, 0x%llx, 0x%lx)\r\n", buffer,
-                 ulSectorNumber, blockCnt);
-    int status = in_sd_write_blocks(pSD, buffer, ulSectorNumber, blockCnt);
-    sd_release(pSD);
+    int status = sd_write_blocks_async(pSD, buffer, ulSectorNumber, blockCnt, NULL, NULL);
+    if (SD_BLOCK_DEVICE_ERROR_NONE == status) status = sd_async_wait(pSD);
     return status;
 }
 
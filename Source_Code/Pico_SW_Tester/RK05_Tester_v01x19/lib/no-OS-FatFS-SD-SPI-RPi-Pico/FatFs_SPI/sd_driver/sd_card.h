@@ -86,6 +86,16 @@ struct sd_card_t {
 bool sd_card_detect(sd_card_t *pSD);
 uint64_t sd_sectors(sd_card_t *pSD);
 
+// Background block transfers, see sd_card.c. The callback is called from sd_async_poll() or
+// sd_async_wait() once the card is unlocked, so it may start the next transfer.
+typedef void (*sd_async_callback_t)(sd_card_t *sd_card_p, int status, void *context);
+int sd_read_blocks_async(sd_card_t *sd_card_p, uint8_t *buffer, uint64_t ulSectorNumber,
+                         uint32_t ulSectorCount, sd_async_callback_t callback, void *context);
+int sd_write_blocks_async(sd_card_t *sd_card_p, const uint8_t *buffer, uint64_t ulSectorNumber,
+                          uint32_t blockCnt, sd_async_callback_t callback, void *context);
+bool sd_async_poll(sd_card_t *sd_card_p);
+int sd_async_wait(sd_card_t *sd_card_p);
+
 bool sd_init_driver();
 bool sd_card_detect(sd_card_t *sd_card_p);
 
@@ -16,6 +16,7 @@
 //#include "display_functions.h"
 //#include "tester_state_definitions.h"  // commented-out 2/5/2025
 #include "tester_hardware.h"
+#include "image_codec.h"
 //#include "microsd_file_ops.h" // commented-out 2/7/2025
 #include "dpd_definitions.h"
 
@@ -32,10 +33,42 @@ static int ret;
 static char diskimagefilename[FF_LFN_BUF + 1] = "";
 static uint8_t sectordata[MAX_SECTOR_SIZE];
 
+// image file format versions, format 2.0 adds an encoding to every sector record (see image_codec.h)
+// Both formats are read, images are always written in format 1.1.
+#define IMAGE_FORMAT_1_1 11
+#define IMAGE_FORMAT_2_0 20
+#define MAX_IMAGE_RECORD_SIZE (MAX_SECTOR_SIZE + IMAGE_RECORD_HEADER_V2_MAX - 4) // largest sector record in the file
+static int imageformat = IMAGE_FORMAT_1_1;  // format of the open image file
+
+// When the image file is one contiguous run of clusters the image data is read straight from the card, in the
+// background while the sectors are stored in the FPGA DRAM. The cluster link map shows whether it is contiguous.
+// Each fragment of the file takes 2 entries, plus 1 for the table size and 1 for the terminator.
+#define IMAGE_LINKMAP_SIZE 256
+static DWORD imagelinkmap[IMAGE_LINKMAP_SIZE];
+static bool imageraw = false;      // the open image file is contiguous and imagelba is valid
+static LBA_t imagelba;             // card block number of the first byte of the image file
+
 /* Search a directory for objects and display it */
 
+// check whether the open image file is contiguous, if it is too fragmented for the table it is read through FatFs
+static void image_contiguous_check()
+{
+    imagelinkmap[0] = IMAGE_LINKMAP_SIZE;
+    fil.cltbl = imagelinkmap;
+    FRESULT fr = f_lseek(&fil, CREATE_LINKMAP);
+    imageraw = false;
+    if (fr != FR_OK)
+        fil.cltbl = NULL;
+    else if ((imagelinkmap[0] == 4) && (fil.obj.sclust >= 2)){
+        // a single fragment takes 4 table entries, size + one (length, start cluster) pair + terminator
+        imagelba = fs.database + ((LBA_t)(fil.obj.sclust - 2) * fs.csize);
+        imageraw = true;
+    }
+}
+
 static void force_unmount()
 {
+    imageraw = false;
     f_unmount("0:");
 
     // Force SD card reinitialization.
@@ -114,6 +147,7 @@ FRESULT file_open_read_disk_image_n(char* filename)
         force_unmount();
         return(fr);
     }
+    image_contiguous_check();
     return(FR_OK);
 }
 
@@ -140,6 +174,7 @@ FRESULT file_close_disk_image()
 {
     // Close file
     FRESULT fr;
+    imageraw = false;
     fr = f_close(&fil);
     if (fr != FR_OK) {
         printf("ERROR: Could not close microSD file (%d)\r\n", fr);
@@ -271,18 +306,60 @@ FRESULT open_and_read_drive_parameters(Disk_State* dstate, char* filename)
     return(FR_OK);
 }
 
-bool deserialize_int(int *vp)
+// *************** image file header ***************
+// The whole header is read from the file with one f_read and the fields are parsed from memory.
+// Header version 2.1 has the same sector records as format 2.0 and ends the header with a tag-length-value
+// trailer so fields can be added without a new format. Each entry is a 16-bit tag and a 16-bit value length,
+// big endian like the other header values, then the value bytes. The trailer ends with IMAGE_TAG_END and a
+// length of 0. Tags that this firmware doesn't know are skipped, so a newer image can still be loaded.
+// A version 2.0 header has no trailer and ends after microsecondsPerSector. The whole header is at most
+// IMAGE_HEADER_MAX bytes.
+//
+#define IMAGE_HEADER_MAX 1024
+#define IMAGE_TAG_END 0
+static uint8_t headerbuf[IMAGE_HEADER_MAX];
+static int headerlen;   // number of valid bytes in headerbuf
+static int headerpos;   // offset of the next unparsed byte in headerbuf
+
+// read the start of the file into headerbuf, the image data after the header is read too and ignored
+static bool header_buffer_read()
 {
     FRESULT fr;
     UINT nr;
-    uint8_t buf[4];
-    int value = 0;
 
-    fr = f_read(&fil, buf, 4, &nr);
-    if (fr != FR_OK || nr != 4) {
+    headerlen = 0;
+    headerpos = 0;
+    fr = f_read(&fil, headerbuf, sizeof(headerbuf), &nr);
+    if (fr != FR_OK) {
         printf("###ERROR, microSD Header data read error fr=%d, nr=%u\r\n", fr, nr);
         return(false);
     }
+    headerlen = nr;
+    return(true);
+}
+
+// leave the file positioned at the first sector record, the header is always at the start of the file
+static bool header_buffer_done()
+{
+    FRESULT fr = f_lseek(&fil, headerpos);
+    if (fr != FR_OK) {
+        printf("###ERROR, microSD Header seek error fr=%d\r\n", fr);
+        return(false);
+    }
+    return(true);
+}
+
+bool deserialize_int(int *vp)
+{
+    uint8_t* buf;
+    int value = 0;
+
+    if ((headerpos + 4) > headerlen) {
+        printf("###ERROR, microSD Header data read error, file too short\r\n");
+        return(false);
+    }
+    buf = &headerbuf[headerpos];
+    headerpos += 4;
 
     value  = buf[0] << 24;
     value |= buf[1] << 16;
@@ -315,14 +392,56 @@ bool serialize_int(int value)
 }
 
 bool deserialize_string(char *cp, int size)
+{
+    if ((headerpos + size) > headerlen) {
+        printf("###ERROR, microSD Header data read error, file too short\r\n");
+        return(false);
+    }
+    memcpy(cp, &headerbuf[headerpos], size);
+    headerpos += size;
+
+    return(true);
+}
+
+// parse the tag-length-value trailer of a version 2.1 header
+bool deserialize_trailer()
+{
+    int skipped = 0;
+
+    while (true) {
+        if ((headerpos + 4) > headerlen) {
+            printf("###ERROR, microSD Header trailer is not terminated\r\n");
+            return(false);
+        }
+        int tag = (headerbuf[headerpos] << 8) | headerbuf[headerpos + 1];
+        int length = (headerbuf[headerpos + 2] << 8) | headerbuf[headerpos + 3];
+        headerpos += 4;
+        if ((headerpos + length) > headerlen) {
+            printf("###ERROR, microSD Header trailer tag %d is too long (%d)\r\n", tag, length);
+            return(false);
+        }
+        if (tag == IMAGE_TAG_END)
+            break;
+        // no other tags are defined yet
+        headerpos += length;
+        skipped++;
+    }
+    if (skipped > 0)
+        printf("  skipped %d unknown header tags\r\n", skipped);
+
+    return(true);
+}
+
+// write the tag-length-value trailer of a version 2.1 header, there are no tags to write yet
+bool serialize_trailer()
 {
     FRESULT fr;
-    UINT nr;
-    int value = 0;
+    UINT nw;
+    uint8_t buf[4] = { (IMAGE_TAG_END >> 8) & 0xFF, IMAGE_TAG_END & 0xFF, 0, 0 };
 
-    fr = f_read(&fil, cp, size, &nr);
-    if (fr != FR_OK || nr != size) {
-        printf("###ERROR, microSD Header data read error fr=%d, nr=%u\r\n", fr, nr);
+    fr = f_write(&fil, buf, 4, &nw);
+    if (fr != FR_OK || nw != 4) {
+        printf("###ERROR, microSD Header data write error fr=%d, nw=%u\r\n", fr, nw);
         return(false);
     }
 
@@ -356,6 +475,8 @@ bool serialize_string(char *cp, int size)
 
 static char magicNumber[10] = "\x89RK05\r\n\x1A"; 
 static char versionNumber[4] = "1.1";
+static char versionNumber2[4] = "2.0";    // format 2.0 records, no header trailer
+static char versionNumber21[4] = "2.1";   // format 2.0 records, header trailer
 
 int read_image_file_header(struct Disk_State* dstate)
 {
@@ -364,13 +485,26 @@ int read_image_file_header(struct Disk_State* dstate)
 
     printf("  Reading header from file '%s'\r\n", diskimagefilename);
 
+    if (!header_buffer_read())
+        return 1;
+
     if (!deserialize_string(tmp, sizeof(magicNumber)) || strncmp(tmp, magicNumber, sizeof(magicNumber)) != false) {
         // invalid magic
         printf("###ERROR, invalid magic number in microSD image file header\r\n");
         return 2;
     }
 
-    if (!deserialize_string(tmp, sizeof(versionNumber)) || strncmp(tmp, versionNumber, sizeof(versionNumber)) != false) {
+    if (!deserialize_string(tmp, sizeof(versionNumber))) {
+        printf("###ERROR, invalid Version Number in microSD image file header\r\n");
+        return 3;
+    }
+    if (strncmp(tmp, versionNumber, sizeof(versionNumber)) == 0)
+        imageformat = IMAGE_FORMAT_1_1;
+    else if (strncmp(tmp, versionNumber2, sizeof(versionNumber2)) == 0)
+        imageformat = IMAGE_FORMAT_2_0;
+    else if (strncmp(tmp, versionNumber21, sizeof(versionNumber21)) == 0)
+        imageformat = IMAGE_FORMAT_2_0;
+    else {
         // unexpected version
         printf("###ERROR, invalid Version Number in microSD image file header\r\n");
         return 3;
@@ -386,6 +520,9 @@ int read_image_file_header(struct Disk_State* dstate)
     rc = rc && deserialize_int(&dstate->numberOfSectorsPerTrack); 
     rc = rc && deserialize_int(&dstate->numberOfHeads);           
     rc = rc && deserialize_int(&dstate->microsecondsPerSector);
+    if (strncmp(tmp, versionNumber21, sizeof(versionNumber21)) == 0)
+        rc = rc && deserialize_trailer();
+    rc = rc && header_buffer_done();
 
     if (rc) {
         printf("controller = %s\r\n", dstate->controller);
@@ -409,6 +546,7 @@ int write_image_file_header(struct Disk_State* dstate)
 
     printf("  Writing header to microSD file '%s'\r\n", diskimagefilename);
 
+    imageformat = IMAGE_FORMAT_1_1;
     rc =       serialize_string(magicNumber, sizeof(magicNumber));
     rc = rc && serialize_string(versionNumber, sizeof(versionNumber));
     rc = rc && serialize_string(dstate->imageName, sizeof(dstate->imageName));
@@ -425,67 +563,231 @@ int write_image_file_header(struct Disk_State* dstate)
 
 }
 
-FRESULT read_disk_image_data_tester(struct Disk_State* dstate)
+// *************** chunked image data reads ***************
+// The image data is read from the file in large chunks and the variable-length sector records are parsed
+// from memory, instead of two small f_read calls per sector. The reads are kept aligned to the 512-byte
+// microSD sectors so FatFs can transfer them straight into the buffer with multi-sector reads. A record
+// that straddles the end of a chunk is moved to the front of the buffer before the next chunk is appended.
+// When the file is contiguous the next chunk is read from the card in the background with the SD driver's
+// asynchronous block reads while the current one is stored in the FPGA DRAM.
+//
+#define IMAGE_CHUNK_SIZE (16 * 1024)
+static uint8_t imagechunk[MAX_IMAGE_RECORD_SIZE + IMAGE_CHUNK_SIZE];
+static int chunklen;   // number of valid bytes in imagechunk
+static int chunkpos;   // offset of the next unparsed byte in imagechunk
+static FSIZE_t chunkfileoffset; // file offset of the byte after the last one in imagechunk
+
+static uint8_t imageprefetch[IMAGE_CHUNK_SIZE];
+static bool prefetch_busy;      // a read into imageprefetch is running
+static int prefetch_status;     // SD driver status of the last read into imageprefetch
+static FSIZE_t prefetchoffset;  // file offset of the block read into imageprefetch, -1 if none
+
+// completion callback from the SD driver
+static void image_prefetch_done(sd_card_t *pSD, int status, void *context)
+{
+    prefetch_status = status;
+    prefetch_busy = false;
+}
+
+// move the background read along, called while the sectors are stored
+static void image_prefetch_poll()
+{
+    if (prefetch_busy)
+        sd_async_poll(sd_get_by_num(0));
+}
+
+// wait for the background read to finish and return its status
+static int image_prefetch_wait()
+{
+    if (prefetch_busy)
+        sd_async_wait(sd_get_by_num(0));
+    return(prefetch_status);
+}
+
+static void image_chunk_reset()
+{
+    chunklen = 0;
+    chunkpos = 0;
+    chunkfileoffset = f_tell(&fil);
+    prefetchoffset = -1;
+}
+
+// read the next chunk straight from the card and start reading the one after it
+// The first read after the header starts at the beginning of the 512-byte block holding the end of the header.
+static FRESULT image_chunk_read_raw(UINT* nbytes)
+{
+    int skip = chunkfileoffset % FF_MIN_SS;
+    FSIZE_t blockoffset = chunkfileoffset - skip;
+    FSIZE_t available = f_size(&fil) - blockoffset;
+    int nblocks = IMAGE_CHUNK_SIZE / FF_MIN_SS;
+    if (available < IMAGE_CHUNK_SIZE)
+        nblocks = (int)((available + FF_MIN_SS - 1) / FF_MIN_SS);
+    *nbytes = 0;
+    if (nblocks == 0)
+        return(FR_OK);
+    int valid = (available < (FSIZE_t)(nblocks * FF_MIN_SS)) ? (int)available : (nblocks * FF_MIN_SS);
+    // skip is only non-zero on the first read, when the buffer is empty
+    sd_card_t *pSD = sd_get_by_num(0);
+    int status;
+    if (prefetchoffset == blockoffset){
+        status = image_prefetch_wait();
+        if (status == SD_BLOCK_DEVICE_ERROR_NONE)
+            memcpy(&imagechunk[chunklen], imageprefetch, valid);
+    }
+    else{
+        image_prefetch_wait();
+        status = pSD->read_blocks(pSD, &imagechunk[chunklen], imagelba + (blockoffset / FF_MIN_SS), nblocks);
+    }
+    prefetchoffset = -1;
+    if (status != SD_BLOCK_DEVICE_ERROR_NONE){
+        printf("###ERROR, Image data block read error %d\r\n", status);
+        return(FR_DISK_ERR);
+    }
+    if (skip != 0){
+        memmove(&imagechunk[chunklen], &imagechunk[chunklen + skip], valid - skip);
+    }
+    *nbytes = valid - skip;
+
+    FSIZE_t nextoffset = blockoffset + (nblocks * FF_MIN_SS);
+    if (nextoffset < f_size(&fil)){
+        FSIZE_t nextavailable = f_size(&fil) - nextoffset;
+        int nextblocks = (nextavailable < IMAGE_CHUNK_SIZE) ? (int)((nextavailable + FF_MIN_SS - 1) / FF_MIN_SS) : (IMAGE_CHUNK_SIZE / FF_MIN_SS);
+        prefetch_busy = true;
+        prefetch_status = sd_read_blocks_async(pSD, imageprefetch, imagelba + (nextoffset / FF_MIN_SS), nextblocks, image_prefetch_done, NULL);
+        if (prefetch_status == SD_BLOCK_DEVICE_ERROR_NONE)
+            prefetchoffset = nextoffset;
+        else
+            prefetch_busy = false; // not started, the next chunk is read without it
+    }
+    return(FR_OK);
+}
+
+// make sure at least count bytes of image data are available at &imagechunk[chunkpos], count must be <= MAX_IMAGE_RECORD_SIZE
+static FRESULT image_chunk_ensure(int count)
 {
     FRESULT fr;
     UINT nr;
+    int remaining = chunklen - chunkpos;
+
+    if (remaining >= count)
+        return(FR_OK);
+    memmove(imagechunk, &imagechunk[chunkpos], remaining);
+    chunkpos = 0;
+    chunklen = remaining;
+
+    if (imageraw){
+        fr = image_chunk_read_raw(&nr);
+        if (fr != FR_OK)
+            return(fr);
+    }
+    else{
+        // the first read after the header ends on a 512-byte boundary, after that every read is a whole number of sectors
+        UINT toread = IMAGE_CHUNK_SIZE - (chunkfileoffset % FF_MIN_SS);
+        fr = f_read(&fil, &imagechunk[chunklen], toread, &nr);
+        if (fr != FR_OK) {
+            printf("###ERROR, Image data read error fr=%d, nr=%u\r\n", fr, nr);
+            return(fr);
+        }
+    }
+    chunklen += nr;
+    chunkfileoffset += nr;
+    if (chunklen < count) {
+        printf("###ERROR, Image data read error, end of file, needed %d bytes, %d available\r\n", count, chunklen);
+        return(FR_INVALID_PARAMETER);
+    }
+    return(FR_OK);
+}
+
+FRESULT read_disk_image_data_tester(struct Disk_State* dstate)
+{
+    FRESULT fr;
     uint8_t *bp;
     int bytecount;
     int sectorcount;
     int headcount;
     int cylindercount;
     int ramaddress;
+    int crcsectors = 0;
+    int crcerrors = 0;
 
     printf("  Reading disk data from microSD file '%s'\r\n", diskimagefilename);
     printf("  %s\r\n", dstate->controller);
     printf("  cylinders=%d, heads=%d, sectors=%d\r\n", dstate->numberOfCylinders, dstate->numberOfHeads, dstate->numberOfSectorsPerTrack);
+    image_chunk_reset();
     for (cylindercount = 0; cylindercount < dstate->numberOfCylinders; cylindercount++){
         if ((cylindercount % 20) == 0)
             printf("    cylindercount = %d\r\n", cylindercount);
         for (headcount = 0; headcount < dstate->numberOfHeads; headcount++){
             for( sectorcount = 0; sectorcount < dstate->numberOfSectorsPerTrack; sectorcount++){
-                // first read the two parameters:
+                // first parse the two parameters:
                 //   1. Bit times from sector pulse to start bit (16-bit value)
                 //   2. Number of data bits after the start bit (16-bit value)
-                bytecount = 4;
-                fr = f_read(&fil, sectordata, bytecount, &nr);
+                //   format 2.0 adds the body encoding, flags, the number of body bytes stored in the file and an optional CRC
+                int recordheader = (imageformat == IMAGE_FORMAT_2_0) ? IMAGE_RECORD_HEADER_V2 : 4;
+                fr = image_chunk_ensure(recordheader);
                 if (fr != FR_OK) {
-                    printf("###ERROR, Image data read error fr=%d, nr=%u\r\n", fr, nr);
+                    image_prefetch_wait();
                     microSD_LED_off();
                     return(fr);
                 }
-                if (nr != bytecount) {
-                    printf("###ERROR, Image data read error, number read != bytecount, fr=%d, nr=%u\r\n", fr, nr);
-                    microSD_LED_off();
-                    return(FR_INVALID_PARAMETER);
-                }
+                bp = &imagechunk[chunkpos];
 
                 // compute the DRAM address of this sector and load it into the hardware address counter
                 ramaddress = compute_ram_address(dstate->numberOfSectorsPerTrack, cylindercount, headcount, sectorcount);
                 load_ram_address(ramaddress);
 
                 // compute the byte count based on "Number of data bits after the start bit"
-                int sector_data_bit_count = (sectordata[3] << 8) | sectordata[2];
+                int sector_data_bit_count = (bp[3] << 8) | bp[2];
                 int wordcount = (sector_data_bit_count + 15) >> 4; // round the word count up to the next integer value
                 bytecount = wordcount * 2;
+                int encoding = IMAGE_ENC_RAW;
+                int storedcount = bytecount;
+                if (imageformat == IMAGE_FORMAT_2_0){
+                    encoding = bp[4];
+                    storedcount = (bp[7] << 8) | bp[6];
+                    recordheader = image_record_header_length(bp[5]);
+                }
                 //printf("  bc=%d\r\n", bytecount);
+                // the same limit as the emulator, a record with the largest header still fits in MAX_IMAGE_RECORD_SIZE
+                if (((bytecount + 4) > MAX_SECTOR_SIZE) || ((storedcount + 4) > MAX_SECTOR_SIZE)) {
+                    printf("###ERROR, sector too long C=%d H=%d S=%d, bytecount=%d\r\n", cylindercount, headcount, sectorcount, bytecount);
+                    image_prefetch_wait();
+                    microSD_LED_off();
+                    return(FR_INVALID_PARAMETER);
+                }
 
-                bp = sectordata;
-                fr = f_read(&fil, sectordata, bytecount, &nr);
+                fr = image_chunk_ensure(recordheader + storedcount);
                 if (fr != FR_OK) {
-                    printf("###ERROR, Image data read error fr=%d, nr=%u\r\n", fr, nr);
+                    image_prefetch_wait();
                     microSD_LED_off();
                     return(fr);
                 }
-                if (nr != bytecount) {
-                    printf("###ERROR, Image data read error, number read != bytecount, fr=%d, nr=%u\r\n", fr, nr);
-                    microSD_LED_off();
-                    return(FR_INVALID_PARAMETER);
+                bp = &imagechunk[chunkpos];
+                chunkpos += recordheader + storedcount;
+                // the load carries on after a CRC mismatch so every bad sector is reported
+                if ((imageformat == IMAGE_FORMAT_2_0) && (bp[5] & IMAGE_FLAG_CRC32)){
+                    crcsectors++;
+                    if (!image_record_crc_ok(bp)){
+                        printf("###ERROR, CRC mismatch C=%d H=%d S=%d\r\n", cylindercount, headcount, sectorcount);
+                        crcerrors++;
+                    }
+                }
+                bp += recordheader;
+                if (imageformat == IMAGE_FORMAT_2_0){
+                    // decode the body into the sector buffer
+                    if (!image_decode_body(encoding, bp, storedcount, sectordata, bytecount)) {
+                        printf("###ERROR, bad sector record C=%d H=%d S=%d, encoding=%d\r\n", cylindercount, headcount, sectorcount, encoding);
+                        image_prefetch_wait();
+                        microSD_LED_off();
+                        return(FR_INVALID_PARAMETER);
+                    }
+                    bp = sectordata;
                 }
 
                 gpio_put(22, 1); // for debugging to time the loop
-                bp = sectordata;
                 for (int i = 0; i < bytecount; i++){
+                    if ((i & 127) == 0)
+                        image_prefetch_poll(); // keep the background read going between the blocks
                     storebyte(*bp++);
                 }
                 gpio_put(22, 0); // for debugging to time the loop
@@ -504,14 +806,76 @@ FRESULT read_disk_image_data_tester(struct Disk_State* dstate)
             }
         }
     }
+    image_prefetch_wait(); // a read past the last record may still be running
+    if (crcerrors > 0){
+        printf("###ERROR, %d of %d sectors failed the CRC check\r\n", crcerrors, crcsectors);
+        return(FR_INT_ERR);
+    }
+    if (crcsectors > 0)
+        printf("  %d sectors passed the CRC check\r\n", crcsectors);
+
+    return(FR_OK);
+}
+
+// *************** staged image data writes ***************
+// The sector records are copied into the chunk buffer and written to the file with one f_write for each stretch
+// that ends on an IMAGE_CHUNK_SIZE boundary of the file, instead of one small f_write per sector. That is a whole
+// number of clusters for clusters up to IMAGE_CHUNK_SIZE, so FatFs writes the full sectors straight from the buffer
+// with multi-sector writes and only the sectors at the ends go through its own sector buffer.
+//
+static FSIZE_t stagefileoffset; // file offset of imagechunk[0]
+static int stagelen;            // number of bytes staged in imagechunk
+static int stagewrites;         // number of f_write calls, printed after the save
+
+static void image_stage_start()
+{
+    stagefileoffset = f_tell(&fil);
+    stagelen = 0;
+    stagewrites = 0;
+}
 
+// write the first count staged bytes and move the rest to the front of the buffer
+static FRESULT image_stage_write(int count)
+{
+    UINT nw;
+    FRESULT fr = f_write(&fil, imagechunk, count, &nw);
+    if (fr != FR_OK) {
+        printf("###ERROR, microSD Image data write error fr=%d, nw=%u\r\n", fr, nw);
+        return(fr);
+    }
+    if (nw != (UINT)count) {
+        printf("###ERROR, microSD Image data write, number written != bytecount, fr=%d, nw=%u\r\n", fr, nw);
+        return(FR_INVALID_PARAMETER);
+    }
+    stagewrites++;
+    stagelen -= count;
+    memmove(imagechunk, &imagechunk[count], stagelen);
+    stagefileoffset += count;
     return(FR_OK);
 }
 
+// add a sector record, count must be <= MAX_IMAGE_RECORD_SIZE
+static FRESULT image_stage_append(const uint8_t* bp, int count)
+{
+    memcpy(&imagechunk[stagelen], bp, count);
+    stagelen += count;
+    int flushsize = IMAGE_CHUNK_SIZE - (int)(stagefileoffset % IMAGE_CHUNK_SIZE);
+    if (stagelen < flushsize)
+        return(FR_OK);
+    return(image_stage_write(flushsize));
+}
+
+// write whatever is left in the buffer
+static FRESULT image_stage_finish()
+{
+    if (stagelen == 0)
+        return(FR_OK);
+    return(image_stage_write(stagelen));
+}
+
 FRESULT write_disk_image_data(struct Disk_State* dstate)
 {
     FRESULT fr;
-    UINT nw;
     uint8_t *bp;
     int bytecount;
     int sectorcount;
@@ -521,6 +885,9 @@ FRESULT write_disk_image_data(struct Disk_State* dstate)
 
     printf("  Writing disk image data to microSD file '%s':\r\n", diskimagefilename);
     printf("  cylinders=%d, heads=%d, sectors=%d\r\n", dstate->numberOfCylinders, dstate->numberOfHeads, dstate->numberOfSectorsPerTrack);
+    uint64_t start_time = time_us_64();
+    int totalbytes = 0;
+    image_stage_start();
     for (cylindercount = 0; cylindercount < dstate->numberOfCylinders; cylindercount++){
         if ((cylindercount % 20) == 0)
             printf("    cylinder = %d\r\n", cylindercount);
@@ -543,27 +910,28 @@ FRESULT write_disk_image_data(struct Disk_State* dstate)
 
                 // bp is already pointing to the proper place in the sectordata array
                 // copy from the Tester DRAM to the sector data array
-                for (int i = 0; i < bytecount; i++){
-                    *bp++ = readbyte();
-                }
+                readbytes(bp, bytecount);
                 gpio_put(22, 0); // for debugging to time the loop
 
                 bytecount += 4; // add 4 bytes to account for the two 16-bit length fields
                 //printf("C = %d, H = %d, S = %d, bytecount = %d\r\n", cylindercount, headcount, sectorcount, bytecount); // for debugging
-                fr = f_write(&fil, sectordata, bytecount, &nw);
+                fr = image_stage_append(sectordata, bytecount);
                 if (fr != FR_OK) {
-                    printf("###ERROR, microSD Image data write error fr=%d, nw=%u\r\n", fr, nw);
                     microSD_LED_off();
                     return(fr);
                 }
-                if (nw != bytecount) {
-                    printf("###ERROR, microSD Image data write, number written != bytecount, fr=%d, nw=%u\r\n", fr, nw);
-                    microSD_LED_off();
-                    return(FR_INVALID_PARAMETER);
-                }
+                totalbytes += bytecount;
             }
         }
     }
+    fr = image_stage_finish();
+    if (fr != FR_OK) {
+        microSD_LED_off();
+        return(fr);
+    }
+    int elapsed_us = (int)(time_us_64() - start_time);
+    printf("  saved %d bytes in %d msec, %.2f MB/s, %d writes to the card\r\n", totalbytes, elapsed_us / 1000,
+        (elapsed_us > 0) ? (float)totalbytes / (float)elapsed_us : 0.0f, stagewrites);
     return(FR_OK);
 }
 
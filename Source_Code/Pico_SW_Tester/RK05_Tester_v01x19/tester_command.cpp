@@ -24,6 +24,7 @@
         // for RK11-E mode this needs to be at least ((256 * 18) + 32) / 8 = 580, 
         // so make it oversized, even for 4 sector disks
         //  for 4 sectors, one revolution is 40 msec, 40 ms / 4 = 10 ms, 10 ms * 1.6 Mbps / 8 bits/byte = 2000 bytes
+static uint8_t readbackbytes[SAVE_BUFFER_SIZE]; // sector data read back from the tester DRAM in one burst
 
 int min(int a, int b){
     if(a < b)
@@ -756,10 +757,8 @@ void read_loop(Disk_State* dstate){
             head = list_head[list_item];
             sector = list_sector[list_item];
 
-            select_head(head);
-            load_sector_address(sector);
             ramaddress = compute_ram_address(dstate->numberOfSectorsPerTrack, cylinder, head, sector);
-            load_ram_address(ramaddress);
+            setup_sector_access(head, sector, ramaddress);
 
             // Read the cylinder/head/sector from disk (disk to tester DRAM)
             restore_state = ((cylinder & 0x100) != 0) ? true : false;
@@ -852,10 +851,8 @@ void write_loop(Disk_State* dstate, bool verify){
             return;
         }
         printf("    list_item = %d\r\n", list_item);
-        select_head(head);
-        load_sector_address(sector);
         ramaddress = compute_ram_address(dstate->numberOfSectorsPerTrack, cylinder, head, sector);
-        load_ram_address(ramaddress);
+        setup_sector_access(head, sector, ramaddress);
         //for(sectorbytes = 0; sectorbytes < (dstate->dataLength / 8); sectorbytes++){
         for(sectorbytes = 0; sectorbytes < (((dstate->bit_times_data_bits_after_start + 15) >> 4) * 2); sectorbytes++){
             for(i = 0; i < 8; i++) shift_prbs16(&prbs_reg); // shift 16 times so the next value is less correlated with the previous
@@ -904,9 +901,7 @@ void write_loop(Disk_State* dstate, bool verify){
             ramaddress = compute_ram_address(dstate->numberOfSectorsPerTrack, cylinder, head, sector);
             load_ram_address(ramaddress);
             //for(sectorbytes = 0; sectorbytes < (dstate->dataLength / 8); sectorbytes++){
-            for(sectorbytes = 0; sectorbytes < (((dstate->bit_times_data_bits_after_start + 15) >> 4) * 2); sectorbytes++){
-                savebytes[sectorbytes] = readbyte();
-            }
+            readbytes(savebytes, (((dstate->bit_times_data_bits_after_start + 15) >> 4) * 2));
         }
 
         // Read the cylinder/head/sector from disk (disk to tester DRAM)
@@ -931,10 +926,7 @@ void write_loop(Disk_State* dstate, bool verify){
         }
         assert_GP6();
         deassert_GP6();
-        select_head(head);
-        load_sector_address(sector);
-
-        read_sector();
+        read_sector_at(head, sector);
         // wait for read to complete before we compare the data read to the saved data
         for(readwrite_time = 0; readwrite_time < READWRITE_TIMEOUT; readwrite_time++){ // wait for drive read Ready or timeout
             if(is_read_in_progress() == false)
@@ -953,8 +945,9 @@ void write_loop(Disk_State* dstate, bool verify){
             ramaddress = compute_ram_address(dstate->numberOfSectorsPerTrack, cylinder, head, sector);
             load_ram_address(ramaddress);
             //for(sectorbytes = 0; sectorbytes < (dstate->dataLength / 8); sectorbytes++){
+            readbytes(readbackbytes, (((dstate->bit_times_data_bits_after_start + 15) >> 4) * 2));
             for(sectorbytes = 0; sectorbytes < (((dstate->bit_times_data_bits_after_start + 15) >> 4) * 2); sectorbytes++){
-                int read_temp = readbyte();
+                int read_temp = readbackbytes[sectorbytes];
                 if(savebytes[sectorbytes] != read_temp){
                     printf("### ERROR, data error, chs = %3d %1d %2d, byte %d, ref=%x, read=%x\r\n",
                         cylinder, head, sector, sectorbytes, savebytes[sectorbytes], read_temp);
@@ -1018,10 +1011,8 @@ void read_sectors(Disk_State* dstate){
         head = list_head[list_item];
         sector = list_sector[list_item];
 
-        select_head(head);
-        load_sector_address(sector);
         ramaddress = compute_ram_address(dstate->numberOfSectorsPerTrack, cylinder, head, sector);
-        load_ram_address(ramaddress);
+        setup_sector_access(head, sector, ramaddress);
 
         // Read the cylinder/head/sector from disk (disk to tester DRAM)
         restore_state = ((cylinder & 0x100) != 0) ? true : false;
@@ -1063,12 +1054,13 @@ void read_sectors(Disk_State* dstate){
         load_ram_address(ramaddress);
         printf("    Cylinder = %d, Head = %d, Sector = %d", cylinder, head, sector);
         //for(sectorbytes = 0; sectorbytes < (dstate->dataLength / 8); sectorbytes++){
+        readbytes(readbackbytes, (((dstate->bit_times_data_bits_after_start + 15) >> 4) * 2));
         for(sectorbytes = 0; sectorbytes < (((dstate->bit_times_data_bits_after_start + 15) >> 4) * 2); sectorbytes++){
             if((sectorbytes & 0xf) == 0)
                 printf("\r\n    ");
             else if((sectorbytes & 0x7) == 0)
                 printf("  ");
-            int read_temp = readbyte();
+            int read_temp = readbackbytes[sectorbytes];
             printf("%2x ", read_temp);
         }
         printf("\r\n");
@@ -1125,10 +1117,8 @@ void write_loop_zero(Disk_State* dstate, bool verify){
             return;
         }
         printf("    list_item = %d\r\n", list_item);
-        select_head(head);
-        load_sector_address(sector);
         ramaddress = compute_ram_address(dstate->numberOfSectorsPerTrack, cylinder, head, sector);
-        load_ram_address(ramaddress);
+        setup_sector_access(head, sector, ramaddress);
         //for(sectorbytes = 0; sectorbytes < (dstate->dataLength / 8); sectorbytes++){
         for(sectorbytes = 0; sectorbytes < (((dstate->bit_times_data_bits_after_start + 15) >> 4) * 2); sectorbytes++){
             storebyte(0);
@@ -1191,10 +1181,7 @@ void write_loop_zero(Disk_State* dstate, bool verify){
             command_clear();
             return;
         }
-        select_head(head);
-        load_sector_address(sector);
-
-        read_sector();
+        read_sector_at(head, sector);
         // wait for read to complete before we compare the data read from disk
         for(readwrite_time = 0; readwrite_time < READWRITE_TIMEOUT; readwrite_time++){ // wait for drive read Ready or timeout
             if(is_read_in_progress() == false)
@@ -1213,8 +1200,9 @@ void write_loop_zero(Disk_State* dstate, bool verify){
             ramaddress = compute_ram_address(dstate->numberOfSectorsPerTrack, cylinder, head, sector);
             load_ram_address(ramaddress);
             //for(sectorbytes = 0; sectorbytes < (dstate->dataLength / 8); sectorbytes++){
+            readbytes(readbackbytes, (((dstate->bit_times_data_bits_after_start + 15) >> 4) * 2));
             for(sectorbytes = 0; sectorbytes < (((dstate->bit_times_data_bits_after_start + 15) >> 4) * 2); sectorbytes++){
-                int read_temp = readbyte();
+                int read_temp = readbackbytes[sectorbytes];
                 if(read_temp != 0){
                     printf("### ERROR, data error, chs = %3d %1d %2d, byte %d, data = %x\r\n", cylinder, head, sector, sectorbytes, read_temp);
                     error_in_this_sector = true;
@@ -1357,10 +1345,8 @@ void write_sectors_ia(Disk_State* dstate){
         sector = list_sector[list_item];
         printf("    list_item = %d, cyl = %d, head = %d, sect = %d\r\n", list_item, cylinder, head, sector);
 
-        select_head(head);
-        load_sector_address(sector);
         ramaddress = compute_ram_address(dstate->numberOfSectorsPerTrack, cylinder, head, sector);
-        load_ram_address(ramaddress);
+        setup_sector_access(head, sector, ramaddress);
         seek_to_cylinder(cylinder, false);
         // wait for BUS_ADDR_ACCEPTED_L to be asserted or timeout
         for(addr_accepted_time = 0; ((addr_accepted_time < ADDR_ACCEPTED_TIMEOUT) && (is_addr_accepted_ready() == false)); addr_accepted_time++){
@@ -1592,9 +1578,7 @@ void write_loop_random(Disk_State* dstate){
         ramaddress = compute_ram_address(dstate->numberOfSectorsPerTrack, cylinder, head, sector);
         load_ram_address(ramaddress);
         //for(sectorbytes = 0; sectorbytes < (dstate->dataLength / 8); sectorbytes++){
-        for(sectorbytes = 0; sectorbytes < (((dstate->bit_times_data_bits_after_start + 15) >> 4) * 2); sectorbytes++){
-            savebytes[sectorbytes] = readbyte();
-        }
+        readbytes(savebytes, (((dstate->bit_times_data_bits_after_start + 15) >> 4) * 2));
 
         // to be safe, wipe the tester DRAM data for the selected cylinder/head/sector, make it all 0xff before we read from the disk
         // This is so we know data was actually read from the disk to be present in this cylinder/head/sector location in the DRAM.
@@ -1624,10 +1608,7 @@ void write_loop_random(Disk_State* dstate){
             command_clear();
             return;
         }
-        select_head(head);
-        load_sector_address(sector);
-
-        read_sector();
+        read_sector_at(head, sector);
         // wait for read to complete before we compare the data read to the saved data
         for(readwrite_time = 0; readwrite_time < READWRITE_TIMEOUT; readwrite_time++){ // wait for drive read Ready or timeout
             if(is_read_in_progress() == false)
@@ -1650,8 +1631,9 @@ void write_loop_random(Disk_State* dstate){
         int bit_mask_l = 0xff & bit_mask_h;  // lower byte of mask for the last partial word
         bit_mask_h = bit_mask_h >> 8; // upper byte of mask for the last partial word
         //for(sectorbytes = 0; sectorbytes < (dstate->dataLength / 8); sectorbytes++){
+        readbytes(readbackbytes, (((dstate->bit_times_data_bits_after_start + 15) >> 4) * 2));
         for(sectorbytes = 0; sectorbytes < (((dstate->bit_times_data_bits_after_start + 15) >> 4) * 2); sectorbytes++){
-            int read_temp = readbyte();
+            int read_temp = readbackbytes[sectorbytes];
             if((sectorbytes == (sector_number_of_bytes - 2)) && (remainder_bits != 0)){ // if this is the second to last partial byte in the sector
                 // apply a mask to ignore the unused bits in the next to last partial byte
                 read_temp = read_temp & bit_mask_l;
@@ -1982,6 +1964,7 @@ void mode_wrprot(Disk_State* dstate, bool on_off){
 
 void ramtest(int start_address, int num_bytes){
     #define MASK_FOR_DOT 0xfffff
+    #define RAMTEST_BLOCK_LEN 256
     int prbs_reg;
     int bytecount, i;
     int byte_errors;
@@ -2010,7 +1993,9 @@ void ramtest(int start_address, int num_bytes){
         if((bytecount & MASK_FOR_DOT) == 0) // print a progress dot on the console
             printf(".");
         shift_prbs31(&prbs_reg); // shift 1 time
-        int tempval = readbyte();
+        if((bytecount % RAMTEST_BLOCK_LEN) == 0) // read back a block at a time with the burst transfer
+            readbytes(readbackbytes, ((num_bytes - bytecount) > RAMTEST_BLOCK_LEN) ? RAMTEST_BLOCK_LEN : (num_bytes - bytecount));
+        int tempval = readbackbytes[bytecount % RAMTEST_BLOCK_LEN];
         if(tempval != (prbs_reg & 0xff)){
             printf("### Error, address = %x, ideal = %x, readback = %x\r\n", start_address + bytecount, prbs_reg & 0xff, tempval);
             byte_errors++;
@@ -2035,7 +2020,9 @@ void ramtest(int start_address, int num_bytes){
         if((bytecount & MASK_FOR_DOT) == 0) // print a progress dot on the console
             printf(".");
         shift_prbs31(&prbs_reg); // shift 1 time
-        int tempval = readbyte();
+        if((bytecount % RAMTEST_BLOCK_LEN) == 0) // read back a block at a time with the burst transfer
+            readbytes(readbackbytes, ((num_bytes - bytecount) > RAMTEST_BLOCK_LEN) ? RAMTEST_BLOCK_LEN : (num_bytes - bytecount));
+        int tempval = readbackbytes[bytecount % RAMTEST_BLOCK_LEN];
         if(tempval != (~prbs_reg & 0xff)){
             printf("### Error, address = %x, ideal = %x, readback = %x\r\n", start_address + bytecount, ~prbs_reg & 0xff, tempval);
             byte_errors++;
@@ -2205,10 +2192,20 @@ void command_parse_and_dispatch (Disk_State* dstate)
             tempval = read_write_spi_register(p2_numeric & 0xff, p3_numeric & 0xff);
             if(p2_numeric >= 0x80)
                 printf("  read reg 0x%x -> 0x%x\r\n", p2_numeric, tempval);
-            else
+            else{
                 printf("  write reg 0x%x <- 0x%x\r\n", p2_numeric, p3_numeric);
+                shadow_registers_written(p2_numeric & 0xff, p3_numeric & 0xff); // the write may have changed a control register
+            }
         }
     }
+    else if((strcmp((char *) "SHADOW", extract_argv[0])==0) || (strcmp((char *) "SH", extract_argv[0])==0)){
+        if((extract_argc == 2) && (strcmp((char *) "RESET", extract_argv[1])==0))
+            shadow_registers_report(true);
+        else if(extract_argc != 1)
+            printf("### ERROR, %d fields entered, should be 1 field or SHADOW RESET\r\n", extract_argc);
+        else
+            shadow_registers_report(false);
+    }
     else if((strcmp((char *) "MODE", extract_argv[0])==0) || (strcmp((char *) "MD", extract_argv[0])==0)){
         if(extract_argc != 3)
             printf("### ERROR, %d fields entered, should be 3 fields\r\n", extract_argc);
@@ -2415,6 +2412,7 @@ void command_parse_and_dispatch (Disk_State* dstate)
             printf("  DISK WRITE <filename>\r\n  DISK READ <filename>\r\n");
             printf("  DIRECTORY [DIR]\r\n");
             printf("  REGISTER <register address> <register data>\r\n");
+            printf("  SHADOW [SH] [RESET]\r\n");
             printf("  MODE [MD] RK11D ON [1] or OFF [0]\r\n  MODE [MD] WTPROT [WP] ON [1] or OFF [0]\r\n");
             printf("  MODE [MD] CONTROLLER [CONT] RK8E or RK11D or RK11E or ALTO\r\n");
             printf("  MODE [MD] ITEST SCANINPUTS [I] or SCANOUTPUTS [O] or ADDRESS [ADDR] [A] or ROCKER [ROCK] [R] or LEDTEST [LED] [L] or DOORTEST [DOOR] [M]\r\n");
@@ -15,6 +15,8 @@
 
 #include "disk_state_definitions.h"
 #include "display_functions.h"
+#include "fpga_batch.h"
+#include "fpga_bus.h"
 //#include "tester_state_definitions.h" //commented-out 2/5/2025
 
 //#include "pico/stdlib.h"
@@ -123,50 +125,109 @@
 #define COMMAND_CLEAR_BIT 0x80
 
 #define BUF_LEN 2
+#define READBYTES_BLOCK_LEN 256 // bytes per burst block, must be even
+#define READBYTES_FRAME_BUF_LEN ((READBYTES_BLOCK_LEN * 3) / 2) // 3 frames for every 2 bytes
 //#define PICO_DEFAULT_SPI_CSN_PIN 17
 
 //Function Prototypes
 //void update_drive_address(Disk_State* ddisk);
 
-#ifdef PICO_DEFAULT_SPI_CSN_PIN
-static inline void cs_select()
+// *************** FPGA SPI Registers ***************
+//
+uint8_t read_write_spi_register(uint8_t reg, uint8_t data)
 {
-    asm volatile("nop \n nop \n nop");
-    gpio_put(PICO_DEFAULT_SPI_CSN_PIN, 0);  // Active low
-    asm volatile("nop \n nop \n nop");
+    return(fpga_bus_transfer(reg, data));
 }
 
-static inline void cs_deselect()
+void write_spi_register(uint8_t reg, uint8_t data)
 {
-    asm volatile("nop \n nop \n nop");
-    gpio_put(PICO_DEFAULT_SPI_CSN_PIN, 1);
-    asm volatile("nop \n nop \n nop");
+    fpga_bus_transfer(reg, data);
 }
-#endif
 
-// *************** FPGA SPI Registers ***************
+// *************** FPGA control register shadows ***************
+// Control registers 0 and 3 are kept in shadow copies so changing a bit is a single register write instead of a
+// readback and a write. select_head() runs for every sector in the read and write loops.
+// The shadows are loaded from the readback registers by shadow_registers_sync(), called from initialize_fpga() and
+// after anything else writes the registers. With SHADOW_REGISTER_CHECK set to 1 every update still reads the
+// register back first and reports a shadow that doesn't match.
+// The 0xA0 readback doesn't include support_5_bit_sector (register 0 bit 6), so only the bits in
+// CTRL_REG_READBACK_BITS are taken from the readback and bit 6 always comes from the shadow. The old read-modify-write
+// wrote bit 6 back as 0 on every register 0 update, which turned 5-bit sector support off again after the first
+// load_drive_address() or tester ready change. The shadow keeps the bit as set_5bit_support() left it.
 //
-uint8_t read_write_spi_register(uint8_t reg, uint8_t data)
+#ifndef SHADOW_REGISTER_CHECK
+#define SHADOW_REGISTER_CHECK 0
+#endif
+
+#define CTRL_REG_READBACK_BITS 0x3f     // register 0 bits that read back at 0xA0
+#define CTRL3_REG_READBACK_BITS 0x07    // register 3 bits that read back at 0xA3
+
+static uint8_t fpga_ctrl_reg_image;     // register 0, drive address and mode bits
+static uint8_t fpga_ctrl3_reg_image;    // register 3, head select and write protect
+static uint32_t shadow_updates;         // control register updates
+static uint32_t shadow_readbacks_saved; // readbacks the shadows made unnecessary
+static uint32_t shadow_mismatches;      // readbacks that didn't match the shadow, check mode only
+
+// queue for register sequences that are sent as one burst, see fpga_batch.cpp.
+// Used by one function at a time, and each one runs it before returning.
+static Fpga_Batch regbatch;
+
+// load the bits that read back into the shadows, the others keep their shadow value
+void shadow_registers_sync()
 {
-    uint8_t out_buf [BUF_LEN], in_buf [BUF_LEN];
-    uint8_t buf[2];
-    out_buf[0] = reg;
-    out_buf[1] = data;
-    cs_select();
-    spi_write_read_blocking (spi_default, out_buf, in_buf, 2);
-    cs_deselect();
-    return(in_buf[1]);
+    uint8_t readback = read_write_spi_register(SPI_READBACK_00_A0, 0);
+    fpga_ctrl_reg_image = (fpga_ctrl_reg_image & ~CTRL_REG_READBACK_BITS) | (readback & CTRL_REG_READBACK_BITS);
+    readback = read_write_spi_register(SPI_READBACK_00_A3, 0);
+    fpga_ctrl3_reg_image = (fpga_ctrl3_reg_image & ~CTRL3_REG_READBACK_BITS) | (readback & CTRL3_REG_READBACK_BITS);
 }
 
-void write_spi_register(uint8_t reg, uint8_t data)
+// resync the shadows after the REGISTER command wrote value to reg, the bits of a control register that don't read
+// back are taken from the value written
+void shadow_registers_written(int reg, int value)
+{
+    if(reg == SPI_DRIVE_ADDRESS_0)
+        fpga_ctrl_reg_image = value & 0xff;
+    else if(reg == SPI_CONTROL_3)
+        fpga_ctrl3_reg_image = value & 0xff;
+    shadow_registers_sync();
+}
+
+// clear then set bits in the shadow of a control register and return the new register value, the caller writes it
+static uint8_t shadow_update(uint8_t reg, uint8_t readback_reg, uint8_t* image, uint8_t clearbits, uint8_t setbits)
+{
+#if SHADOW_REGISTER_CHECK
+    uint8_t readbits = (readback_reg == SPI_READBACK_00_A0) ? CTRL_REG_READBACK_BITS : CTRL3_REG_READBACK_BITS;
+    uint8_t readback = read_write_spi_register(readback_reg, 0) & readbits;
+    if(readback != (*image & readbits)){
+        printf("###ERROR, control register %d reads 0x%x, shadow is 0x%x\r\n", reg, readback, *image & readbits);
+        shadow_mismatches++;
+        *image = (*image & ~readbits) | readback;
+    }
+#else
+    shadow_readbacks_saved++;
+#endif
+    *image = (*image & ~clearbits) | setbits;
+    shadow_updates++;
+    return(*image);
+}
+
+// clear then set bits in a control register and its shadow with one write
+static void update_control_register(uint8_t reg, uint8_t readback_reg, uint8_t* image, uint8_t clearbits, uint8_t setbits)
 {
-    uint8_t out_buf [BUF_LEN], in_buf [BUF_LEN];
-    uint8_t buf[2];
-    out_buf[0] = reg;
-    out_buf[1] = data;
-    cs_select();
-    spi_write_read_blocking (spi_default, out_buf, in_buf, 2);
-    cs_deselect();
+    write_spi_register(reg, shadow_update(reg, readback_reg, image, clearbits, setbits));
+}
+
+void shadow_registers_report(bool reset)
+{
+    printf("  control register updates %lu, SPI transactions saved %lu, shadow mismatches %lu%s\r\n", (unsigned long)shadow_updates,
+        (unsigned long)shadow_readbacks_saved, (unsigned long)shadow_mismatches, SHADOW_REGISTER_CHECK ? " (check mode)" : "");
+    printf("  register 0 = 0x%x, register 3 = 0x%x\r\n", fpga_ctrl_reg_image, fpga_ctrl3_reg_image);
+    if(reset){
+        shadow_updates = 0;
+        shadow_readbacks_saved = 0;
+        shadow_mismatches = 0;
+        printf("  counters cleared\r\n");
+    }
 }
 
 int read_drive_status1(){
@@ -214,89 +275,67 @@ void load_sector_address(int sect_addr)
 void load_drive_address(int d_addr)
 {
     //printf(" load_drive_address=%d\r\n", d_addr);
-    int tempctrlreg = read_write_spi_register(SPI_READBACK_00_A0, 0);
-    tempctrlreg = (tempctrlreg & ~DRIVE_ADDRESS_BITS) | d_addr;
-    write_spi_register(SPI_DRIVE_ADDRESS_0, tempctrlreg & 0xff);
+    update_control_register(SPI_DRIVE_ADDRESS_0, SPI_READBACK_00_A0, &fpga_ctrl_reg_image, DRIVE_ADDRESS_BITS, d_addr & 0xff);
 }
 
 void set_rk11de_mode()
 {
     printf("  set_rk11de_mode\r\n");
-    int tempctrlreg = read_write_spi_register(SPI_READBACK_00_A0, 0);
-    tempctrlreg = tempctrlreg | RK11DE_MODE_BIT;
-    write_spi_register(SPI_DRIVE_ADDRESS_0, tempctrlreg & 0xff);
+    update_control_register(SPI_DRIVE_ADDRESS_0, SPI_READBACK_00_A0, &fpga_ctrl_reg_image, 0, RK11DE_MODE_BIT);
 }
 
 void clear_rk11de_mode()
 {
     printf("  clear_rk11de_mode\r\n");
-    int tempctrlreg = read_write_spi_register(SPI_READBACK_00_A0, 0);
-    tempctrlreg = tempctrlreg & ~RK11DE_MODE_BIT;
-    write_spi_register(SPI_DRIVE_ADDRESS_0, tempctrlreg & 0xff);
+    update_control_register(SPI_DRIVE_ADDRESS_0, SPI_READBACK_00_A0, &fpga_ctrl_reg_image, RK11DE_MODE_BIT, 0);
 }
 
 void set_wtprot_mode()
 {
     printf("  set_wtprot_mode\r\n");
-    int tempctrlreg = read_write_spi_register(SPI_READBACK_00_A3, 0);
-    tempctrlreg = tempctrlreg | WRITE_PROTECT_BIT;
-    write_spi_register(SPI_CONTROL_3, tempctrlreg & 0xff);
+    update_control_register(SPI_CONTROL_3, SPI_READBACK_00_A3, &fpga_ctrl3_reg_image, 0, WRITE_PROTECT_BIT);
 }
 
 void clear_wtprot_mode()
 {
     printf("  clear_wtprot_mode\r\n");
-    int tempctrlreg = read_write_spi_register(SPI_READBACK_00_A3, 0);
-    tempctrlreg = tempctrlreg & ~WRITE_PROTECT_BIT;
-    write_spi_register(SPI_CONTROL_3, tempctrlreg & 0xff);
+    update_control_register(SPI_CONTROL_3, SPI_READBACK_00_A3, &fpga_ctrl3_reg_image, WRITE_PROTECT_BIT, 0);
 }
 
 void set_tester_ready()
 {
     printf("  set_tester_ready\r\n");
-    int tempctrlreg = read_write_spi_register(SPI_READBACK_00_A0, 0);
-    tempctrlreg = tempctrlreg | TESTER_READY_BIT;
-    write_spi_register(SPI_DRIVE_ADDRESS_0, tempctrlreg & 0xff);
+    update_control_register(SPI_DRIVE_ADDRESS_0, SPI_READBACK_00_A0, &fpga_ctrl_reg_image, 0, TESTER_READY_BIT);
 }
 
 void clear_tester_ready()
 {
     printf("  clear_tester_ready\r\n");
-    int tempctrlreg = read_write_spi_register(SPI_READBACK_00_A0, 0);
-    tempctrlreg = tempctrlreg & ~TESTER_READY_BIT;
-    write_spi_register(SPI_DRIVE_ADDRESS_0, tempctrlreg & 0xff);
+    update_control_register(SPI_DRIVE_ADDRESS_0, SPI_READBACK_00_A0, &fpga_ctrl_reg_image, TESTER_READY_BIT, 0);
 }
 
 void set_on_cyl_indicator()
 {
     printf("  set_on_cyl_indicator\r\n");
-    int tempctrlreg = read_write_spi_register(SPI_READBACK_00_A0, 0);
-    tempctrlreg = tempctrlreg | ON_CYL_INDICATOR_BIT;
-    write_spi_register(SPI_DRIVE_ADDRESS_0, tempctrlreg & 0xff);
+    update_control_register(SPI_DRIVE_ADDRESS_0, SPI_READBACK_00_A0, &fpga_ctrl_reg_image, 0, ON_CYL_INDICATOR_BIT);
 }
 
 void clear_on_cyl_indicator()
 {
     printf("  clear_on_cyl_indicator\r\n");
-    int tempctrlreg = read_write_spi_register(SPI_READBACK_00_A0, 0);
-    tempctrlreg = tempctrlreg & ~ON_CYL_INDICATOR_BIT;
-    write_spi_register(SPI_DRIVE_ADDRESS_0, tempctrlreg & 0xff);
+    update_control_register(SPI_DRIVE_ADDRESS_0, SPI_READBACK_00_A0, &fpga_ctrl_reg_image, ON_CYL_INDICATOR_BIT, 0);
 }
 
 void set_5bit_support()
 {
     printf("  set_5bit_support\r\n");
-    int tempctrlreg = read_write_spi_register(SPI_READBACK_00_A0, 0);
-    tempctrlreg = tempctrlreg | SUPPORT_5BIT_BIT;
-    write_spi_register(SPI_DRIVE_ADDRESS_0, tempctrlreg & 0xff);
+    update_control_register(SPI_DRIVE_ADDRESS_0, SPI_READBACK_00_A0, &fpga_ctrl_reg_image, 0, SUPPORT_5BIT_BIT);
 }
 
 void clear_5bit_support()
 {
     printf("  clear_5bit_support\r\n");
-    int tempctrlreg = read_write_spi_register(SPI_READBACK_00_A0, 0);
-    tempctrlreg = tempctrlreg & ~SUPPORT_5BIT_BIT;
-    write_spi_register(SPI_DRIVE_ADDRESS_0, tempctrlreg & 0xff);
+    update_control_register(SPI_DRIVE_ADDRESS_0, SPI_READBACK_00_A0, &fpga_ctrl_reg_image, SUPPORT_5BIT_BIT, 0);
 }
 
 void led_from_bits(int walking_bit){
@@ -315,35 +354,39 @@ void assert_outputs(int step_count, int hw_version){
         clock_bit = 8;
     int walking_one = 1 << (step_count & 0x7);
     if((step_count >= 0) && (step_count <= 7)){
-        write_spi_register(SPI_PREAMBLE1_7, walking_one);
-        write_spi_register(SPI_PREAMBLE2_8, 0);
+        fpga_batch_write(&regbatch, SPI_PREAMBLE1_7, walking_one);
+        fpga_batch_write(&regbatch, SPI_PREAMBLE2_8, 0);
         if((step_count & 1) == 1)
-            write_spi_register(SPI_DATA_LENH_9, clock_bit);
+            fpga_batch_write(&regbatch, SPI_DATA_LENH_9, clock_bit);
         else
-            write_spi_register(SPI_DATA_LENH_9, 0);
+            fpga_batch_write(&regbatch, SPI_DATA_LENH_9, 0);
     }
     else if((step_count >= 8) && (step_count <= 15)){
-        write_spi_register(SPI_PREAMBLE1_7, 0);
-        write_spi_register(SPI_PREAMBLE2_8, walking_one);
+        fpga_batch_write(&regbatch, SPI_PREAMBLE1_7, 0);
+        fpga_batch_write(&regbatch, SPI_PREAMBLE2_8, walking_one);
         if((step_count & 1) == 1)
-            write_spi_register(SPI_DATA_LENH_9, clock_bit);
+            fpga_batch_write(&regbatch, SPI_DATA_LENH_9, clock_bit);
         else
-            write_spi_register(SPI_DATA_LENH_9, 0);
+            fpga_batch_write(&regbatch, SPI_DATA_LENH_9, 0);
     }
     else if((step_count >= 16) && (step_count <= 21)){
-        write_spi_register(SPI_PREAMBLE1_7, 0);
-        write_spi_register(SPI_PREAMBLE2_8, 0);
+        fpga_batch_write(&regbatch, SPI_PREAMBLE1_7, 0);
+        fpga_batch_write(&regbatch, SPI_PREAMBLE2_8, 0);
         if((step_count & 1) == 1)
-            write_spi_register(SPI_DATA_LENH_9, walking_one | clock_bit);
+            fpga_batch_write(&regbatch, SPI_DATA_LENH_9, walking_one | clock_bit);
         else
-            write_spi_register(SPI_DATA_LENH_9, walking_one);
+            fpga_batch_write(&regbatch, SPI_DATA_LENH_9, walking_one);
     }
+    fpga_batch_run(&regbatch);
 }
 
 int read_test_inputs(){
-    int retval = read_write_spi_register(SPI_TEST_MODE_GRP1_94, 0);
-    retval |= (read_write_spi_register(SPI_TEST_MODE_GRP2_95, 0) & 0xff) << 8;
-    retval |= (read_write_spi_register(SPI_TEST_MODE_GRP3_96, 0) & 0xff) << 16;
+    uint8_t grp[3];
+    fpga_batch_read(&regbatch, SPI_TEST_MODE_GRP1_94, &grp[0]);
+    fpga_batch_read(&regbatch, SPI_TEST_MODE_GRP2_95, &grp[1]);
+    fpga_batch_read(&regbatch, SPI_TEST_MODE_GRP3_96, &grp[2]);
+    fpga_batch_run(&regbatch);
+    int retval = grp[0] | (grp[1] << 8) | (grp[2] << 16);
     return(retval);
 }
 
@@ -378,11 +421,17 @@ int read_board_version()
     return(retval);
 }
 
+static void batch_ram_address(int ramaddress)
+{
+    fpga_batch_write(&regbatch, SPI_DRAM_ADDR_5, (ramaddress >> 16) & 0xff);
+    fpga_batch_write(&regbatch, SPI_DRAM_ADDR_5, (ramaddress >> 8)  & 0xff);
+    fpga_batch_write(&regbatch, SPI_DRAM_ADDR_5,  ramaddress        & 0xff);
+}
+
 void load_ram_address(int ramaddress)
 {
-    write_spi_register(SPI_DRAM_ADDR_5, (ramaddress >> 16) & 0xff);
-    write_spi_register(SPI_DRAM_ADDR_5, (ramaddress >> 8)  & 0xff);
-    write_spi_register(SPI_DRAM_ADDR_5,  ramaddress        & 0xff);
+    batch_ram_address(ramaddress);
+    fpga_batch_run(&regbatch);
 }
 
 void storebyte(int bytevalue)
@@ -397,6 +446,43 @@ int readbyte()
 
 }
 
+// read a block of bytes from the FPGA DRAM starting at the address loaded by load_ram_address()
+// The FPGA latches each register access on the rising edge of CS, so CS can't be held low for the whole
+// block. Instead the FPGA link is used as 16-bit frames with CS pulsed high between frames by the hardware.
+// Each frame is one complete [register][data] access and the read byte comes back in the low half of the
+// received frame. With the PIO link the read stream stores the DRAM bytes straight into the buffer.
+// The FPGA fetches the next DRAM word after the high byte is read, so a read of the function ID register,
+// which has no side effects, follows every word to give the DRAM controller time to fetch the next word.
+void readbytes(uint8_t* bp, int count)
+{
+#if FPGA_BUS_PIO
+    fpga_bus_dram_read(bp, count);
+#else
+    static uint16_t txframes[READBYTES_FRAME_BUF_LEN];
+    static uint16_t rxframes[READBYTES_FRAME_BUF_LEN];
+    static bool txframes_built = false;
+
+    if (!txframes_built){
+        for (int i = 0; i < READBYTES_FRAME_BUF_LEN; i++)
+            txframes[i] = ((i % 3) == 2) ? (SPI_FUNCT_ID_89 << 8) : (SPI_DRAMREAD_88 << 8);
+        txframes_built = true;
+    }
+    fpga_bus_frames_begin();
+    while (count > 0){
+        // the block size is always even except possibly the last one, so every block starts on a low byte
+        int n = (count > READBYTES_BLOCK_LEN) ? READBYTES_BLOCK_LEN : count;
+        int nframes = n + (n / 2);
+        spi_write16_read16_blocking(spi_default, txframes, rxframes, nframes);
+        for (int i = 0; i < nframes; i++){
+            if ((i % 3) != 2)
+                *bp++ = rxframes[i] & 0xff;
+        }
+        count -= n;
+    }
+    fpga_bus_frames_end();
+#endif
+}
+
 void assert_bus_restore(){
     gpio_put(BUS_RESTORE, GPIO_OFF);
 }
@@ -405,8 +491,8 @@ void deassert_bus_restore(){
     gpio_put(BUS_RESTORE, GPIO_ON);
 }
 
+// the Restore line is set first so the cylinder address and the Seek command go out in one burst
 void seek_to_cylinder(int cylinder, bool restore){
-    write_spi_register(SPI_CYLINDER_ADDRESS_1, cylinder & 0xff);
     //int tempctrlreg = read_write_spi_register(SPI_READBACK_00_A3, 0);
     if(restore) // if restore command in seek list then set the Restore bit
         //tempctrlreg = tempctrlreg | RESTORE_BIT; 
@@ -416,16 +502,32 @@ void seek_to_cylinder(int cylinder, bool restore){
        deassert_bus_restore();
     
     //write_spi_register(SPI_CONTROL_3, tempctrlreg & 0xff); // write back the Restore bit
-    write_spi_register(SPI_COMMAND_4, SEEK_COMMAND_BIT); // issue the Seek command
+    fpga_batch_write(&regbatch, SPI_CYLINDER_ADDRESS_1, cylinder & 0xff);
+    fpga_batch_write(&regbatch, SPI_COMMAND_4, SEEK_COMMAND_BIT); // issue the Seek command
+    fpga_batch_run(&regbatch);
 }
 
 void select_head(int head){
     //printf(" select_head%d\r\n", head);
-    int tempreg = read_write_spi_register(SPI_READBACK_00_A3, 0);
-    tempreg = tempreg & ~HEAD_SELECT_BIT; // clear the head bit in tempreg
-    if(head != 0) // if the head bit parameter is non-zero then set the head bit in tempreg
-        tempreg = tempreg | HEAD_SELECT_BIT;
-    write_spi_register(SPI_CONTROL_3, tempreg & 0xff); //write-back the register value with the head bit 
+    // clear the head bit, then set it if the head parameter is non-zero
+    update_control_register(SPI_CONTROL_3, SPI_READBACK_00_A3, &fpga_ctrl3_reg_image, HEAD_SELECT_BIT, (head != 0) ? HEAD_SELECT_BIT : 0);
+}
+
+// select the head, load the sector address and then the DRAM address, in one burst
+// The usual setup before the sector data is stored or read and write_sector() or read_sector() is called.
+void setup_sector_access(int head, int sector, int ramaddress){
+    fpga_batch_write(&regbatch, SPI_CONTROL_3, shadow_update(SPI_CONTROL_3, SPI_READBACK_00_A3, &fpga_ctrl3_reg_image, HEAD_SELECT_BIT, (head != 0) ? HEAD_SELECT_BIT : 0));
+    fpga_batch_write(&regbatch, SPI_SECTOR_ADDRESS_2, sector & 0xff);
+    batch_ram_address(ramaddress);
+    fpga_batch_run(&regbatch);
+}
+
+// select the head, load the sector address and issue the Read Sector command, in one burst
+void read_sector_at(int head, int sector){
+    fpga_batch_write(&regbatch, SPI_CONTROL_3, shadow_update(SPI_CONTROL_3, SPI_READBACK_00_A3, &fpga_ctrl3_reg_image, HEAD_SELECT_BIT, (head != 0) ? HEAD_SELECT_BIT : 0));
+    fpga_batch_write(&regbatch, SPI_SECTOR_ADDRESS_2, sector & 0xff);
+    fpga_batch_write(&regbatch, SPI_COMMAND_4, READ_SECTOR_COMMAND_BIT);
+    fpga_batch_run(&regbatch);
 }
 
 void write_sector(){
@@ -457,32 +559,33 @@ void command_clear()
 //
 void update_fpga_disk_state(Disk_State* ddisk){
     if(ddisk->bitRate == 1440000){
-        write_spi_register(SPI_BITCLKDIV_CP_D, 14);
-        write_spi_register(SPI_BITCLKDIV_DP_E, 14);
-        write_spi_register(SPI_BITPLSWIDTH_F, 6);
+        fpga_batch_write(&regbatch, SPI_BITCLKDIV_CP_D, 14);
+        fpga_batch_write(&regbatch, SPI_BITCLKDIV_DP_E, 14);
+        fpga_batch_write(&regbatch, SPI_BITPLSWIDTH_F, 6);
     }
     else if(ddisk->bitRate == 1545000){
-        write_spi_register(SPI_BITCLKDIV_CP_D, 13);
-        write_spi_register(SPI_BITCLKDIV_DP_E, 13);
-        write_spi_register(SPI_BITPLSWIDTH_F, 5);
+        fpga_batch_write(&regbatch, SPI_BITCLKDIV_CP_D, 13);
+        fpga_batch_write(&regbatch, SPI_BITCLKDIV_DP_E, 13);
+        fpga_batch_write(&regbatch, SPI_BITPLSWIDTH_F, 5);
     }
     else if(ddisk->bitRate == 1600000){
-        write_spi_register(SPI_BITCLKDIV_CP_D, 12);
-        write_spi_register(SPI_BITCLKDIV_DP_E, 13);
-        write_spi_register(SPI_BITPLSWIDTH_F, 5);
+        fpga_batch_write(&regbatch, SPI_BITCLKDIV_CP_D, 12);
+        fpga_batch_write(&regbatch, SPI_BITCLKDIV_DP_E, 13);
+        fpga_batch_write(&regbatch, SPI_BITPLSWIDTH_F, 5);
     }
     else
         printf("###ERROR, unknown disk bitRate %d\r\n", ddisk->bitRate);
-    write_spi_register(SPI_PREAMBLE1_7, ddisk->preamble1Length);
-    write_spi_register(SPI_PREAMBLE2_8, ddisk->preamble2Length);
-    write_spi_register(SPI_DATA_LENH_9, (ddisk->bit_times_data_bits_after_start >> 8) & 0xff);
-    write_spi_register(SPI_DATA_LENL_A, ddisk->bit_times_data_bits_after_start & 0xff);
-    write_spi_register(SPI_POSTAMBLE_B, ddisk->postambleLength);
+    fpga_batch_write(&regbatch, SPI_PREAMBLE1_7, ddisk->preamble1Length);
+    fpga_batch_write(&regbatch, SPI_PREAMBLE2_8, ddisk->preamble2Length);
+    fpga_batch_write(&regbatch, SPI_DATA_LENH_9, (ddisk->bit_times_data_bits_after_start >> 8) & 0xff);
+    fpga_batch_write(&regbatch, SPI_DATA_LENL_A, ddisk->bit_times_data_bits_after_start & 0xff);
+    fpga_batch_write(&regbatch, SPI_POSTAMBLE_B, ddisk->postambleLength);
     //write_spi_register(<NO_REGISTER_FOR_THIS_YET>, ddisk->numberOfCylinders); // FPGA is coded with a constant == 203
-    write_spi_register(SPI_SECTPERTRK_C, ddisk->numberOfSectorsPerTrack);
+    fpga_batch_write(&regbatch, SPI_SECTPERTRK_C, ddisk->numberOfSectorsPerTrack);
     //write_spi_register(<NO_REGISTER_FOR_THIS_YET>, ddisk->numberOfHeads); // FPGA is coded with a constant of 2 heads
-    write_spi_register(SPI_USECPERSECTH_10, ddisk->microsecondsPerSector >> 8);
-    write_spi_register(SPI_USECPERSECTL_11, ddisk->microsecondsPerSector & 0xff);
+    fpga_batch_write(&regbatch, SPI_USECPERSECTH_10, ddisk->microsecondsPerSector >> 8);
+    fpga_batch_write(&regbatch, SPI_USECPERSECTL_11, ddisk->microsecondsPerSector & 0xff);
+    fpga_batch_run(&regbatch);
     if(ddisk->rk11d)
         set_rk11de_mode();
     else
@@ -688,26 +791,8 @@ void initialize_gpio()
 
 void initialize_spi()
 {
-    // initialize SPI to run at 25 MHz
-    spi_init(spi_default, 25 * 1000 * 1000);
-    gpio_set_function(PICO_DEFAULT_SPI_SCK_PIN, GPIO_FUNC_SPI);
-    gpio_set_function(PICO_DEFAULT_SPI_TX_PIN, GPIO_FUNC_SPI);
-    gpio_set_function(PICO_DEFAULT_SPI_RX_PIN, GPIO_FUNC_SPI);
-    // SPI configuration needs to be CPHA = 0, CPOL = 0
-    // resting state of the CPI clock is low, data is captured in the RPi Pico and in the FPGA on rising edge
-    // so data needs to change on the falling edge and be set up half a clock prior to the first clock rising edge
-    //spi_set_format(spi_default, )
-
-    // Make the SPI pins available to picotool
-    bi_decl(bi_2pins_with_func(PICO_DEFAULT_SPI_TX_PIN, PICO_DEFAULT_SPI_SCK_PIN, GPIO_FUNC_SPI));
-
-    // Chip select is active-low, so we'll initialise it to a driven-high state
-    gpio_init(PICO_DEFAULT_SPI_CSN_PIN);
-    gpio_set_dir(PICO_DEFAULT_SPI_CSN_PIN, GPIO_OUT);
-    gpio_put(PICO_DEFAULT_SPI_CSN_PIN, 1);
-
-    // Make the CS pin available to picotool
-    bi_decl(bi_1pin_with_name(PICO_DEFAULT_SPI_CSN_PIN, "SPI CS"));
+    // the CPU to FPGA link, run by a PIO state machine or by the SPI port, see fpga_bus.cpp
+    fpga_bus_init();
 }
 
 void initialize_uart()
@@ -729,7 +814,11 @@ void initialize_uart()
 
 void initialize_fpga(Disk_State* ddisk)
 {
-    //fpga_ctrl_reg_image = 0;
+    // the FPGA has just been reset, start the shadows from its registers. The bits that don't read back start at 0,
+    // main() sets or clears 5-bit sector support right after this.
+    fpga_ctrl_reg_image = 0;
+    fpga_ctrl3_reg_image = 0;
+    shadow_registers_sync();
     //update_drive_address(ddisk);
     load_drive_address(0); // initialize drive address to zero, initially
     set_tester_ready();
@@ -26,6 +26,7 @@ void initialize_spi();
 void load_ram_address(int ramaddress);
 void storebyte(int bytevalue);
 int readbyte();
+void readbytes(uint8_t* bp, int count);
 bool is_it_a_tester();
 int read_board_version();
 
@@ -43,6 +44,9 @@ void assert_GP6();
 void deassert_GP6();
 
 uint8_t read_write_spi_register(uint8_t reg, uint8_t data);
+void shadow_registers_sync();
+void shadow_registers_written(int reg, int value);
+void shadow_registers_report(bool reset);
 void load_sector_address(int sect_addr);
 void load_drive_address(int dr_addr);
 void set_rk11de_mode();
@@ -60,6 +64,8 @@ void microSD_LED_off();
 
 void seek_to_cylinder(int cylinder, bool restore);
 void select_head(int head);
+void setup_sector_access(int head, int sector, int ramaddress);
+void read_sector_at(int head, int sector);
 void write_sector();
 void read_sector();
 void command_clear();